@@ -2,17 +2,46 @@
 #include <string>
 #include <ctime>
 #include <csignal>
-#include <sstream>
 #include <fstream>
 #include <locale>
 #include <iomanip>
-
+#include <cstdarg>
+#include <climits>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#ifndef SIMULATOR
 #include <wiringPi.h>
-#include <wiringPiSPI.h>
+#endif
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <yaml.h>
 #include <math.h>
+#include <pthread.h>
+#include <poll.h>
+#include <semaphore.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sched.h>
+#include <malloc.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/ioctl.h>
+#include <linux/spi/spidev.h>
+
+#ifdef USE_ALSA
+#include <alsa/asoundlib.h>
+#endif
 
 using namespace std;
 
@@ -21,14 +50,118 @@ using namespace std;
 #define SPI_SPEED 3000000
 #define LED_BRIGHTNESS 31
 
+// output transfer, see OutputLutInit. the buffers are gamma encoded, the
+// dimmer and color balance scale the light that comes out
+#define OUTPUT_GAMMA 2.2
+#define OUTPUT_DIMMER 1.0
+// channels QuantizeLight does at a time, the light and dither arrays have
+// this much spare at the end
+#define QUANTIZE_BLOCK 16
+#define DITHER_BENCH_FRAMES 16
+
+// power limit, see PowerLimit. what the supply feeding the strip can give,
+// 0 for no limit, and the current of one LED when dark and per channel at
+// full light. after limiting the light comes back POWER_RELEASE a frame
+#define POWER_BUDGET_AMPS 20.0
+#define LED_IDLE_MA 1.0
+#define LED_CHANNEL_MA 20.0
+#define POWER_RELEASE (1.0 / 64)
+#define POWER_BENCH_FRAMES 1200
+
 #define PI 3.14159265
+// LEDs on our wall, the hot buffer kernels are specialized for this count.
+// layout.conf can describe a different install of up to MAX_LEDS
 #define NUM_LEDS 646
+#define MAX_LEDS 1000
+#define LAYOUT_SEGMENTS 16
+#define LAYOUT_NAME_SIZE 32
 #define FADE_VAL 1
 #define FAST_FADE_VAL 16
 #define EFFECT_DELAY 120
-#define WAIT_DELAY 30
 #define PERSONAL_EFFECT_TIME 600
 
+// badge swipes, see InSemaphor. each person queued gets PERSONAL_EFFECT_TIME
+// in turns of PERSONAL_SLICE seconds, a repeat swipe updates their colors
+#define SEMAPHOR_DIR "/var/www/html/bl_semaphor"
+#define PERSONAL_SLICE 120
+#define TRIGGER_QUEUE_SIZE 32
+#define TRIGGER_USERS 16
+#define TRIGGER_USER_SIZE 32
+
+// built-in badge endpoint taking the same POST as badger_access.php, see --http
+#define HTTP_PORT 8080
+#define HTTP_CLIENTS 16
+#define HTTP_REQUEST_SIZE 2048
+#define HTTP_BENCH_SECONDS 5
+#define ACCESS_LOG "/var/www/html/log.txt"
+
+// longest the lights-off idle sleeps without a schedule change, in seconds
+#define IDLE_MAX_SLEEP (8 * 24 * 3600)
+
+// days of schedule expanded into the change list at a time, see ScheduleCompile
+#define SCHEDULE_WINDOW 400
+#define SCHEDULE_BENCH_EVENTS 5000
+// time for the LED supply to come up after pin 2 goes high, in microseconds
+#define PSU_WARMUP 100000
+
+// frames two effects overlap for when switching effects
+#define TRANSITION_FRAMES 48
+// shorter transition into a personal effect right after a swipe, see --trigger-transition
+#define TRIGGER_TRANSITION_FRAMES 6
+#define TRIGGER_BENCH_SAMPLES 100
+// frame rate the render loop has to hold, used by the benchmarks
+#define TARGET_FPS 60
+
+// real time mode (--rt): the render and transmit threads run SCHED_FIFO
+// pinned to these CPUs (--rt-cpus RENDER,TRANSMIT) with memory locked
+#define RT_PRIORITY 50
+#define RT_RENDER_CPU 2
+#define RT_TRANSMIT_CPU 3
+// stack and heap touched up front so the frame loop doesn't page fault
+#define RT_STACK_PREFAULT (256 * 1024)
+#define RT_HEAP_PREFAULT (4 * 1024 * 1024)
+#define JITTER_BENCH_SECONDS 30
+
+// prometheus textfile collector output, rewritten every METRICS_INTERVAL seconds
+#define METRICS_FILE "/var/lib/prometheus/node-exporter/blinkenlights.prom"
+#define METRICS_INTERVAL 15
+
+// build with -DTRACING to record frame stages, dumped as chrome trace json on SIGUSR2
+#define TRACE_FILE "/tmp/blinkenlights-trace.json"
+#define TRACE_DUMP_SECONDS 10
+#define TRACE_EVENTS 32768
+#define TRACE_THREADS 16
+
+// shared memory ring external processes can hand frames to, see RunExternal
+#define SHM_NAME "/blinkenlights"
+#define SHM_SLOTS 8
+#define SHM_MAGIC 0x424c4e4b
+
+// simulator build (-DSIMULATOR), ansi output columns and refresh rate
+#define SIM_ANSI_WIDTH 160
+#define SIM_ANSI_FPS 30
+
+// audio input for the color organ, see --audio
+#define AUDIO_RATE 44100
+#define AUDIO_FFT_SIZE 1024
+#define AUDIO_HOP 512
+#define AUDIO_BANDS 8
+#define AUDIO_BENCH_SECONDS 5
+
+// log records are queued by the render loop and written by a background thread
+#define LOG_QUEUE_SIZE 256
+#define LOG_MESSAGE_SIZE 112
+// a call site logs the same text at most once per LOG_RATE_LIMIT microseconds
+#define LOG_RATE_LIMIT 1000000
+
+// log levels
+#define LOG_DEBUG 1
+#define LOG_INFO 2
+#define LOG_WARN 3
+#define LOG_ERROR 4
+// not a level, appended to ACCESS_LOG as is and never rate limited
+#define LOG_ACCESS 5
+
 // mix effects
 #define HARD_MIX 1
 #define SUBTRACT 2
@@ -36,9 +169,18 @@ using namespace std;
 #define MAX 4
 #define REPLACE 5
 
-// number of effects
-#define EFFECTS 12
-#define CUSTOM_EFFECTS 9
+// transition effects
+#define CROSSFADE 1
+#define WIPE 2
+#define DISSOLVE 3
+
+#define TRANSITIONS 3
+
+// number of effects, the ones from RANDOM_EFFECTS on only run when the
+// schedule names them
+#define EFFECTS 21
+#define RANDOM_EFFECTS 20
+#define CUSTOM_EFFECTS 17
 
 #define STATIC_EFFECTS 2
 
@@ -57,374 +199,2933 @@ const static string effects[] = {
     "LavaLamp",
     "ColorOrgan",
     "SlowSparkle",
-    "SlowTwoColorSparkle"
+    "SlowTwoColorSparkle",
+    // spatial, from the layout positions
+    "RadialSweep",
+    "PlaneWave",
+    "DoorWave",
+    // particles
+    "Fireworks",
+    "Rain",
+    "Comets",
+    // per LED expression from shaders.conf
+    "Shader",
+    // gradients from palettes.conf
+    "Palette",
+    // scheduled only: a GIF or PPM file from the schedule's media
+    "Playback"
 };
 
-uint8_t display_buffer[NUM_LEDS * 3];
-uint8_t buffer1[NUM_LEDS * 3];
-uint8_t buffer2[NUM_LEDS * 3];
-uint8_t buffer3[NUM_LEDS * 3];
-uint8_t buffer4[NUM_LEDS * 3];
+// customizable effects that put the personal colors on the wall from their
+// first frame, used for the turn right after a swipe
+#define SWIPE_EFFECTS 4
+const static int swipe_effects[SWIPE_EFFECTS] = { 3, 4, 5, 6 };
 
-int signaled = 0;
-uint8_t lights_on = 0;
+// render pool: threads sharing per pixel work, --render-threads to change
+#define RENDER_THREADS 4
+#define MAX_RENDER_THREADS 4
 
-time_t personal_effect_until;
-uint8_t p_r1, p_g1, p_b1, p_r2, p_g2, p_b2;
+// particles, one array per property so the per frame update is a few
+// straight loops over floats. positions and sizes are in LEDs and kept
+// fractional, speeds are LEDs per frame
+#define MAX_PARTICLES 4096
+#define PARTICLE_FOREVER 1e9f
 
-// functions
+// ParticleRender blend modes
+#define PARTICLE_MAX 0
+#define PARTICLE_ADD 1
 
-void signalHandler(int signum)
+// LEDs per render pool chunk, 6 cache lines of accum
+#define PARTICLE_CHUNK 32
+#define PARTICLE_CHUNKS ((MAX_LEDS + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK)
+// fewer particles than this are drawn on the render thread
+#define PARTICLE_POOL_MIN 256
+
+struct particle_system
 {
-  signaled = signum;
-  cout << "signal: " << signaled << endl;
-}
+  int count;
+  // wrap round the strip instead of dropping off the ends
+  uint8_t wrap;
+  // speed kept from one frame to the next
+  float drag;
+
+  float pos[MAX_PARTICLES];
+  float vel[MAX_PARTICLES];
+  float size[MAX_PARTICLES];
+  float growth[MAX_PARTICLES];
+  // frames to live, brightness 0..1 and what it's multiplied by each frame
+  float life[MAX_PARTICLES];
+  float bright[MAX_PARTICLES];
+  float fade[MAX_PARTICLES];
+  float r[MAX_PARTICLES];
+  float g[MAX_PARTICLES];
+  float b[MAX_PARTICLES];
+  uint8_t group[MAX_PARTICLES];
+
+  // rendered particles, BGR like the LED buffers
+  alignas(64) float accum[MAX_LEDS * 3];
+
+  // particles being rendered sorted by the chunk their middle is in
+  uint16_t bins[MAX_PARTICLES];
+  int bin_start[PARTICLE_CHUNKS + 1];
+};
 
-void DisplayBuffer(uint8_t *buffer)
+// shaders
+//
+// an expression like hsv(i/N + t*0.1, 1, sin(i*0.05+t)) is parsed once into
+// a tree with the constant parts folded, then turned into two programs: one
+// run once per frame for everything that doesn't depend on the LED (t, N,
+// the colors) and one run over SHADER_BATCH LEDs at a time, each
+// instruction a loop over a batch of floats.
+#define SHADER_NAME_SIZE 32
+#define SHADER_TEXT_SIZE 256
+#define SHADER_NODES 128
+#define SHADER_BATCH 64
+
+// shader ops, variables first
+#define SH_CONST 0
+#define SH_I 1
+#define SH_N 2
+#define SH_T 3
+#define SH_X 4
+#define SH_Y 5
+#define SH_ANGLE 6
+#define SH_PARAM 7
+#define SH_NEG 8
+#define SH_ADD 9
+#define SH_SUB 10
+#define SH_MUL 11
+#define SH_DIV 12
+#define SH_MOD 13
+#define SH_POW 14
+#define SH_SIN 15
+#define SH_COS 16
+#define SH_ABS 17
+#define SH_FLOOR 18
+#define SH_FRACT 19
+#define SH_SQRT 20
+#define SH_MIN 21
+#define SH_MAX 22
+#define SH_STEP 23
+#define SH_CLAMP 24
+#define SH_MIX 25
+
+struct shader_node
 {
-  uint8_t led_frame[4];
+  uint8_t op, uniform, broadcast, emitted;
+  int16_t args[3];
+  // constant value, or which color for SH_PARAM
+  float value;
+};
 
-  uint8_t brightness;
+struct shader_program
+{
+  char name[SHADER_NAME_SIZE];
+  char text[SHADER_TEXT_SIZE];
 
-  // max brightness to reduce end of strip flicker
-  brightness = LED_BRIGHTNESS;
+  int nodes_used;
+  shader_node nodes[SHADER_NODES];
 
-  // start of frame all 0x00
-  uint8_t buf[1];
-  for(int i = 0; i < 4; i++) {
-    buf[0] = 0x00;
-    wiringPiSPIDataRW(0, buf, 1);
-  }
+  // node numbers in the order they're run, per frame then per batch
+  int uniform_len, varying_len;
+  int16_t uniform_code[SHADER_NODES];
+  int16_t varying_code[SHADER_NODES];
 
-  // write out frame
-  for(int i = 0; i < NUM_LEDS; i++)
-  {
-    led_frame[0] = 0b11100000 | (0b00011111 & brightness);
+  // nodes with the red, green and blue or hue, saturation and value
+  int16_t out[3];
+  uint8_t hsv;
+};
 
-    led_frame[1] = buffer[i*3];
-    led_frame[2] = buffer[i*3+1];
-    led_frame[3] = buffer[i*3+2];
+// palettes
+//
+// 256 colors made once from a few evenly spaced colors, going round from the
+// last back to the first, so effects draw a gradient with one table lookup
+// per LED. the position along a palette is 8.24 fixed point, the top byte is
+// the entry. entries are in buffer order, blue, green, red.
+#define PALETTE_SIZE 256
+#define PALETTE_NAME_SIZE 32
+#define PALETTE_STOPS 16
+#define PALETTE_BENCH_FRAMES 10000
+
+// how the colors between stops are worked out
+#define BLEND_RGB 0
+#define BLEND_HSV 1
+#define BLEND_OKLAB 2
+
+struct palette
+{
+  char name[PALETTE_NAME_SIZE];
+  uint8_t entries[PALETTE_SIZE * 3];
+};
 
-    wiringPiSPIDataRW(0, led_frame, 4);
-  }
+// media playback
+//
+// GIFs and PPM streams (raw RGB video, ffmpeg's -f image2pipe -c:v ppm) are
+// decoded a frame at a time by the media thread into a small ring of frames
+// already resampled to the LEDs. a file with several frames is mapped onto
+// the wall by LED position, a single image is a sprite sheet played a row
+// per frame along the strip.
+#define PLAYBACK_EFFECT 20
+#define MEDIA_RING 4
+#define MEDIA_PATH_SIZE 256
+// biggest frame decoded, 1920x1080 fits
+#define MEDIA_MAX_PIXELS (1 << 21)
+// frame rate of PPM streams and sprite sheet rows, GIFs have their own
+#define MEDIA_FPS 30
+#define MEDIA_BENCH_FRAMES 300
+
+#define MEDIA_GIF 1
+#define MEDIA_PPM 2
+
+// hands a resampled frame on with how many microseconds to show it,
+// returns 0 to stop decoding
+typedef uint8_t (*media_sink)(void *ctx, const uint8_t *leds, int delay);
+
+struct media_decoder
+{
+  FILE *fh;
+  uint8_t format;
+  int width, height;
+  // where the first frame starts, to go round again
+  long data_start;
+  uint8_t still;
+
+  // one frame (or for a still one row) in buffer order, and for each LED
+  // the byte offset of its pixel
+  vector<uint8_t> canvas, previous;
+  vector<uint32_t> map;
+  uint8_t leds[MAX_LEDS * 3];
+
+  // GIF: color tables, the graphic control extension of the next image
+  // and the LZW tables
+  uint8_t global_table[256 * 3], local_table[256 * 3];
+  int delay, transparent, disposal;
+  int block_left;
+  uint16_t prefix[4096];
+  uint8_t suffix[4096];
+  uint8_t stack[4097];
+};
 
-  // end of frame all FFs
-  for(int i = 0; i < 4; i++) {
-    buf[0] = 0xFF;
-    wiringPiSPIDataRW(0, buf, 1);
-  }
-}
+struct effect_state
+{
+  int effect;
 
-uint8_t InSchedule(void)
+  // what the effect shows, blended into display_buffer by RunEffect
+  alignas(64) uint8_t layer[MAX_LEDS * 3];
+
+  // work buffers private to the effect
+  alignas(64) uint8_t buffer1[MAX_LEDS * 3];
+  alignas(64) uint8_t buffer2[MAX_LEDS * 3];
+  alignas(64) uint8_t buffer3[MAX_LEDS * 3];
+  alignas(64) uint8_t buffer4[MAX_LEDS * 3];
+
+  useconds_t frame_delay;
+  uint8_t direction, blend, mixval;
+  uint8_t r1, g1, b1, r2, g2, b2, r3, g3, b3;
+
+  // blobs, sparks, drops, ...
+  particle_system particles;
+
+  // Shader's program and registers, one per node. per frame values are
+  // shared, per LED ones are per render pool thread
+  const shader_program *shader;
+  float shader_uniforms[SHADER_NODES];
+  alignas(64) float shader_regs[SHADER_NODES][SHADER_BATCH];
+  alignas(64) float shader_work[MAX_RENDER_THREADS][SHADER_NODES][SHADER_BATCH];
+
+  // last audio snapshot rendered
+  uint32_t audio_seq;
+
+  // spatial effects: a per LED coordinate and where the effect is along it
+  float field[MAX_LEDS];
+  float phase, speed, width;
+
+  // palette effects: which one, where the first LED is along it, how far
+  // apart the LEDs are and how far it moves a second, all 8.24
+  const palette *pal;
+  uint32_t pal_phase, pal_step, pal_speed;
+
+  // EffectTime of the last frame, for effects that move with the clock
+  uint64_t frame_time;
+};
+
+uint8_t display_buffer[MAX_LEDS * 3];
+
+// start frame, one 4 byte frame per LED, end frame
+#define WIRE_FRAME_SIZE (4 + (MAX_LEDS * 4) + 4)
+
+// physical outputs, each sends the LEDs from its first one up to the next
+// output's first from its own spidev device. build with -DSPLIT_OUTPUTS for
+// the strip cut in half and fed from the SPI0 and SPI1 controllers
+struct output_map
 {
-  /*
-    Function reads in schedule from YAML formatted configuration file to determine if
-    it's currently time to turn on the lights or not.
-  */
+  const char *device;
+  // in 1/1000ths of the strip so the split follows the layout's length
+  int first;
+};
 
-  uint8_t in_schedule = 0;
+#ifdef SPLIT_OUTPUTS
+#define OUTPUTS 2
+const static output_map output_segments[OUTPUTS] = {
+  { "/dev/spidev0.0", 0 },
+  { "/dev/spidev1.0", 500 }
+};
+#else
+#define OUTPUTS 1
+const static output_map output_segments[OUTPUTS] = {
+  { "/dev/spidev0.0", 0 }
+};
+#endif
 
-  time_t now = time(0);
-  tm *ltm = localtime(&now);
-
-  stringstream parse_time;
-  string hr_time, min_time;
-  int hr_time_int, min_time_int, start_secs, end_secs, max_end_secs;
-
-  const static string dow[] = {
-    "Su",
-    "Mo",
-    "Tu",
-    "We",
-    "Th",
-    "Fr",
-    "Sa"
-  };
+struct output_state
+{
+  const output_map *map;
+  int first;
+  int count;
+  int fd;
+  int len;
+  uint64_t transmit_time;
+  uint8_t wire[WIRE_FRAME_SIZE];
+
+  // per channel, the light the last frame fell short by, added to the next
+  alignas(64) int32_t dither[MAX_LEDS * 3 + QUANTIZE_BLOCK];
+};
 
-  const static string mon[] = {
-    "Jan",
-    "Feb",
-    "Mar",
-    "Apr",
-    "May",
-    "Jun",
-    "Jul",
-    "Aug",
-    "Sep",
-    "Oct",
-    "Nov",
-    "Dec"
-  };
+output_state outputs[OUTPUTS];
+
+// buffer value to 16 bit light output per channel, in buffer order (blue,
+// green, red). a pixel's brightest channel picks the smallest APA102 global
+// brightness it fits in and the channels are scaled up to fill the 8 bit
+// PWM at that level, so dim colors keep their resolution
+float output_gamma = OUTPUT_GAMMA;
+float output_dimmer = OUTPUT_DIMMER;
+float output_balance[3] = { 1, 1, 1 };
+uint8_t output_hdr = 1;
+uint8_t output_dither = 1;
+uint16_t output_lut[3][256];
+uint8_t output_level[256];
+uint32_t output_scale[LED_BRIGHTNESS + 1];
+// light per PWM step at each global brightness, 8.8 fixed point
+uint32_t output_unit[LED_BRIGHTNESS + 1];
+
+// estimated supply current in amps and the limit, and the share of the
+// light being let through
+float power_budget = POWER_BUDGET_AMPS;
+float power_amps = 0;
+float power_gain = 1;
+
+// the frame going out as 16 bit light per channel. DisplayBuffer fills it
+// from an 8 bit buffer, crossfades and the fade out write it directly
+alignas(64) uint16_t display_light[MAX_LEDS * 3 + QUANTIZE_BLOCK];
+
+// with more than one output every transmit thread waits at output_start for
+// the next frame and DisplayBuffer waits at output_done until all are out
+const uint16_t *output_frame;
+pthread_barrier_t output_start;
+pthread_barrier_t output_done;
+
+// a run of LEDs along one wall, in strip order. the last corner LEDs go
+// round the corner and effects that outline walls leave them dark
+struct layout_segment
+{
+  char name[LAYOUT_NAME_SIZE];
+  int first;
+  int count;
+  int corner;
+  // position of the first and last LED in cm
+  float x1, y1, x2, y2;
+};
 
-  FILE *fh = fopen("schedule.conf", "r");
-  yaml_parser_t parser;
-  yaml_event_t  event;   /* New variable */
+// the SYN Shop wall, used when there's no layout.conf
+const static layout_segment default_layout[] = {
+  { "Bottom Right", 0,   173, 3, 0,   0,   288, 0 },
+  { "Top Right",    173, 173, 3, 288, 0,   288, 288 },
+  { "Top Left",     346, 150, 3, 288, 288, 38,  288 },
+  { "Bottom Left",  496, 150, 3, 38,  288, 38,  38 }
+};
 
-  uint8_t in_events = 0;
-  uint8_t in_sequence = 0;
-  uint8_t in_mapping = 0;
-  uint8_t in_read = 0;
+int num_leds = NUM_LEDS;
+int num_segments = 0;
+layout_segment segments[LAYOUT_SEGMENTS];
 
-  string event_name, start_time, end_time, day_of_week, week_day_number, month, day_of_month, year, disabled, open_status;
+// per LED lookup tables built from the layout
+float led_x[MAX_LEDS];
+float led_y[MAX_LEDS];
+// angle round the middle of the room, -PI to PI
+float led_angle[MAX_LEDS];
+uint8_t led_segment[MAX_LEDS];
 
-  /* Initialize parser */
-  if(!yaml_parser_initialize(&parser))
-    fputs("Failed to initialize parser!\n", stderr);
-  if(fh == NULL)
-    fputs("Failed to open schedule file!\n", stderr);
+// middle of the room, distance from there to the furthest LED and the
+// door, all in cm
+float layout_cx, layout_cy, layout_radius;
+float door_x = 0, door_y = 0;
 
-  /* Set input file */
-  yaml_parser_set_input_file(&parser, fh);
+struct schedule_event
+{
+  string event_name, start_time, end_time, day_of_week, week_day_number, month, day_of_month, year, disabled, open_status, calendar, effect, media;
+};
 
-  /* START new code */
-  do {
-    if (!yaml_parser_parse(&parser, &event)) {
-       printf("Parser error %d\n", parser.error);
-       exit(EXIT_FAILURE);
-    }
+vector<schedule_event> schedule;
 
-    switch(event.type)
-    {
-    case YAML_NO_EVENT:
-      //puts("No event!");
-      break;
-    /* Stream start/end */
-    case YAML_STREAM_START_EVENT:
-      //puts("STREAM START");
-      break;
-    case YAML_STREAM_END_EVENT:
-      //puts("STREAM END");
-      break;
-    /* Block delimeters */
-    case YAML_DOCUMENT_START_EVENT:
-      //puts("Start Document");
-      break;
-    case YAML_DOCUMENT_END_EVENT:
-      //puts("End Document");
-      break;
-    case YAML_SEQUENCE_START_EVENT:
-      //puts("Start Sequence");
-      break;
-    case YAML_SEQUENCE_END_EVENT:
-      //puts("End Sequence");
-      in_events = 0;
-      break;
-    case YAML_MAPPING_START_EVENT:
-      //puts("Start Mapping");
-      break;
-    case YAML_MAPPING_END_EVENT:
-      //puts("End Mapping");
+// schedule rules
+//
+// every schedule.conf event and every VEVENT of a calendar it names becomes
+// a rule: a first occurrence and length, plus how it repeats. YAML events
+// repeat daily filtered by their fields, calendar events follow their RRULE.
+// days are counted from 1970-01-01 in local time.
 
-      if(in_events)
-      {
-        uint8_t event_in_event = 0;
+// how a rule repeats
+#define RULE_ONCE 0
+#define RULE_DAILY 1
+#define RULE_WEEKLY 2
+#define RULE_MONTHLY 3
+#define RULE_YEARLY 4
 
-        int secs = (ltm->tm_hour * 3600) + (ltm->tm_min * 60) + ltm->tm_sec;
+// rule weekday_nth bit for the last one in the month, bits 0-4 are 1st-5th
+#define RULE_LAST_WEEK 0x20
 
-        if(start_time != "")
-        {
-          // clear variables
-          parse_time.clear();
-          hr_time.clear();
-          min_time.clear();
+struct schedule_rule
+{
+  string name, uid;
+  uint8_t freq, open;
+
+  // effect to run instead of random ones, 0 for none, and its media file
+  int effect;
+  string media;
+
+  // first occurrence, seconds after its midnight it starts, and how long
+  // each one lasts. one-off events only use start.
+  long first_day;
+  int time_of_day;
+  time_t start;
+  int duration;
+
+  int interval, count;
+  // last day and time of day an occurrence can start, until_day -1 for none
+  long until_day;
+  int until_time;
+
+  // filters on the day, 0 for any: bit per tm_wday, for each weekday a bit
+  // per week of the month it's on, bit per tm_mon, per day of the month
+  // (bit 0 the 1st), and the year
+  uint8_t weekdays, weekday_nth[7];
+  uint16_t months;
+  uint32_t monthdays;
+  int year;
+
+  // skipped occurrences, by start time and for all-day EXDATEs by day
+  vector<time_t> exdates;
+  vector<long> exdays;
+};
 
-          parse_time<<start_time;
+// the compiled schedule: the state from each change until the next one
+struct schedule_change
+{
+  time_t at;
+  uint8_t on, open;
+  // 1 + the schedule_rules index of the event picking the effect, 0 for none
+  uint16_t effect_rule;
+};
 
-          getline(parse_time, hr_time, ':' );
-          getline(parse_time, min_time, ':' );
+// what ScheduleCompile needs to know about each day of its window
+struct schedule_day
+{
+  time_t midnight;
+  int length;
+  int year;
+  uint8_t month, mday, wday, nth;
+};
 
-          hr_time_int = atoi(hr_time.c_str());
-          min_time_int = atoi(min_time.c_str());
-          start_secs = (hr_time_int * 3600) + (min_time_int * 60);
+vector<schedule_rule> schedule_rules;
+vector<schedule_change> schedule_changes;
+vector<schedule_day> schedule_days;
+long schedule_first_day = 0;
+// times schedule_changes can answer for, 0 to compile on the next lookup
+time_t schedule_start = 0, schedule_end = 0;
+// mtime and size of schedule.conf and its calendars when they were read
+uint64_t schedule_signature = 0;
+uint8_t schedule_open = 0;
+
+// frame ring shared with an external producer
+//
+// single producer, single consumer: the producer only writes head and the
+// daemon only writes tail. after filling the slot at head the producer
+// bumps head, then bumps doorbell and futex wakes it. the slot at tail is
+// the frame on the wall, so the producer gets SHM_SLOTS - 1 slots to fill.
+// pixels are in display buffer order, blue, green, red per LED.
+
+struct shm_frame
+{
+  // MicroTime (CLOCK_MONOTONIC) when the producer finished the frame
+  uint64_t produced;
+  uint8_t pixels[MAX_LEDS * 3];
+};
 
-          if(secs >= start_secs)
-          {
-            // It's past the start time
-            event_in_event = 1;
-          }
-        }
+struct shm_ring
+{
+  uint32_t magic;
+  uint32_t num_leds;
+  uint32_t slots;
+  // the producer signals SIGRTMIN here when it attaches
+  int32_t daemon_pid;
+  // pid of the attached producer, 0 when there is none
+  std::atomic<int32_t> producer_pid;
+
+  alignas(64) std::atomic<uint32_t> head;
+  alignas(64) std::atomic<uint32_t> tail;
+  alignas(64) std::atomic<uint32_t> doorbell;
+
+  alignas(64) shm_frame frames[SHM_SLOTS];
+};
 
-        if(end_time != "")
-        {
-          // clear variables
-          parse_time.clear();
-          hr_time.clear();
-          min_time.clear();
+shm_ring *frame_ring = NULL;
 
-          parse_time<<end_time;
+// set while the lights are off, the LED supply is down and nothing is sent
+std::atomic<uint8_t> output_idle;
 
-          getline(parse_time, hr_time, ':' );
-          getline(parse_time, min_time, ':' );
+// the effect on the wall and the one being transitioned to or from
+effect_state effect_states[2];
+effect_state *current_state = &effect_states[0];
 
-          hr_time_int = atoi(hr_time.c_str());
-          min_time_int = atoi(min_time.c_str());
-          end_secs = (hr_time_int * 3600) + (min_time_int * 60);
+// per LED threshold for the dissolve transition
+uint8_t dissolve_order[MAX_LEDS];
 
-          // cout << "end_secs: " << end_secs << endl;
+int signaled = 0;
+uint8_t lights_on = 0;
 
-          if(secs >= end_secs)
-          {
-            // It's past the end time
-            event_in_event = 0;
-          }
-        }
+uint8_t p_r1, p_g1, p_b1, p_r2, p_g2, p_b2;
 
-        if(day_of_week != "")
-        {
-          if(day_of_week.find(dow[ltm->tm_wday]) == std::string::npos)
-          {
-            // Day of the week not found in schedule
-            event_in_event = 0;
-          }
-        }
+// a badge swipe asking for a personal effect
+struct trigger_request
+{
+  uint64_t received;
+  char user[TRIGGER_USER_SIZE];
+  uint8_t r1, g1, b1, r2, g2, b2;
+};
 
-        if(week_day_number != "")
-        {
-          if(atoi(week_day_number.c_str()) != (((ltm->tm_mday - 1)/7)+1))
-          {
-            // Day of the week not found in schedule
-            event_in_event = 0;
-          }
-        }
+// bounded queue any thread can push requests into, only the render loop
+// pops. same sequence numbered cells as the log queue.
+struct trigger_cell
+{
+  std::atomic<uint32_t> sequence;
+  trigger_request request;
+};
 
-        if(month != "")
-        {
-          if(month.find(mon[ltm->tm_mon]) == std::string::npos)
-          {
-            // Day of the week not found in schedule
-            event_in_event = 0;
-          }
-        }
+trigger_cell trigger_queue[TRIGGER_QUEUE_SIZE];
+std::atomic<uint32_t> trigger_enqueue_pos;
+uint32_t trigger_dequeue_pos;
 
-        if(day_of_month != "")
-        {
-          if(atoi(day_of_month.c_str()) != ltm->tm_mday)
-          {
-            // Day of the week not found in schedule
-            event_in_event = 0;
-          }
-        }
+// people waiting for their personal effect, in turn order
+struct personal_turn
+{
+  trigger_request request;
+  int32_t remaining;
+};
 
-        if(year != "")
-        {
-          if(atoi(year.c_str()) != (ltm->tm_year + 1900))
-          {
-            // Day of the week not found in schedule
-            event_in_event = 0;
-          }
-        }
+personal_turn personal_turns[TRIGGER_USERS];
+uint8_t personal_waiting = 0;
+int trigger_transition = TRIGGER_TRANSITION_FRAMES;
 
-        if(disabled == "true")
-        {
-          // Schedule is disabled
-          event_in_event = 0;
-        }
-        in_schedule |= event_in_event;
+// armed by --bench-trigger, DisplayBuffer disarms it with the first frame
+// holding either color on its way to the strip
+struct trigger_probe_state
+{
+  std::atomic<uint8_t> armed;
+  uint8_t r1, g1, b1, r2, g2, b2;
+  uint64_t injected;
+  uint64_t latency;
+};
 
-      }
+trigger_probe_state trigger_probe;
 
-      start_time.clear();
-      end_time.clear();
-      day_of_week.clear();
-      week_day_number.clear();
-      month.clear();
-      day_of_month.clear();
-      year.clear();
-      disabled.clear();
-      open_status.clear();
+// set by benchmarks to time frames as if they went out without touching SPI
+uint8_t bench_output = 0;
 
-      break;
-    /* Data */
-    case YAML_ALIAS_EVENT:
-      //printf("Got alias (anchor %s)\n", event.data.alias.anchor);
-      break;
-    case YAML_SCALAR_EVENT:
+uint8_t rt_mode = 0;
+int rt_render_cpu = RT_RENDER_CPU;
+int rt_transmit_cpu = RT_TRANSMIT_CPU;
 
-      if(in_events)
-      {
-        // we've found that we're in the events section so ok to read data
+// metrics
+//
+// updated from the render loop with relaxed atomics and written out in
+// prometheus text format by a background thread
 
-        if(in_read)
-        {
-          // we've previously found a data type to read so next bit of data goes in there
-          switch(in_read)
-          {
-            case 1:
-              // read in Event Name next
-              event_name = reinterpret_cast<char*>(event.data.scalar.value);
+// histogram bucket upper bounds in microseconds, the last bucket is +Inf
+#define HISTOGRAM_BUCKETS 12
+const static uint64_t histogram_bounds[HISTOGRAM_BUCKETS - 1] = {
+  50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000
+};
 
-              break;
-            case 2:
-              // read in Start Time next
-              start_time = reinterpret_cast<char*>(event.data.scalar.value);
+struct histogram
+{
+  std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+  std::atomic<uint64_t> sum;
+  std::atomic<uint64_t> count;
+};
 
-              break;
-            case 3:
-              // read in End Time next
-              end_time = reinterpret_cast<char*>(event.data.scalar.value);
+histogram render_time;
+histogram composite_time;
+histogram transmit_time;
+histogram frame_interval;
+histogram audio_analysis_time;
+histogram audio_latency;
+histogram shm_latency;
+histogram frame_jitter;
+
+std::atomic<uint64_t> dropped_frames;
+std::atomic<uint64_t> triggers_received;
+std::atomic<uint64_t> triggers_queued;
+std::atomic<uint64_t> http_requests;
+std::atomic<uint64_t> triggers_coalesced;
+std::atomic<uint64_t> triggers_dropped;
+std::atomic<uint64_t> schedule_reloads;
+std::atomic<uint64_t> effect_runs[EFFECTS];
+std::atomic<uint64_t> idle_wakeups;
+std::atomic<uint64_t> idle_seconds;
+std::atomic<uint64_t> shm_attaches;
+std::atomic<uint64_t> shm_frames;
+std::atomic<uint64_t> shm_dropped;
+std::atomic<uint64_t> pool_steals;
+std::atomic<uint64_t> frame_allocations;
+std::atomic<uint64_t> power_limited_frames;
+std::atomic<uint64_t> power_limited_percent;
+// Playback frames the media thread hadn't decoded in time
+std::atomic<uint64_t> media_underruns;
+
+// set on the render thread while it's in the frame loop, where nothing
+// should allocate. operator new counts any allocation made while it's set
+thread_local uint8_t in_frame = 0;
+
+void *operator new(size_t size)
+{
+  if(in_frame)
+  {
+    frame_allocations.fetch_add(1, std::memory_order_relaxed);
+  }
 
-              break;
-            case 4:
-              // read in Day of Week next
-              day_of_week = reinterpret_cast<char*>(event.data.scalar.value);
+  void *p = malloc(size);
+  if(!p)
+  {
+    throw std::bad_alloc();
+  }
+  return(p);
+}
 
-              break;
-            case 5:
-              // read in Disabled next
-              disabled = reinterpret_cast<char*>(event.data.scalar.value);
+void *operator new[](size_t size)
+{
+  return(operator new(size));
+}
 
-              break;
-            case 6:
-              // read in Month next
-              month = reinterpret_cast<char*>(event.data.scalar.value);
+// kept out of line, gcc otherwise sees free() on a pointer from
+// operator new and warns about a mismatch that is not there
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+  free(p);
+}
 
-              break;
-            case 7:
-              // read in Day next
-              day_of_month = reinterpret_cast<char*>(event.data.scalar.value);
+// the sized and array forms have to match, or sanitizer builds see
+// mismatched allocations
+void operator delete(void *p, size_t size) noexcept
+{
+  operator delete(p);
+}
 
-              break;
-            case 8:
-              // read in Yeak next
-              year = reinterpret_cast<char*>(event.data.scalar.value);
+void operator delete[](void *p) noexcept
+{
+  operator delete(p);
+}
 
-              break;
-            case 9:
-              // read in Week day number next
-              week_day_number = reinterpret_cast<char*>(event.data.scalar.value);
+void operator delete[](void *p, size_t size) noexcept
+{
+  operator delete(p);
+}
 
-              break;
-            case 10:
-              // read in open status next
-              open_status = reinterpret_cast<char*>(event.data.scalar.value);
+// wakes the metrics thread early, it sleeps without a timeout while idle
+// plain pthread objects so there's no destructor to wait on the thread at exit
+pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t metrics_cond = PTHREAD_COND_INITIALIZER;
 
-              break;
-          }
-          in_read = 0;
-        }
-        else
-        {
-          // read scalar of variable names
-          if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "event_name") == 0)
-          {
-            // read in Event Name next
-            in_read = 1;
-          }
-          if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "start_time") == 0)
-          {
-            // read in Start Time next
-            in_read = 2;
-          }
-          if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "end_time") == 0)
-          {
-            // read in End Time next
-            in_read = 3;
-          }
-          if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "day_of_week") == 0)
-          {
-            // read in Day of Week next
-            in_read = 4;
-          }
+// functions
+
+uint64_t MicroTime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t(ts.tv_sec) * 1000000) + (ts.tv_nsec / 1000);
+}
+
+// simulator
+//
+// -DSIMULATOR swaps wiringPi for a virtual strip that decodes the SPI frames
+// and draws them as a truecolor ansi bar and/or a PPM image with one row per
+// frame. with --sim-fast the schedule and effects run on a simulated clock
+// that only advances by the sleeps and the time the SPI transfer would take.
+
+#ifdef SIMULATOR
+
+#define OUTPUT 1
+
+uint8_t sim_fast = 0;
+uint8_t sim_ansi = 0;
+FILE *sim_ppm = NULL;
+uint64_t sim_ppm_rows = 0;
+uint64_t sim_frames = 0;
+// simulated time in microseconds since the epoch, and when to stop
+std::atomic<uint64_t> sim_clock;
+uint64_t sim_end = 0;
+uint64_t sim_last_ansi = 0;
+uint8_t sim_pixels[MAX_LEDS * 3];
+
+void SimCheckEnd(void)
+{
+  uint64_t now = sim_fast ? sim_clock.load() : uint64_t(time(0)) * 1000000;
+
+  if(sim_end && now >= sim_end)
+  {
+    signaled = SIGINT;
+  }
+}
+
+void SimWritePPMHeader(void)
+{
+  // fixed width height field so it can be rewritten in place at the end
+  fprintf(sim_ppm, "P6\n%d %10llu\n255\n", num_leds, (unsigned long long) sim_ppm_rows);
+}
+
+void SimClose(void)
+{
+  if(sim_ppm)
+  {
+    fseek(sim_ppm, 0, SEEK_SET);
+    SimWritePPMHeader();
+    fclose(sim_ppm);
+    sim_ppm = NULL;
+  }
+  if(sim_ansi)
+  {
+    printf("\x1b[0m\n");
+  }
+}
+
+void SimDrawAnsi(void)
+{
+  // one character cell per SIM_ANSI_WIDTH'th of the strip, averaged
+  static char line[SIM_ANSI_WIDTH * 24 + 16];
+  int len = 0;
+
+  line[len++] = '\r';
+  for(int col = 0; col < SIM_ANSI_WIDTH; col++)
+  {
+    int first = (col * num_leds) / SIM_ANSI_WIDTH;
+    int last = ((col + 1) * num_leds) / SIM_ANSI_WIDTH;
+    int r = 0, g = 0, b = 0;
+
+    for(int i = first; i < last; i++)
+    {
+      r += sim_pixels[i*3];
+      g += sim_pixels[i*3+1];
+      b += sim_pixels[i*3+2];
+    }
+    int n = std::max(last - first, 1);
+    len += sprintf(line + len, "\x1b[48;2;%d;%d;%dm ", r / n, g / n, b / n);
+  }
+  len += sprintf(line + len, "\x1b[0m");
+
+  fwrite(line, 1, len, stdout);
+  fflush(stdout);
+}
+
+int wiringPiSetup(void)
+{
+  return 0;
+}
+
+void pinMode(int pin, int mode)
+{
+}
+
+void digitalWrite(int pin, int value)
+{
+}
+
+int OutputOpen(output_state *o)
+{
+  return 0;
+}
+
+void OutputWrite(output_state *o)
+{
+  // decode the APA102 frame: 4 start bytes then brightness, blue, green, red per LED
+  for(int i = 0; i < o->count; i++)
+  {
+    uint8_t *led = &o->wire[4 + i*4];
+    uint8_t *pixel = &sim_pixels[(o->first + i) * 3];
+    int brightness = led[0] & 0b00011111;
+
+    pixel[0] = (led[3] * brightness) / 31;
+    pixel[1] = (led[2] * brightness) / 31;
+    pixel[2] = (led[1] * brightness) / 31;
+  }
+}
+
+void SimFrame(int len)
+{
+  // a whole frame is out on every output, len is the longest transfer
+  sim_frames++;
+
+  if(sim_ppm)
+  {
+    fwrite(sim_pixels, 1, num_leds * 3, sim_ppm);
+    sim_ppm_rows++;
+  }
+
+  if(sim_ansi && (MicroTime() - sim_last_ansi) >= (1000000 / SIM_ANSI_FPS))
+  {
+    sim_last_ansi = MicroTime();
+    SimDrawAnsi();
+  }
+
+  if(sim_fast)
+  {
+    // as long as the transfer would have taken on the bus
+    sim_clock += (uint64_t(len) * 8 * 1000000) / SPI_SPEED;
+  }
+  SimCheckEnd();
+}
+
+#endif
+
+time_t Now(void)
+{
+#ifdef SIMULATOR
+  if(sim_fast)
+  {
+    return sim_clock / 1000000;
+  }
+#endif
+  return time(0);
+}
+
+uint64_t EffectTime(void)
+{
+  // microseconds for effects that move with the clock, simulated or not
+#ifdef SIMULATOR
+  if(sim_fast)
+  {
+    return sim_clock;
+  }
+#endif
+  return MicroTime();
+}
+
+void Sleep(uint64_t usec)
+{
+#ifdef SIMULATOR
+  if(sim_fast)
+  {
+    sim_clock += sim_end ? std::min(usec, sim_end - std::min(sim_end, sim_clock.load())) : usec;
+    SimCheckEnd();
+    return;
+  }
+#endif
+  usleep(usec);
+}
+
+// logging
+//
+// LOG() formats into a fixed-size record in a bounded lock-free queue and
+// returns, the log thread adds the timestamp and does the actual write. if
+// the queue is full the record is dropped and counted rather than waiting.
+
+struct log_record
+{
+  time_t ts;
+  uint8_t level;
+  uint32_t suppressed;
+  char text[LOG_MESSAGE_SIZE];
+};
+
+struct log_cell
+{
+  std::atomic<uint32_t> sequence;
+  log_record record;
+};
+
+// per call site rate limit state, see LOG(). hash is of the last text
+// logged, only the same text again inside the limit is held back.
+struct log_limit
+{
+  std::atomic<uint64_t> next;
+  std::atomic<uint64_t> hash;
+  std::atomic<uint32_t> suppressed;
+};
+
+#define LOG(level, ...) do { static log_limit log_limit_; Log(&log_limit_, level, __VA_ARGS__); } while(0)
+
+log_cell log_queue[LOG_QUEUE_SIZE];
+std::atomic<uint32_t> log_enqueue_pos;
+std::atomic<uint32_t> log_dequeue_pos;
+std::atomic<uint64_t> log_dropped;
+
+// posted once per queued record so the log thread can sleep until there is work
+sem_t log_ready;
+
+int log_level = LOG_INFO;
+
+void LogInit(void)
+{
+  for(int i = 0; i < LOG_QUEUE_SIZE; i++)
+  {
+    log_queue[i].sequence.store(i, std::memory_order_relaxed);
+  }
+  sem_init(&log_ready, 0, 0);
+}
+
+void Log(log_limit *limit, uint8_t level, const char *format, ...)
+{
+  if(level < log_level)
+  {
+    return;
+  }
+
+  char text[LOG_MESSAGE_SIZE];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(text, LOG_MESSAGE_SIZE, format, args);
+  va_end(args);
+
+  // the same text from the same call site inside the rate limit is only
+  // counted, a different one (another user, another file) still goes out
+  uint64_t now = MicroTime();
+  if(limit)
+  {
+    uint64_t hash = 14695981039346656037ull;
+    for(const char *c = text; *c; c++)
+    {
+      hash = (hash ^ uint8_t(*c)) * 1099511628211ull;
+    }
+
+    if(hash == limit->hash.load(std::memory_order_relaxed) && now < limit->next.load(std::memory_order_relaxed))
+    {
+      limit->suppressed.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    limit->hash.store(hash, std::memory_order_relaxed);
+    limit->next.store(now + LOG_RATE_LIMIT, std::memory_order_relaxed);
+  }
+
+  // claim a cell, multiple threads may be logging at once
+  log_cell *cell;
+  uint32_t pos = log_enqueue_pos.load(std::memory_order_relaxed);
+  while(true)
+  {
+    cell = &log_queue[pos & (LOG_QUEUE_SIZE - 1)];
+    int32_t diff = int32_t(cell->sequence.load(std::memory_order_acquire)) - int32_t(pos);
+
+    if(diff == 0)
+    {
+      if(log_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+      {
+        break;
+      }
+    }
+    else if(diff < 0)
+    {
+      // queue full, never block the caller
+      log_dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    else
+    {
+      pos = log_enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+
+  memcpy(cell->record.text, text, LOG_MESSAGE_SIZE);
+  cell->record.ts = Now();
+  cell->record.level = level;
+  cell->record.suppressed = limit ? limit->suppressed.exchange(0, std::memory_order_relaxed) : 0;
+
+  cell->sequence.store(pos + 1, std::memory_order_release);
+  sem_post(&log_ready);
+}
+
+uint8_t LogPop(log_record *record)
+{
+  log_cell *cell;
+  uint32_t pos = log_dequeue_pos.load(std::memory_order_relaxed);
+  while(true)
+  {
+    cell = &log_queue[pos & (LOG_QUEUE_SIZE - 1)];
+    int32_t diff = int32_t(cell->sequence.load(std::memory_order_acquire)) - int32_t(pos + 1);
+
+    if(diff == 0)
+    {
+      if(log_dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+      {
+        break;
+      }
+    }
+    else if(diff < 0)
+    {
+      // empty
+      return 0;
+    }
+    else
+    {
+      pos = log_dequeue_pos.load(std::memory_order_relaxed);
+    }
+  }
+
+  *record = cell->record;
+  cell->sequence.store(pos + LOG_QUEUE_SIZE, std::memory_order_release);
+  return 1;
+}
+
+void LogDrain(void)
+{
+  const static char *level_names[] = { "", "debug: ", "", "warning: ", "error: " };
+  static uint64_t reported_dropped = 0;
+
+  static FILE *access_log = NULL;
+
+  log_record record;
+  char s[100];
+  uint8_t wrote = 0;
+
+  while(LogPop(&record))
+  {
+    if(record.level == LOG_ACCESS)
+    {
+      if(access_log == NULL)
+      {
+        access_log = fopen(ACCESS_LOG, "a");
+      }
+      if(access_log)
+      {
+        fprintf(access_log, "%s\n", record.text);
+        fflush(access_log);
+      }
+      continue;
+    }
+
+    strftime(s, 100, "%c", localtime(&record.ts));
+    // the count is of repeats held back before this record
+    if(record.suppressed)
+    {
+      fprintf(stdout, "%s: (last message repeated %u more times)\n", s, record.suppressed);
+    }
+    fprintf(stdout, "%s: %s%s\n", s, level_names[record.level], record.text);
+    wrote = 1;
+  }
+
+  uint64_t dropped = log_dropped.load(std::memory_order_relaxed);
+  if(dropped != reported_dropped)
+  {
+    fprintf(stdout, "(%llu log messages dropped)\n", (unsigned long long) (dropped - reported_dropped));
+    reported_dropped = dropped;
+    wrote = 1;
+  }
+
+  if(wrote)
+  {
+    fflush(stdout);
+  }
+}
+
+void HistogramObserve(histogram *h, uint64_t usec)
+{
+  int bucket = 0;
+
+  while(bucket < (HISTOGRAM_BUCKETS - 1) && usec > histogram_bounds[bucket])
+  {
+    bucket++;
+  }
+
+  h->buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+  h->sum.fetch_add(usec, std::memory_order_relaxed);
+  h->count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void WriteHistogram(FILE *fh, const char *name, const char *help, histogram *h)
+{
+  uint64_t cumulative = 0;
+
+  fprintf(fh, "# HELP %s %s\n", name, help);
+  fprintf(fh, "# TYPE %s histogram\n", name);
+
+  for(int i = 0; i < HISTOGRAM_BUCKETS; i++)
+  {
+    cumulative += h->buckets[i].load(std::memory_order_relaxed);
+
+    if(i < (HISTOGRAM_BUCKETS - 1))
+    {
+      fprintf(fh, "%s_bucket{le=\"%g\"} %llu\n", name, histogram_bounds[i] / 1e6, (unsigned long long) cumulative);
+    }
+    else
+    {
+      fprintf(fh, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long) cumulative);
+    }
+  }
+
+  fprintf(fh, "%s_sum %g\n", name, h->sum.load(std::memory_order_relaxed) / 1e6);
+  fprintf(fh, "%s_count %llu\n", name, (unsigned long long) h->count.load(std::memory_order_relaxed));
+}
+
+void WriteCounter(FILE *fh, const char *name, const char *help, std::atomic<uint64_t> *counter)
+{
+  fprintf(fh, "# HELP %s %s\n", name, help);
+  fprintf(fh, "# TYPE %s counter\n", name);
+  fprintf(fh, "%s %llu\n", name, (unsigned long long) counter->load(std::memory_order_relaxed));
+}
+
+void WriteMetrics(void)
+{
+  /*
+    Writes all metrics to a temporary file and renames it over METRICS_FILE so
+    the textfile collector never sees a half written file.
+  */
+  static uint8_t reported = 0;
+  string tmp_name = string(METRICS_FILE) + ".tmp";
+
+  FILE *fh = fopen(tmp_name.c_str(), "w");
+  if(fh == NULL)
+  {
+    if(!reported)
+    {
+      LOG(LOG_ERROR, "Failed to open metrics file %s", METRICS_FILE);
+      reported = 1;
+    }
+    return;
+  }
+
+  WriteHistogram(fh, "blinkenlights_render_seconds", "Time spent rendering effects per frame.", &render_time);
+  WriteHistogram(fh, "blinkenlights_composite_seconds", "Time spent blending layers per frame.", &composite_time);
+  WriteHistogram(fh, "blinkenlights_transmit_seconds", "Time spent sending a frame over SPI.", &transmit_time);
+  WriteHistogram(fh, "blinkenlights_frame_interval_seconds", "Time between the start of consecutive frames.", &frame_interval);
+  WriteHistogram(fh, "blinkenlights_audio_analysis_seconds", "Time to analyse one hop of audio.", &audio_analysis_time);
+  WriteHistogram(fh, "blinkenlights_audio_latency_seconds", "Age of the audio levels when an effect first renders them.", &audio_latency);
+  WriteHistogram(fh, "blinkenlights_external_latency_seconds", "Time from an external producer finishing a frame to it being sent.", &shm_latency);
+  WriteHistogram(fh, "blinkenlights_frame_jitter_seconds", "How late the render thread woke up for a frame.", &frame_jitter);
+
+  WriteCounter(fh, "blinkenlights_dropped_frames_total", "Frames that took longer than two frame budgets.", &dropped_frames);
+  WriteCounter(fh, "blinkenlights_triggers_total", "SIGUSR1 triggers received.", &triggers_received);
+  WriteCounter(fh, "blinkenlights_http_requests_total", "Badge posts handled by the built-in endpoint.", &http_requests);
+  WriteCounter(fh, "blinkenlights_triggers_queued_total", "Personal effect requests queued.", &triggers_queued);
+  WriteCounter(fh, "blinkenlights_triggers_coalesced_total", "Requests merged into a queued request from the same user.", &triggers_coalesced);
+  WriteCounter(fh, "blinkenlights_triggers_dropped_total", "Requests dropped because the queue was full.", &triggers_dropped);
+  WriteCounter(fh, "blinkenlights_schedule_reloads_total", "Times the schedule file was read.", &schedule_reloads);
+  WriteCounter(fh, "blinkenlights_idle_wakeups_total", "Times the render thread woke up while the lights were off.", &idle_wakeups);
+  WriteCounter(fh, "blinkenlights_idle_seconds_total", "Seconds spent idle with the lights off.", &idle_seconds);
+  WriteCounter(fh, "blinkenlights_external_attaches_total", "External frame producers attached.", &shm_attaches);
+  WriteCounter(fh, "blinkenlights_external_frames_total", "External frames sent to the strip.", &shm_frames);
+  WriteCounter(fh, "blinkenlights_external_dropped_total", "External frames skipped because a newer one was ready.", &shm_dropped);
+  WriteCounter(fh, "blinkenlights_render_steals_total", "Render pool chunks taken from another thread's share.", &pool_steals);
+  WriteCounter(fh, "blinkenlights_frame_allocations_total", "Heap allocations made inside the frame loop, should stay 0.", &frame_allocations);
+  WriteCounter(fh, "blinkenlights_power_limited_frames_total", "Frames dimmed to stay within the power budget.", &power_limited_frames);
+  WriteCounter(fh, "blinkenlights_media_underruns_total", "Playback frames shown again because the next one wasn't decoded yet.", &media_underruns);
+  WriteCounter(fh, "blinkenlights_power_limited_percent_total", "Sum over dimmed frames of the percent of light taken off.", &power_limited_percent);
+  WriteCounter(fh, "blinkenlights_log_dropped_total", "Log messages dropped because the log queue was full.", &log_dropped);
+
+  fprintf(fh, "# HELP blinkenlights_effect_runs_total Times each effect was started.\n");
+  fprintf(fh, "# TYPE blinkenlights_effect_runs_total counter\n");
+  for(int i = 0; i < EFFECTS; i++)
+  {
+    fprintf(fh, "blinkenlights_effect_runs_total{effect=\"%s\"} %llu\n", effects[i].c_str(),
+            (unsigned long long) effect_runs[i].load(std::memory_order_relaxed));
+  }
+
+  fclose(fh);
+  rename(tmp_name.c_str(), METRICS_FILE);
+}
+
+// tracing
+//
+// each thread records begin/end events into its own ring buffer, the dump
+// thread copies out the last TRACE_DUMP_SECONDS when it gets SIGUSR2
+
+#ifdef TRACING
+
+#define TRACE_BEGIN(name) TraceEvent(name, 'B')
+#define TRACE_END(name) TraceEvent(name, 'E')
+
+struct trace_event
+{
+  uint64_t ts;
+  const char *name;
+  char phase;
+};
+
+struct trace_ring
+{
+  std::atomic<uint32_t> head;
+  int tid;
+  trace_event events[TRACE_EVENTS];
+};
+
+std::atomic<trace_ring *> trace_rings[TRACE_THREADS];
+std::atomic<int> trace_ring_count;
+
+uint64_t NanoTime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t(ts.tv_sec) * 1000000000) + ts.tv_nsec;
+}
+
+trace_ring *TraceRing(void)
+{
+  static thread_local trace_ring *ring = NULL;
+
+  if(ring == NULL)
+  {
+    ring = new trace_ring();
+    ring->tid = trace_ring_count.fetch_add(1);
+
+    // threads past TRACE_THREADS still record, they just never get dumped
+    if(ring->tid < TRACE_THREADS)
+    {
+      trace_rings[ring->tid].store(ring, std::memory_order_release);
+    }
+  }
+  return ring;
+}
+
+inline void TraceEvent(const char *name, char phase)
+{
+  trace_ring *ring = TraceRing();
+  uint32_t head = ring->head.load(std::memory_order_relaxed);
+  trace_event *e = &ring->events[head & (TRACE_EVENTS - 1)];
+
+  e->ts = NanoTime();
+  e->name = name;
+  e->phase = phase;
+
+  ring->head.store(head + 1, std::memory_order_release);
+}
+
+void DumpTrace(void)
+{
+  /*
+    Writes the last TRACE_DUMP_SECONDS of every ring out in chrome trace
+    format, which loads in chrome://tracing and ui.perfetto.dev. Writers keep
+    going while we copy, so any entry that may have been overwritten during
+    the copy is skipped.
+  */
+  uint64_t since = NanoTime() - (uint64_t(TRACE_DUMP_SECONDS) * 1000000000);
+  uint8_t first = 1;
+
+  FILE *fh = fopen(TRACE_FILE, "w");
+  if(fh == NULL)
+  {
+    LOG(LOG_ERROR, "Failed to open trace file %s", TRACE_FILE);
+    return;
+  }
+
+  fprintf(fh, "{\"traceEvents\":[\n");
+
+  for(int t = 0; t < TRACE_THREADS; t++)
+  {
+    trace_ring *ring = trace_rings[t].load(std::memory_order_acquire);
+    if(ring == NULL)
+    {
+      continue;
+    }
+
+    uint32_t head = ring->head.load(std::memory_order_acquire);
+    uint32_t start = (head > TRACE_EVENTS) ? (head - TRACE_EVENTS) : 0;
+
+    for(uint32_t i = start; i < head; i++)
+    {
+      trace_event e = ring->events[i & (TRACE_EVENTS - 1)];
+
+      if(ring->head.load(std::memory_order_acquire) - i >= TRACE_EVENTS)
+      {
+        // writer lapped us while copying
+        continue;
+      }
+      if(e.ts < since)
+      {
+        continue;
+      }
+
+      fprintf(fh, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%d}", first ? "" : ",\n",
+              e.name, e.phase, e.ts / 1000.0, ring->tid);
+      first = 0;
+    }
+  }
+
+  fprintf(fh, "\n]}\n");
+  fclose(fh);
+}
+
+void TraceThread(void)
+{
+  sigset_t mask;
+  int sig;
+
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR2);
+
+  while(true)
+  {
+    sigwait(&mask, &sig);
+    DumpTrace();
+  }
+}
+
+#else
+
+#define TRACE_BEGIN(name)
+#define TRACE_END(name)
+
+#endif
+
+void BlockSignals(void)
+{
+  // helper threads leave SIGUSR1, SIGINT and SIGRTMIN to the render thread
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGRTMIN);
+  pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+void RtThread(int cpu, int priority)
+{
+  /*
+    In real time mode, pins the calling thread to cpu (if there is one)
+    and makes it SCHED_FIFO at priority, then touches its stack
+  */
+  if(!rt_mode)
+  {
+    return;
+  }
+
+  if(cpu >= 0 && cpu < sysconf(_SC_NPROCESSORS_ONLN))
+  {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    {
+      LOG(LOG_ERROR, "Failed to pin thread to CPU %d", cpu);
+    }
+  }
+
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  param.sched_priority = priority;
+  if(pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0)
+  {
+    LOG(LOG_ERROR, "Failed to set SCHED_FIFO, needs root or CAP_SYS_NICE");
+  }
+
+  volatile uint8_t stack[RT_STACK_PREFAULT / 4];
+  for(unsigned int i = 0; i < sizeof(stack); i += 4096)
+  {
+    stack[i] = 0;
+  }
+}
+
+void RtInit(void)
+{
+  /*
+    Locks everything mapped now and anything mapped later into memory, and
+    keeps a few MB of heap around so malloc never goes back to the kernel.
+    Call before starting threads so their stacks are locked too.
+  */
+  if(!rt_mode)
+  {
+    return;
+  }
+
+  mallopt(M_TRIM_THRESHOLD, -1);
+  mallopt(M_MMAP_MAX, 0);
+
+  // fault in globals and buffers now, later mappings (thread stacks) as
+  // they're touched so unused stack isn't pinned
+  if(mlockall(MCL_CURRENT) != 0)
+  {
+    LOG(LOG_ERROR, "Failed to lock memory, needs root or CAP_IPC_LOCK");
+  }
+#ifdef MCL_ONFAULT
+  mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT);
+#else
+  mlockall(MCL_CURRENT | MCL_FUTURE);
+#endif
+
+  uint8_t *heap = (uint8_t *) malloc(RT_HEAP_PREFAULT);
+  if(heap)
+  {
+    memset(heap, 0, RT_HEAP_PREFAULT);
+    free(heap);
+  }
+
+  LOG(LOG_INFO, "real time mode: render CPU %d, transmit CPU %d, priority %d", rt_render_cpu, rt_transmit_cpu, RT_PRIORITY);
+}
+
+void LogThread(void)
+{
+  BlockSignals();
+
+  while(true)
+  {
+    sem_wait(&log_ready);
+    LogDrain();
+  }
+}
+
+void MetricsThread(void)
+{
+  struct timespec wake;
+
+  BlockSignals();
+
+  pthread_mutex_lock(&metrics_mutex);
+
+  while(true)
+  {
+    // nothing changes while the lights are off, so don't wake up for it
+    if(output_idle)
+    {
+      pthread_cond_wait(&metrics_cond, &metrics_mutex);
+    }
+    else
+    {
+      clock_gettime(CLOCK_REALTIME, &wake);
+      wake.tv_sec += METRICS_INTERVAL;
+      pthread_cond_timedwait(&metrics_cond, &metrics_mutex, &wake);
+    }
+    WriteMetrics();
+  }
+}
+
+void signalHandler(int signum)
+{
+  signaled = signum;
+  if(signum == SIGUSR1)
+  {
+    triggers_received.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void TriggerProbe(const uint8_t *buffer)
+{
+  for(int i = 0; i < num_leds; i++)
+  {
+    const uint8_t *led = &buffer[i*3];
+    if((led[0] == trigger_probe.b1 && led[1] == trigger_probe.g1 && led[2] == trigger_probe.r1)
+       || (led[0] == trigger_probe.b2 && led[1] == trigger_probe.g2 && led[2] == trigger_probe.r2))
+    {
+      uint8_t armed = 1;
+      trigger_probe.latency = MicroTime() - trigger_probe.injected;
+      trigger_probe.armed.compare_exchange_strong(armed, 0, std::memory_order_release);
+      return;
+    }
+  }
+}
+
+#ifndef SIMULATOR
+int OutputOpen(output_state *o)
+{
+  int fd = open(o->map->device, O_RDWR | O_CLOEXEC);
+  if(fd < 0)
+  {
+    return -1;
+  }
+
+  uint8_t mode = SPI_MODE_0;
+  uint8_t bits = 8;
+  uint32_t speed = SPI_SPEED;
+  if(ioctl(fd, SPI_IOC_WR_MODE, &mode) < 0
+     || ioctl(fd, SPI_IOC_WR_BITS_PER_WORD, &bits) < 0
+     || ioctl(fd, SPI_IOC_WR_MAX_SPEED_HZ, &speed) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void OutputWrite(output_state *o)
+{
+  // the whole segment in one transfer, it fits in the default 4096 byte spidev buffer
+  if(o->fd >= 0 && write(o->fd, o->wire, o->len) != o->len)
+  {
+    LOG(LOG_ERROR, "SPI write to %s failed", o->map->device);
+  }
+}
+#endif
+
+void QuantizeLight(int n, const uint16_t *__restrict__ light, int32_t *__restrict__ dither, const uint32_t *__restrict__ scale,
+                   const uint32_t *__restrict__ unit, uint8_t *__restrict__ pwm)
+{
+  /*
+    Temporal dithering: each channel's light plus what the last frames fell
+    short by is rounded to a PWM value and the difference is carried to the
+    next frame, so over a few frames the LED averages the exact 16 bit
+    light. The error is kept within one PWM step at the LED's current
+    global brightness and dark channels drop it so they stay off. Straight
+    per element math in fixed size blocks, which the compiler vectorizes at
+    -O2; the last block runs into the arrays' spare QUANTIZE_BLOCK entries.
+  */
+  for(int block = 0; block < n; block += QUANTIZE_BLOCK)
+  {
+    for(int i = block; i < block + QUANTIZE_BLOCK; i++)
+    {
+      int32_t step = unit[i] >> 8;
+      int32_t v = std::min(std::max(int32_t(light[i]) + std::min(std::max(dither[i], -step), step), 0), 65535);
+      uint32_t p = std::min((uint32_t(v) * scale[i] + 32768) >> 16, 255u);
+      int32_t error = std::min(std::max(v - int32_t((p * unit[i] + 128) >> 8), -step), step);
+      dither[i] = light[i] ? error : 0;
+      pwm[i] = p;
+    }
+  }
+}
+
+void OutputFrame(output_state *o, const uint16_t *frame)
+{
+  uint64_t start = MicroTime();
+  const uint16_t *light = &frame[o->first * 3];
+
+  TRACE_BEGIN("serialize");
+
+  // start of frame all 0x00
+  for(int i = 0; i < 4; i++) {
+    o->wire[i] = 0x00;
+  }
+
+  if(!output_dither)
+  {
+    memset(o->dither, 0, o->count * 3 * sizeof(int32_t));
+  }
+
+  // write out frame in one pass, QUANTIZE_BLOCK LEDs at a time with their
+  // per channel factors on the stack. a short last block quantizes a few
+  // spare channels with the factors left over from the block before
+  uint8_t level[QUANTIZE_BLOCK];
+  alignas(64) uint32_t scale[QUANTIZE_BLOCK * 4] = { 0 };
+  alignas(64) uint32_t unit[QUANTIZE_BLOCK * 4] = { 0 };
+  alignas(64) uint8_t pwm[QUANTIZE_BLOCK * 4];
+  for(int first = 0; first < o->count; first += QUANTIZE_BLOCK)
+  {
+    int count = std::min(o->count - first, QUANTIZE_BLOCK);
+    const uint16_t *block = &light[first * 3];
+
+    // each LED's global brightness from its brightest channel, see OutputLutInit
+    for(int i = 0; i < count; i++)
+    {
+      level[i] = output_level[std::max(std::max(block[i*3], block[i*3+1]), block[i*3+2]) >> 8];
+      scale[i*3] = scale[i*3+1] = scale[i*3+2] = output_scale[level[i]];
+      unit[i*3] = unit[i*3+1] = unit[i*3+2] = output_unit[level[i]];
+    }
+
+    QuantizeLight(count * 3, block, &o->dither[first * 3], scale, unit, pwm);
+
+    for(int i = 0; i < count; i++)
+    {
+      uint8_t *led_frame = &o->wire[4 + (first + i) * 4];
+
+      led_frame[0] = 0b11100000 | level[i];
+
+      led_frame[1] = pwm[i*3];
+      led_frame[2] = pwm[i*3+1];
+      led_frame[3] = pwm[i*3+2];
+    }
+  }
+
+  // end of frame all FFs
+  for(int i = 0; i < 4; i++) {
+    o->wire[o->len - 4 + i] = 0xFF;
+  }
+
+  TRACE_END("serialize");
+
+  TRACE_BEGIN("transmit");
+  if(bench_output)
+  {
+    Sleep((uint64_t(o->len) * 8 * 1000000) / SPI_SPEED);
+  }
+  else
+  {
+    OutputWrite(o);
+  }
+  TRACE_END("transmit");
+
+  o->transmit_time = MicroTime() - start;
+}
+
+void OutputThread(output_state *o)
+{
+  BlockSignals();
+  RtThread(rt_transmit_cpu, RT_PRIORITY + 1);
+
+  while(true)
+  {
+    pthread_barrier_wait(&output_start);
+    OutputFrame(o, output_frame);
+    pthread_barrier_wait(&output_done);
+  }
+}
+
+void OutputLutInit(void)
+{
+  /*
+    Builds the tables buffer values are turned into wire values with.
+    output_lut holds each channel's light output out of 65535 after gamma,
+    the dimmer and the color balance; anything lit stays at least the
+    dimmest the LED can show. output_level gives the global brightness for
+    the high byte of a pixel's brightest channel and output_scale the 16.16
+    factor from light output to PWM at each level, output_unit the way
+    back for the dithering. Without output_hdr every LED runs at
+    LED_BRIGHTNESS, max brightness to reduce end of strip flicker, as
+    before.
+  */
+  const uint32_t step = (65535 + 255 * LED_BRIGHTNESS - 1) / (255 * LED_BRIGHTNESS);
+
+  for(int c = 0; c < 3; c++)
+  {
+    float gain = std::min(std::max(output_dimmer * output_balance[c], 0.0f), 1.0f);
+    for(int i = 0; i < 256; i++)
+    {
+      uint32_t light = lrintf(65535 * gain * powf(i / 255.0f, output_gamma));
+      output_lut[c][i] = (i && gain > 0) ? std::max(light, step) : light;
+    }
+  }
+
+  for(int i = 0; i < 256; i++)
+  {
+    uint32_t top = (i << 8) | 0xff;
+    output_level[i] = output_hdr ? std::max((top * LED_BRIGHTNESS + 65534) / 65535, 1u) : LED_BRIGHTNESS;
+  }
+
+  output_scale[0] = output_unit[0] = 0;
+  for(int level = 1; level <= LED_BRIGHTNESS; level++)
+  {
+    uint64_t light = uint64_t(65535) * level;
+    output_scale[level] = ((uint64_t(255 * LED_BRIGHTNESS) << 16) + light / 2) / light;
+    output_unit[level] = ((light << 8) + 255 * LED_BRIGHTNESS / 2) / (255 * LED_BRIGHTNESS);
+  }
+}
+
+void OutputInit(void)
+{
+  /*
+    Opens every output and, if there's more than one, starts a transmit
+    thread for each. Benchmarks set bench_output first and nothing is opened.
+  */
+  OutputLutInit();
+
+  for(int i = 0; i < OUTPUTS; i++)
+  {
+    output_state *o = &outputs[i];
+    o->map = &output_segments[i];
+    o->first = (o->map->first * num_leds) / 1000;
+    o->count = ((i + 1 < OUTPUTS) ? (output_segments[i + 1].first * num_leds) / 1000 : num_leds) - o->first;
+    o->len = 4 + (o->count * 4) + 4;
+    o->fd = bench_output ? -1 : OutputOpen(o);
+    if(!bench_output && o->fd < 0)
+    {
+      LOG(LOG_ERROR, "Failed to open %s", o->map->device);
+    }
+  }
+
+  if(OUTPUTS > 1)
+  {
+    pthread_barrier_init(&output_start, NULL, OUTPUTS + 1);
+    pthread_barrier_init(&output_done, NULL, OUTPUTS + 1);
+    for(int i = 0; i < OUTPUTS; i++)
+    {
+      std::thread(OutputThread, &outputs[i]).detach();
+    }
+  }
+}
+
+// render pool
+//
+// the render thread and render_threads - 1 helpers split per pixel work
+// into chunks. like the output threads they start and finish a job together
+// on two barriers, so nothing is created or allocated per frame. each
+// thread gets an equal run of chunks and when it runs out takes chunks from
+// the others, which evens out jobs like particles bunched on one wall.
+
+typedef void (*pool_task)(void *arg, int worker, int chunk);
+
+struct pool_queue
+{
+  alignas(64) std::atomic<int> next;
+  int end;
+};
+
+struct render_pool
+{
+  int threads;
+  pool_task task;
+  void *arg;
+  pthread_barrier_t start, done;
+  pool_queue queues[MAX_RENDER_THREADS];
+};
+
+render_pool pool = { 1 };
+int render_threads = RENDER_THREADS;
+
+void PoolWork(int worker)
+{
+  // own chunks first, then whatever's left of everyone else's
+  for(int i = 0; i < pool.threads; i++)
+  {
+    pool_queue *q = &pool.queues[(worker + i) % pool.threads];
+    int chunk;
+
+    while((chunk = q->next.fetch_add(1, std::memory_order_relaxed)) < q->end)
+    {
+      pool.task(pool.arg, worker, chunk);
+      if(i)
+      {
+        pool_steals.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+  }
+}
+
+int PoolCpu(int worker)
+{
+  // the helpers spread over the CPUs after the render thread's, leaving the
+  // render and transmit CPUs alone. -1 (not pinned) if there are no others.
+  int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int found = 0;
+
+  for(int j = 1; j < cpus; j++)
+  {
+    int cpu = ((rt_render_cpu + j) % cpus + cpus) % cpus;
+    if(cpu == rt_render_cpu || cpu == rt_transmit_cpu)
+    {
+      continue;
+    }
+    if(++found == worker)
+    {
+      return cpu;
+    }
+  }
+  return found ? PoolCpu((worker - 1) % found + 1) : -1;
+}
+
+void PoolThread(int worker)
+{
+  BlockSignals();
+  RtThread(PoolCpu(worker), RT_PRIORITY);
+
+  while(true)
+  {
+    // no task means PoolInit is stopping the helpers
+    pthread_barrier_wait(&pool.start);
+    uint8_t stop = !pool.task;
+    if(!stop)
+    {
+      PoolWork(worker);
+    }
+    pthread_barrier_wait(&pool.done);
+    if(stop)
+    {
+      break;
+    }
+  }
+}
+
+void PoolInit(int threads)
+{
+  /*
+    Starts threads - 1 helper threads, stopping any from before. One thread
+    runs everything on the render thread.
+  */
+  threads = std::min(std::max(threads, 1), MAX_RENDER_THREADS);
+
+  if(pool.threads > 1)
+  {
+    pool.task = NULL;
+    pthread_barrier_wait(&pool.start);
+    pthread_barrier_wait(&pool.done);
+    pthread_barrier_destroy(&pool.start);
+    pthread_barrier_destroy(&pool.done);
+  }
+
+  pool.threads = threads;
+  if(threads > 1)
+  {
+    pthread_barrier_init(&pool.start, NULL, threads);
+    pthread_barrier_init(&pool.done, NULL, threads);
+    for(int i = 1; i < threads; i++)
+    {
+      std::thread(PoolThread, i).detach();
+    }
+  }
+}
+
+void PoolRun(int chunks, pool_task task, void *arg)
+{
+  // runs task for chunks 0 to chunks - 1 across the pool and waits for them
+  if(pool.threads < 2 || chunks < 2)
+  {
+    for(int chunk = 0; chunk < chunks; chunk++)
+    {
+      task(arg, 0, chunk);
+    }
+    return;
+  }
+
+  pool.task = task;
+  pool.arg = arg;
+  for(int i = 0; i < pool.threads; i++)
+  {
+    pool.queues[i].next.store((i * chunks) / pool.threads, std::memory_order_relaxed);
+    pool.queues[i].end = ((i + 1) * chunks) / pool.threads;
+  }
+
+  pthread_barrier_wait(&pool.start);
+  PoolWork(0);
+  pthread_barrier_wait(&pool.done);
+}
+
+uint32_t LightSum(int n, const uint16_t *__restrict__ light)
+{
+  // all the light in a frame, in QuantizeLight's blocks so it vectorizes
+  uint32_t sum[QUANTIZE_BLOCK] = { 0 };
+
+  for(int block = 0; block < n; block += QUANTIZE_BLOCK)
+  {
+    for(int i = 0; i < QUANTIZE_BLOCK; i++)
+    {
+      sum[i] += light[block + i];
+    }
+  }
+
+  uint32_t total = 0;
+  for(int i = 0; i < QUANTIZE_BLOCK; i++)
+  {
+    total += sum[i];
+  }
+  return total;
+}
+
+void PowerLimit(uint16_t *light)
+{
+  /*
+    Estimates the frame's supply current from the light on every channel,
+    which is what the PWM duty and global brightness add up to, and if it's
+    over power_budget dims the whole frame to fit straight away. Once it
+    fits again the light comes back at POWER_RELEASE a frame so a flash of
+    white doesn't make the wall pump.
+  */
+  int n = num_leds * 3;
+
+  // the spare entries past the frame are summed too
+  memset(&light[n], 0, QUANTIZE_BLOCK * sizeof(uint16_t));
+  double channel_ma = LightSum(n, light) * (LED_CHANNEL_MA / 65535);
+  double idle_ma = num_leds * LED_IDLE_MA;
+  power_amps = (idle_ma + channel_ma) / 1000;
+
+  float fit = (power_budget > 0 && channel_ma > 0) ? std::max(power_budget * 1000 - idle_ma, 0.0) / channel_ma : 1;
+  power_gain = std::min(std::min(power_gain + float(POWER_RELEASE), fit), 1.0f);
+  if(power_gain >= 1)
+  {
+    return;
+  }
+
+  uint32_t gain = power_gain * 65536;
+  for(int block = 0; block < n; block += QUANTIZE_BLOCK)
+  {
+    for(int i = block; i < block + QUANTIZE_BLOCK; i++)
+    {
+      light[i] = (light[i] * gain) >> 16;
+    }
+  }
+
+  power_limited_frames.fetch_add(1, std::memory_order_relaxed);
+  power_limited_percent.fetch_add(lrintf((1 - power_gain) * 100), std::memory_order_relaxed);
+}
+
+void DisplayLight(uint16_t *light)
+{
+  /*
+    Sends a frame of 16 bit light to every output, dimmed to the power
+    budget first. With several outputs they serialize and transmit in
+    parallel and this returns once the last one is done, so all segments
+    latch the same frame.
+  */
+  PowerLimit(light);
+
+  if(OUTPUTS == 1)
+  {
+    OutputFrame(&outputs[0], light);
+  }
+  else
+  {
+    output_frame = light;
+    pthread_barrier_wait(&output_start);
+    pthread_barrier_wait(&output_done);
+  }
+
+#ifdef SIMULATOR
+  int len = 0;
+  for(int i = 0; i < OUTPUTS; i++)
+  {
+    len = std::max(len, outputs[i].len);
+  }
+  SimFrame(len);
+#endif
+}
+
+void LightBuffer(const uint8_t *buffer, uint16_t *light)
+{
+  // an 8 bit buffer as light through output_lut
+  for(int i = 0; i < num_leds; i++)
+  {
+    light[i*3] = output_lut[0][buffer[i*3]];
+    light[i*3+1] = output_lut[1][buffer[i*3+1]];
+    light[i*3+2] = output_lut[2][buffer[i*3+2]];
+  }
+}
+
+void CrossfadeLight(const uint8_t *buffer1, const uint8_t *buffer2, uint16_t *light, uint16_t progress)
+{
+  // the crossfade transition done on light, with 16 bits between the two
+  for(int i = 0; i < num_leds; i++)
+  {
+    for(int c = 0; c < 3; c++)
+    {
+      light[i*3+c] = (output_lut[c][buffer1[i*3+c]] * (256 - progress) + output_lut[c][buffer2[i*3+c]] * progress) >> 8;
+    }
+  }
+}
+
+void DisplayBuffer(uint8_t *buffer)
+{
+  // sends an 8 bit frame
+  if(trigger_probe.armed.load(std::memory_order_acquire))
+  {
+    TriggerProbe(buffer);
+  }
+
+  LightBuffer(buffer, display_light);
+  DisplayLight(display_light);
+}
+
+void LayoutInit(const layout_segment *layout, int count)
+{
+  /*
+    Lays the segments end to end along the strip and fills in the per LED
+    position and segment tables
+  */
+  num_leds = 0;
+  num_segments = 0;
+
+  for(int i = 0; i < count; i++)
+  {
+    if(num_segments == LAYOUT_SEGMENTS || num_leds + layout[i].count > MAX_LEDS)
+    {
+      LOG(LOG_ERROR, "layout is bigger than %d segments or %d LEDs", LAYOUT_SEGMENTS, MAX_LEDS);
+      break;
+    }
+
+    layout_segment *seg = &segments[num_segments];
+    *seg = layout[i];
+    seg->first = num_leds;
+    seg->corner = std::min(std::max(seg->corner, 0), seg->count - 1);
+
+    for(int j = 0; j < seg->count; j++)
+    {
+      float t = (seg->count > 1) ? float(j) / (seg->count - 1) : 0;
+      led_x[seg->first + j] = seg->x1 + (seg->x2 - seg->x1) * t;
+      led_y[seg->first + j] = seg->y1 + (seg->y2 - seg->y1) * t;
+      led_segment[seg->first + j] = num_segments;
+    }
+
+    num_leds += seg->count;
+    num_segments++;
+  }
+
+  float min_x = led_x[0], max_x = led_x[0], min_y = led_y[0], max_y = led_y[0];
+  for(int i = 1; i < num_leds; i++)
+  {
+    min_x = std::min(min_x, led_x[i]);
+    max_x = std::max(max_x, led_x[i]);
+    min_y = std::min(min_y, led_y[i]);
+    max_y = std::max(max_y, led_y[i]);
+  }
+  layout_cx = (min_x + max_x) / 2;
+  layout_cy = (min_y + max_y) / 2;
+
+  layout_radius = 1;
+  for(int i = 0; i < num_leds; i++)
+  {
+    float dx = led_x[i] - layout_cx;
+    float dy = led_y[i] - layout_cy;
+    led_angle[i] = atan2f(dy, dx);
+    layout_radius = std::max(layout_radius, sqrtf(dx * dx + dy * dy));
+  }
+}
+
+void LoadLayout(void)
+{
+  /*
+    Function reads the LED layout from YAML formatted layout.conf, or uses the
+    default wall if there isn't one
+  */
+  vector<layout_segment> layout;
+  layout_segment current;
+  char key[LAYOUT_NAME_SIZE] = "";
+  uint8_t have_key = 0;
+  uint8_t in_segments = 0;
+  uint8_t failed = 0;
+
+  FILE *fh = fopen("layout.conf", "r");
+  if(fh == NULL)
+  {
+    LayoutInit(default_layout, sizeof(default_layout) / sizeof(layout_segment));
+    return;
+  }
+
+  yaml_parser_t parser;
+  yaml_event_t event;
+  yaml_parser_initialize(&parser);
+  yaml_parser_set_input_file(&parser, fh);
+  memset(&current, 0, sizeof(current));
+
+  do {
+    if(!yaml_parser_parse(&parser, &event))
+    {
+      failed = 1;
+      break;
+    }
+
+    switch(event.type)
+    {
+    case YAML_SEQUENCE_END_EVENT:
+      in_segments = 0;
+      break;
+    case YAML_MAPPING_END_EVENT:
+      if(in_segments && current.count > 0)
+      {
+        layout.push_back(current);
+      }
+      memset(&current, 0, sizeof(current));
+      have_key = 0;
+      break;
+    case YAML_SCALAR_EVENT:
+    {
+      const char *value = reinterpret_cast<char*>(event.data.scalar.value);
+
+      if(!have_key)
+      {
+        snprintf(key, sizeof(key), "%s", value);
+        have_key = 1;
+        if(strcmp(key, "Segments") == 0)
+        {
+          // a sequence of segments follows, not a value
+          in_segments = 1;
+          have_key = 0;
+        }
+        break;
+      }
+      have_key = 0;
+
+      if(strcmp(key, "segment_name") == 0)
+      {
+        snprintf(current.name, LAYOUT_NAME_SIZE, "%s", value);
+      }
+      else if(strcmp(key, "leds") == 0)
+      {
+        current.count = atoi(value);
+      }
+      else if(strcmp(key, "corner") == 0)
+      {
+        current.corner = atoi(value);
+      }
+      else if(strcmp(key, "start") == 0)
+      {
+        sscanf(value, "%f,%f", &current.x1, &current.y1);
+      }
+      else if(strcmp(key, "end") == 0)
+      {
+        sscanf(value, "%f,%f", &current.x2, &current.y2);
+      }
+      else if(strcmp(key, "Door") == 0)
+      {
+        sscanf(value, "%f,%f", &door_x, &door_y);
+      }
+      break;
+    }
+    default:
+      break;
+    }
+
+    if(event.type != YAML_STREAM_END_EVENT)
+    {
+      yaml_event_delete(&event);
+    }
+  } while(event.type != YAML_STREAM_END_EVENT);
+
+  if(!failed)
+  {
+    yaml_event_delete(&event);
+  }
+  yaml_parser_delete(&parser);
+  fclose(fh);
+
+  if(failed || layout.empty())
+  {
+    LOG(LOG_ERROR, "Failed to read layout.conf, using the default layout");
+    LayoutInit(default_layout, sizeof(default_layout) / sizeof(layout_segment));
+    return;
+  }
+
+  LayoutInit(layout.data(), layout.size());
+  LOG(LOG_INFO, "layout: %d LEDs in %d segments", num_leds, num_segments);
+}
+
+long DaysFromCivil(int y, int m, int d)
+{
+  // days since 1970-01-01 of year y, month m (1-12), day d
+  y -= m <= 2;
+  long era = (y >= 0 ? y : y - 399) / 400;
+  long yoe = y - era * 400;
+  long doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  long doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+void CivilFromDays(long z, int *y, int *m, int *d)
+{
+  z += 719468;
+  long era = (z >= 0 ? z : z - 146096) / 146097;
+  long doe = z - era * 146097;
+  long yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  long doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  long mp = (5 * doy + 2) / 153;
+  *d = doy - (153 * mp + 2) / 5 + 1;
+  *m = mp + (mp < 10 ? 3 : -9);
+  *y = yoe + era * 400 + (*m <= 2);
+}
+
+int Weekday(long day)
+{
+  // tm_wday of a day number, 1970-01-01 was a Thursday
+  return int(((day % 7) + 11) % 7);
+}
+
+long LocalDay(time_t t, int *time_of_day)
+{
+  tm ltm;
+  localtime_r(&t, &ltm);
+  if(time_of_day)
+  {
+    *time_of_day = ltm.tm_hour * 3600 + ltm.tm_min * 60 + ltm.tm_sec;
+  }
+  return DaysFromCivil(ltm.tm_year + 1900, ltm.tm_mon + 1, ltm.tm_mday);
+}
+
+time_t LocalTime(long day, int time_of_day)
+{
+  // time_of_day seconds into a local day, through mktime for DST
+  tm ltm;
+  memset(&ltm, 0, sizeof(ltm));
+  CivilFromDays(day, &ltm.tm_year, &ltm.tm_mon, &ltm.tm_mday);
+  ltm.tm_year -= 1900;
+  ltm.tm_mon -= 1;
+  ltm.tm_hour = time_of_day / 3600;
+  ltm.tm_min = (time_of_day / 60) % 60;
+  ltm.tm_sec = time_of_day % 60;
+  ltm.tm_isdst = -1;
+  return mktime(&ltm);
+}
+
+void RuleInit(schedule_rule *r, const string &name)
+{
+  *r = schedule_rule();
+  r->name = name;
+  r->freq = RULE_DAILY;
+  r->interval = 1;
+  r->until_day = -1;
+}
+
+int FindEffect(const string &name)
+{
+  // effect number from its name, 0 if there's no such effect
+  for(int e = 1; e < EFFECTS; e++)
+  {
+    if(effects[e] == name)
+    {
+      return e;
+    }
+  }
+  return 0;
+}
+
+void RuleEffect(schedule_rule *r, const schedule_event *e)
+{
+  // a media file on its own means Playback
+  r->media = e->media;
+  r->effect = (e->effect != "") ? FindEffect(e->effect) : (e->media != "") ? PLAYBACK_EFFECT : 0;
+  if(e->effect != "" && !r->effect)
+  {
+    LOG(LOG_ERROR, "event %s: unknown effect %s", e->event_name.c_str(), e->effect.c_str());
+  }
+}
+
+int ParseClock(const string &text)
+{
+  // "18:00" to seconds after midnight
+  int h = 0, m = 0;
+  sscanf(text.c_str(), "%d:%d", &h, &m);
+  return h * 3600 + m * 60;
+}
+
+int ParseWeekday(const char *text, size_t len)
+{
+  // a day name by its first two letters, "Sa", "SA", "Sat" or "Saturday",
+  // as a tm_wday, -1 if it isn't one
+  const static char *days[] = { "SU", "MO", "TU", "WE", "TH", "FR", "SA" };
+
+  for(size_t i = 0; i < len; i++)
+  {
+    if(!isalpha((unsigned char) text[i]))
+    {
+      return -1;
+    }
+  }
+  for(int i = 0; i < 7 && len >= 2; i++)
+  {
+    if(strncasecmp(text, days[i], 2) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+uint8_t ParseWeekdays(const char *text)
+{
+  // comma separated Su,Mo,Tu,We,Th,Fr,Sa (or longer names), as a bit per
+  // tm_wday
+  uint8_t mask = 0;
+
+  while(*text)
+  {
+    text += strspn(text, " ");
+    size_t len = strcspn(text, ",");
+    size_t word = len;
+    while(word && text[word - 1] == ' ')
+    {
+      word--;
+    }
+
+    int day = ParseWeekday(text, word);
+    if(day >= 0)
+    {
+      mask |= 1 << day;
+    }
+    text += len + (text[len] == ',');
+  }
+  return mask;
+}
+
+void ParseByDay(const char *text, schedule_rule *r)
+{
+  /*
+    An RRULE BYDAY such as "1SA,-1FR": each ordinal stays with its own
+    weekday, and a day without one is every one of those days
+  */
+  uint8_t every = 0;
+
+  while(*text)
+  {
+    size_t len = strcspn(text, ",");
+    char *end;
+    long n = strtol(text, &end, 10);
+    int day = ParseWeekday(end, text + len - end);
+
+    if(day >= 0)
+    {
+      if(end == text)
+      {
+        every |= 1 << day;
+      }
+      else if(n >= 1 && n <= 5)
+      {
+        r->weekday_nth[day] |= 1 << (n - 1);
+      }
+      else if(n == -1)
+      {
+        r->weekday_nth[day] |= RULE_LAST_WEEK;
+      }
+      else
+      {
+        // other ordinals aren't supported, better no day than every one
+        day = -1;
+      }
+    }
+    if(day >= 0)
+    {
+      r->weekdays |= 1 << day;
+    }
+    text += len + (text[len] == ',');
+  }
+
+  for(int i = 0; i < 7; i++)
+  {
+    if(every & (1 << i))
+    {
+      r->weekday_nth[i] = 0;
+    }
+  }
+}
+
+uint8_t ParseWeekNumbers(const char *text)
+{
+  // "1,3" or "-1" for the last, as weekday_nth bits
+  uint8_t mask = 0;
+
+  while(*text)
+  {
+    char *end;
+    long n = strtol(text, &end, 10);
+    if(end == text)
+    {
+      text++;
+      continue;
+    }
+    if(n >= 1 && n <= 5)
+    {
+      mask |= 1 << (n - 1);
+    }
+    else if(n == -1)
+    {
+      mask |= RULE_LAST_WEEK;
+    }
+    text = end;
+  }
+  return mask;
+}
+
+uint32_t ParseNumbers(const char *text, int low, int high)
+{
+  // comma separated numbers from low to high as bits from bit 0
+  uint32_t mask = 0;
+
+  while(*text)
+  {
+    char *end;
+    long n = strtol(text, &end, 10);
+    if(end == text)
+    {
+      text++;
+      continue;
+    }
+    if(n >= low && n <= high)
+    {
+      mask |= 1u << (n - low);
+    }
+    text = end;
+  }
+  return mask;
+}
+
+void EventRule(const schedule_event *e)
+{
+  /*
+    A schedule.conf event as a rule that repeats every day its fields
+    allow. An end time at or before the start time runs past midnight.
+  */
+  const static char *mon[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+  schedule_rule r;
+
+  // an event without a start time has never turned the lights on
+  if(e->start_time == "")
+  {
+    LOG(LOG_WARN, "event %s has no start_time, ignored", e->event_name.c_str());
+    return;
+  }
+
+  RuleInit(&r, e->event_name);
+  r.open = (e->open_status == "true");
+  RuleEffect(&r, e);
+  r.first_day = LONG_MIN / 2;
+  r.time_of_day = ParseClock(e->start_time);
+
+  int end = (e->end_time != "") ? ParseClock(e->end_time) : 86400;
+  r.duration = end - r.time_of_day + ((end <= r.time_of_day) ? 86400 : 0);
+
+  if(e->day_of_week != "")
+  {
+    r.weekdays = ParseWeekdays(e->day_of_week.c_str());
+  }
+  // week numbers go with every day of the week, as they always have
+  uint8_t nth = 0;
+  if(e->week_day_number != "")
+  {
+    nth = ParseWeekNumbers(e->week_day_number.c_str());
+    memset(r.weekday_nth, nth, sizeof(r.weekday_nth));
+  }
+  for(int i = 0; i < 12; i++)
+  {
+    if(e->month.find(mon[i]) != std::string::npos)
+    {
+      r.months |= 1 << i;
+    }
+  }
+  if(e->day_of_month != "")
+  {
+    r.monthdays = ParseNumbers(e->day_of_month.c_str(), 1, 31);
+  }
+  if(e->year != "")
+  {
+    r.year = atoi(e->year.c_str());
+  }
+
+  // a field with nothing valid in it never matches, like it did before
+  const char *invalid = NULL;
+  if(e->day_of_week != "" && !r.weekdays)
+  {
+    invalid = "day_of_week";
+  }
+  else if(e->month != "" && !r.months)
+  {
+    invalid = "month";
+  }
+  else if(e->day_of_month != "" && !r.monthdays)
+  {
+    invalid = "day";
+  }
+  else if(e->week_day_number != "" && !nth)
+  {
+    invalid = "week_day_number";
+  }
+  if(invalid)
+  {
+    LOG(LOG_WARN, "event %s has no valid %s, ignored", e->event_name.c_str(), invalid);
+    return;
+  }
+
+  schedule_rules.push_back(r);
+}
+
+time_t ParseIcsTime(const char *value, uint8_t *date_only)
+{
+  // 20240105, 20240105T180000 (local) or 20240105T180000Z (UTC)
+  tm t;
+  memset(&t, 0, sizeof(t));
+  *date_only = 0;
+
+  if(sscanf(value, "%4d%2d%2d", &t.tm_year, &t.tm_mon, &t.tm_mday) != 3)
+  {
+    return 0;
+  }
+  t.tm_year -= 1900;
+  t.tm_mon -= 1;
+
+  if(value[8] != 'T')
+  {
+    *date_only = 1;
+    t.tm_isdst = -1;
+    return mktime(&t);
+  }
+
+  sscanf(value + 9, "%2d%2d%2d", &t.tm_hour, &t.tm_min, &t.tm_sec);
+  if(value[15] == 'Z')
+  {
+    return timegm(&t);
+  }
+  t.tm_isdst = -1;
+  return mktime(&t);
+}
+
+int ParseIcsDuration(const char *value)
+{
+  // P1D, PT2H30M, P1W, ... in seconds
+  int seconds = 0, n = 0;
+  uint8_t negative = (*value == '-');
+
+  for(const char *c = value; *c; c++)
+  {
+    if(isdigit(*c))
+    {
+      n = n * 10 + (*c - '0');
+      continue;
+    }
+    switch(*c)
+    {
+      case 'W': seconds += n * 7 * 86400; break;
+      case 'D': seconds += n * 86400; break;
+      case 'H': seconds += n * 3600; break;
+      case 'M': seconds += n * 60; break;
+      case 'S': seconds += n; break;
+    }
+    n = 0;
+  }
+  return negative ? -seconds : seconds;
+}
+
+void ParseRrule(schedule_rule *r, const char *value)
+{
+  // FREQ, INTERVAL, COUNT, UNTIL, BYDAY, BYMONTHDAY and BYMONTH of an RRULE
+  char part[256];
+  const char *next = value;
+
+  while(*next)
+  {
+    size_t len = strcspn(next, ";");
+    snprintf(part, sizeof(part), "%.*s", int(len), next);
+    next += len + (next[len] == ';');
+
+    char *eq = strchr(part, '=');
+    if(!eq)
+    {
+      continue;
+    }
+    *eq = 0;
+    const char *v = eq + 1;
+
+    if(strcmp(part, "FREQ") == 0)
+    {
+      r->freq = (strcmp(v, "DAILY") == 0) ? RULE_DAILY : (strcmp(v, "WEEKLY") == 0) ? RULE_WEEKLY :
+                (strcmp(v, "MONTHLY") == 0) ? RULE_MONTHLY : (strcmp(v, "YEARLY") == 0) ? RULE_YEARLY : RULE_ONCE;
+    }
+    else if(strcmp(part, "INTERVAL") == 0)
+    {
+      r->interval = std::max(atoi(v), 1);
+    }
+    else if(strcmp(part, "COUNT") == 0)
+    {
+      r->count = atoi(v);
+    }
+    else if(strcmp(part, "UNTIL") == 0)
+    {
+      uint8_t date_only;
+      time_t until = ParseIcsTime(v, &date_only);
+      r->until_day = LocalDay(until, &r->until_time);
+      if(date_only)
+      {
+        r->until_time = 86400;
+      }
+    }
+    else if(strcmp(part, "BYDAY") == 0)
+    {
+      ParseByDay(v, r);
+    }
+    else if(strcmp(part, "BYMONTHDAY") == 0)
+    {
+      r->monthdays = ParseNumbers(v, 1, 31);
+    }
+    else if(strcmp(part, "BYMONTH") == 0)
+    {
+      r->months = ParseNumbers(v, 1, 12);
+    }
+  }
+}
+
+void LoadCalendar(FILE *fh, const schedule_event *e)
+{
+  /*
+    Adds a rule for every VEVENT in an iCalendar file, with the open_status
+    of the schedule.conf event that named it. Handles DTSTART, DTEND or
+    DURATION, RRULE, EXDATE, STATUS:CANCELLED, and RECURRENCE-ID overrides,
+    which replace that occurrence of the event with the same UID.
+  */
+  char line[1024];
+  string logical, pending;
+  schedule_rule r;
+  uint8_t in_event = 0, date_only = 0, cancelled = 0, has_rrule = 0;
+  time_t end = 0, recurrence_id = 0;
+  int duration = -1;
+  size_t first_rule = schedule_rules.size();
+  vector<std::pair<string, time_t> > overrides;
+
+  // lines starting with a space continue the one before
+  while(true)
+  {
+    uint8_t eof = (fgets(line, sizeof(line), fh) == NULL);
+    if(!eof)
+    {
+      line[strcspn(line, "\r\n")] = 0;
+      if(line[0] == ' ' || line[0] == '\t')
+      {
+        pending += line + 1;
+        continue;
+      }
+    }
+    logical = pending;
+    pending = eof ? "" : line;
+    if(logical.empty())
+    {
+      if(eof)
+      {
+        break;
+      }
+      continue;
+    }
+
+    size_t colon = logical.find(':');
+    if(colon == string::npos)
+    {
+      continue;
+    }
+    string name = logical.substr(0, logical.find_first_of(";:"));
+    string params = logical.substr(name.size(), colon - name.size());
+    const char *value = logical.c_str() + colon + 1;
+
+    if(name == "BEGIN" && strcmp(value, "VEVENT") == 0)
+    {
+      RuleInit(&r, e->event_name);
+      r.open = (e->open_status == "true");
+      RuleEffect(&r, e);
+      in_event = 1;
+      cancelled = has_rrule = 0;
+      end = recurrence_id = 0;
+      duration = -1;
+    }
+    else if(!in_event)
+    {
+      continue;
+    }
+    else if(name == "END" && strcmp(value, "VEVENT") == 0)
+    {
+      in_event = 0;
+      if(cancelled || !r.start)
+      {
+        continue;
+      }
+
+      r.duration = (duration >= 0) ? duration : end ? int(end - r.start) : (date_only ? 86400 : 0);
+      r.first_day = LocalDay(r.start, &r.time_of_day);
+      if(!has_rrule)
+      {
+        r.freq = RULE_ONCE;
+      }
+      // what repeats when the RRULE doesn't say, from the first occurrence
+      else if(r.freq == RULE_WEEKLY && !r.weekdays)
+      {
+        r.weekdays = 1 << Weekday(r.first_day);
+      }
+      else if((r.freq == RULE_MONTHLY || r.freq == RULE_YEARLY) && !r.weekdays && !r.monthdays)
+      {
+        int y, m, d;
+        CivilFromDays(r.first_day, &y, &m, &d);
+        r.monthdays = 1u << (d - 1);
+        if(r.freq == RULE_YEARLY && !r.months)
+        {
+          r.months = 1 << (m - 1);
+        }
+      }
+      // BYDAY without numbers means every one of those days
+      if(r.weekdays && r.freq != RULE_MONTHLY && r.freq != RULE_YEARLY)
+      {
+        memset(r.weekday_nth, 0, sizeof(r.weekday_nth));
+      }
+
+      if(recurrence_id)
+      {
+        overrides.push_back(std::make_pair(r.uid, recurrence_id));
+      }
+      std::sort(r.exdates.begin(), r.exdates.end());
+      std::sort(r.exdays.begin(), r.exdays.end());
+      if(r.duration > 0)
+      {
+        schedule_rules.push_back(r);
+      }
+    }
+    else if(name == "SUMMARY")
+    {
+      r.name = value;
+    }
+    else if(name == "UID")
+    {
+      r.uid = value;
+    }
+    else if(name == "STATUS")
+    {
+      cancelled = (strcmp(value, "CANCELLED") == 0);
+    }
+    else if(name == "DTSTART")
+    {
+      r.start = ParseIcsTime(value, &date_only);
+    }
+    else if(name == "DTEND")
+    {
+      uint8_t end_date_only;
+      end = ParseIcsTime(value, &end_date_only);
+    }
+    else if(name == "DURATION")
+    {
+      duration = ParseIcsDuration(value);
+    }
+    else if(name == "RRULE")
+    {
+      has_rrule = 1;
+      ParseRrule(&r, value);
+    }
+    else if(name == "RECURRENCE-ID")
+    {
+      uint8_t id_date_only;
+      recurrence_id = ParseIcsTime(value, &id_date_only);
+    }
+    else if(name == "EXDATE")
+    {
+      // a comma separated list, possibly VALUE=DATE
+      const char *v = value;
+      while(*v)
+      {
+        uint8_t ex_date_only;
+        time_t t = ParseIcsTime(v, &ex_date_only);
+        if(ex_date_only || params.find("VALUE=DATE") != string::npos)
+        {
+          r.exdays.push_back(LocalDay(t, NULL));
+        }
+        else
+        {
+          r.exdates.push_back(t);
+        }
+        v += strcspn(v, ",");
+        v += (*v == ',');
+      }
+    }
+  }
+
+  // an overridden occurrence is skipped in the recurring event it came from
+  for(size_t i = 0; i < overrides.size(); i++)
+  {
+    for(size_t j = first_rule; j < schedule_rules.size(); j++)
+    {
+      schedule_rule *master = &schedule_rules[j];
+      if(master->freq != RULE_ONCE && master->uid == overrides[i].first)
+      {
+        master->exdates.insert(std::upper_bound(master->exdates.begin(), master->exdates.end(), overrides[i].second), overrides[i].second);
+      }
+    }
+  }
+}
+
+void CompileSchedule(void)
+{
+  // turns the schedule.conf events and their calendars into rules
+  schedule_rules.clear();
+
+  for(size_t i = 0; i < schedule.size(); i++)
+  {
+    const schedule_event *e = &schedule[i];
+    if(e->disabled == "true")
+    {
+      continue;
+    }
+
+    if(e->calendar == "")
+    {
+      EventRule(e);
+      continue;
+    }
+
+    FILE *fh = fopen(e->calendar.c_str(), "r");
+    if(fh == NULL)
+    {
+      LOG(LOG_ERROR, "Failed to open calendar %s", e->calendar.c_str());
+      continue;
+    }
+    LoadCalendar(fh, e);
+    fclose(fh);
+  }
+
+  // expanded on the next lookup
+  schedule_end = 0;
+}
+
+void LoadSchedule(void)
+{
+  /*
+    Function reads in schedule from YAML formatted configuration file into the
+    schedule list.
+  */
+
+  schedule_reloads.fetch_add(1, std::memory_order_relaxed);
+  schedule.clear();
+
+  uint8_t in_events = 0;
+  uint8_t in_sequence = 0;
+  uint8_t in_mapping = 0;
+  uint8_t in_read = 0;
+
+  FILE *fh = fopen("schedule.conf", "r");
+  yaml_parser_t parser;
+  yaml_event_t  event;   /* New variable */
+
+  schedule_event current;
+
+  /* Initialize parser */
+  if(!yaml_parser_initialize(&parser))
+    LOG(LOG_ERROR, "Failed to initialize parser!");
+  if(fh == NULL)
+  {
+    LOG(LOG_ERROR, "Failed to open schedule file!");
+    yaml_parser_delete(&parser);
+    return;
+  }
+
+  /* Set input file */
+  yaml_parser_set_input_file(&parser, fh);
+
+  /* START new code */
+  do {
+    if (!yaml_parser_parse(&parser, &event)) {
+       printf("Parser error %d\n", parser.error);
+       exit(EXIT_FAILURE);
+    }
+
+    switch(event.type)
+    {
+    case YAML_NO_EVENT:
+      //puts("No event!");
+      break;
+    /* Stream start/end */
+    case YAML_STREAM_START_EVENT:
+      //puts("STREAM START");
+      break;
+    case YAML_STREAM_END_EVENT:
+      //puts("STREAM END");
+      break;
+    /* Block delimeters */
+    case YAML_DOCUMENT_START_EVENT:
+      //puts("Start Document");
+      break;
+    case YAML_DOCUMENT_END_EVENT:
+      //puts("End Document");
+      break;
+    case YAML_SEQUENCE_START_EVENT:
+      //puts("Start Sequence");
+      break;
+    case YAML_SEQUENCE_END_EVENT:
+      //puts("End Sequence");
+      in_events = 0;
+      break;
+    case YAML_MAPPING_START_EVENT:
+      //puts("Start Mapping");
+      break;
+    case YAML_MAPPING_END_EVENT:
+      //puts("End Mapping");
+
+      if(in_events)
+      {
+        schedule.push_back(current);
+      }
+
+      current = schedule_event();
+
+      break;
+    /* Data */
+    case YAML_ALIAS_EVENT:
+      //printf("Got alias (anchor %s)\n", event.data.alias.anchor);
+      break;
+    case YAML_SCALAR_EVENT:
+
+      if(in_events)
+      {
+        // we've found that we're in the events section so ok to read data
+
+        if(in_read)
+        {
+          // we've previously found a data type to read so next bit of data goes in there
+          switch(in_read)
+          {
+            case 1:
+              // read in Event Name next
+              current.event_name = reinterpret_cast<char*>(event.data.scalar.value);
+
+              break;
+            case 2:
+              // read in Start Time next
+              current.start_time = reinterpret_cast<char*>(event.data.scalar.value);
+
+              break;
+            case 3:
+              // read in End Time next
+              current.end_time = reinterpret_cast<char*>(event.data.scalar.value);
+
+              break;
+            case 4:
+              // read in Day of Week next
+              current.day_of_week = reinterpret_cast<char*>(event.data.scalar.value);
+
+              break;
+            case 5:
+              // read in Disabled next
+              current.disabled = reinterpret_cast<char*>(event.data.scalar.value);
+
+              break;
+            case 6:
+              // read in Month next
+              current.month = reinterpret_cast<char*>(event.data.scalar.value);
+
+              break;
+            case 7:
+              // read in Day next
+              current.day_of_month = reinterpret_cast<char*>(event.data.scalar.value);
+
+              break;
+            case 8:
+              // read in Yeak next
+              current.year = reinterpret_cast<char*>(event.data.scalar.value);
+
+              break;
+            case 9:
+              // read in Week day number next
+              current.week_day_number = reinterpret_cast<char*>(event.data.scalar.value);
+
+              break;
+            case 10:
+              // read in open status next
+              current.open_status = reinterpret_cast<char*>(event.data.scalar.value);
+
+              break;
+            case 11:
+              // read in calendar file next
+              current.calendar = reinterpret_cast<char*>(event.data.scalar.value);
+
+              break;
+            case 12:
+              // read in effect next
+              current.effect = reinterpret_cast<char*>(event.data.scalar.value);
+
+              break;
+            case 13:
+              // read in media file next
+              current.media = reinterpret_cast<char*>(event.data.scalar.value);
+
+              break;
+          }
+          in_read = 0;
+        }
+        else
+        {
+          // read scalar of variable names
+          if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "event_name") == 0)
+          {
+            // read in Event Name next
+            in_read = 1;
+          }
+          if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "start_time") == 0)
+          {
+            // read in Start Time next
+            in_read = 2;
+          }
+          if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "end_time") == 0)
+          {
+            // read in End Time next
+            in_read = 3;
+          }
+          if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "day_of_week") == 0)
+          {
+            // read in Day of Week next
+            in_read = 4;
+          }
           if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "disabled") == 0)
           {
             // read in Disabled
@@ -447,997 +3148,6738 @@ uint8_t InSchedule(void)
           }
           if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "week_day_number") == 0)
           {
-            // read in Day of Week next
-            in_read = 9;
+            // read in Day of Week next
+            in_read = 9;
+          }
+          if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "open_status") == 0)
+          {
+            // read in Open Status
+            in_read = 10;
+          }
+          if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "calendar") == 0)
+          {
+            // read in Calendar
+            in_read = 11;
+          }
+          if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "effect") == 0)
+          {
+            // read in Effect
+            in_read = 12;
+          }
+          if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "media") == 0)
+          {
+            // read in Media
+            in_read = 13;
+          }
+        }
+      }
+
+      if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "Events") == 0)
+      {
+        in_events = 1;
+        // puts("Found Events");
+      }
+      break;
+    }
+    if(event.type != YAML_STREAM_END_EVENT)
+      yaml_event_delete(&event);
+  } while(event.type != YAML_STREAM_END_EVENT);
+  yaml_event_delete(&event);
+  /* END new code */
+
+  /* Cleanup */
+  yaml_parser_delete(&parser);
+  fclose(fh);
+
+  CompileSchedule();
+}
+
+
+void DayInfo(long day, schedule_day *info)
+{
+  // the date parts of a day, with the bit for which week of the month
+  // it's in and RULE_LAST_WEEK in the last 7 days
+  int y, m, d;
+  CivilFromDays(day, &y, &m, &d);
+  int days_in_month = DaysFromCivil(y + (m == 12), (m % 12) + 1, 1) - DaysFromCivil(y, m, 1);
+
+  info->year = y;
+  info->month = m - 1;
+  info->mday = d;
+  info->wday = Weekday(day);
+  info->nth = (1 << ((d - 1) / 7)) | ((d + 7 > days_in_month) ? RULE_LAST_WEEK : 0);
+}
+
+time_t ScheduleTime(long day, int time_of_day)
+{
+  // LocalTime without mktime for days in the window that aren't a DST change
+  long i = day - schedule_first_day;
+  if(i >= 0 && i < long(schedule_days.size()) && schedule_days[i].length == 86400)
+  {
+    return schedule_days[i].midnight + time_of_day;
+  }
+  return LocalTime(day, time_of_day);
+}
+
+uint8_t RuleMatchesDay(const schedule_rule *r, long day, const schedule_day *info)
+{
+  // whether a rule has an occurrence starting on day, ignoring COUNT
+  if(day < r->first_day || (r->until_day >= 0 && day > r->until_day))
+  {
+    return 0;
+  }
+
+  if(r->year && r->year != info->year) return 0;
+  if(r->months && !(r->months & (1 << info->month))) return 0;
+  if(r->monthdays && !(r->monthdays & (1u << (info->mday - 1)))) return 0;
+  if(r->weekdays && !(r->weekdays & (1 << info->wday))) return 0;
+  if(r->weekday_nth[info->wday] && !(r->weekday_nth[info->wday] & info->nth)) return 0;
+
+  if(r->interval > 1)
+  {
+    int fy, fm, fd;
+    CivilFromDays(r->first_day, &fy, &fm, &fd);
+    switch(r->freq)
+    {
+      case RULE_DAILY:
+        return((day - r->first_day) % r->interval == 0);
+      case RULE_WEEKLY:
+        // weeks start on Monday
+        return(((day - (info->wday + 6) % 7) - (r->first_day - (Weekday(r->first_day) + 6) % 7)) / 7 % r->interval == 0);
+      case RULE_MONTHLY:
+        return(((info->year * 12 + info->month + 1) - (fy * 12 + fm)) % r->interval == 0);
+      case RULE_YEARLY:
+        return((info->year - fy) % r->interval == 0);
+    }
+  }
+
+  return 1;
+}
+
+void RuleExpand(const schedule_rule *r, int id, long from, long to, vector<std::pair<time_t, int> > *edges)
+{
+  /*
+    Adds a start and an end edge for every occurrence of r, rule number id,
+    that overlaps days from to to. Edges are +1/-1 for on and +2/-2 on top
+    for open, and a rule that picks the effect adds 4 times 1 + id.
+  */
+  int weight = (r->open ? 2 : 1) + (r->effect ? 4 * (id + 1) : 0);
+
+  if(r->freq == RULE_ONCE)
+  {
+    if(r->start + r->duration >= ScheduleTime(from, 0) && r->start < ScheduleTime(to + 1, 0))
+    {
+      edges->push_back(std::make_pair(r->start, weight));
+      edges->push_back(std::make_pair(r->start + r->duration, -weight));
+    }
+    return;
+  }
+
+  // a COUNT has to be counted from the first one, otherwise start early
+  // enough to catch occurrences running into the window
+  long first = r->count ? r->first_day : std::max(r->first_day, from - 1 - r->duration / 86400);
+  long last = (r->until_day >= 0) ? std::min(to, r->until_day) : to;
+  int occurrences = 0;
+
+  for(long day = first; day <= last; day++)
+  {
+    schedule_day before;
+    long i = day - schedule_first_day;
+    if(i < 0 || i >= long(schedule_days.size()))
+    {
+      DayInfo(day, &before);
+    }
+    if(!RuleMatchesDay(r, day, (i < 0 || i >= long(schedule_days.size())) ? &before : &schedule_days[i]))
+    {
+      continue;
+    }
+    if(r->until_day == day && r->time_of_day > r->until_time)
+    {
+      break;
+    }
+    if(r->count && ++occurrences > r->count)
+    {
+      break;
+    }
+    if(day < from - 1 - r->duration / 86400)
+    {
+      continue;
+    }
+
+    time_t start = ScheduleTime(day, r->time_of_day);
+    if(std::binary_search(r->exdays.begin(), r->exdays.end(), day) ||
+       std::binary_search(r->exdates.begin(), r->exdates.end(), start))
+    {
+      continue;
+    }
+    edges->push_back(std::make_pair(start, weight));
+    edges->push_back(std::make_pair(start + r->duration, -weight));
+  }
+}
+
+void ScheduleCompile(long from, long to)
+{
+  /*
+    Expands every rule over days from to to and sweeps the occurrences into
+    schedule_changes, the sorted times the lights or open status change, so
+    ScheduleActive is a binary search
+  */
+  vector<std::pair<time_t, int> > edges;
+
+  // every day an occurrence can start on, a couple before for overnight ones
+  schedule_first_day = from - 2;
+  schedule_days.resize(to - from + 4);
+  time_t midnight = LocalTime(schedule_first_day, 0);
+  for(size_t i = 0; i < schedule_days.size(); i++)
+  {
+    time_t next = LocalTime(schedule_first_day + i + 1, 0);
+    DayInfo(schedule_first_day + i, &schedule_days[i]);
+    schedule_days[i].midnight = midnight;
+    schedule_days[i].length = next - midnight;
+    midnight = next;
+  }
+
+  for(size_t i = 0; i < schedule_rules.size(); i++)
+  {
+    RuleExpand(&schedule_rules[i], i, from, to, &edges);
+  }
+  std::sort(edges.begin(), edges.end());
+
+  schedule_changes.clear();
+  int on = 0, open = 0;
+  uint8_t was_on = 0, was_open = 0;
+  uint16_t was_rule = 0;
+  // how many occurrences of each rule picking the effect are running, and
+  // those rules in schedule.conf order, none for a plain schedule
+  vector<int> effect_counts(schedule_rules.size() + 1);
+  vector<uint16_t> effect_rules;
+  for(size_t i = 0; i < schedule_rules.size(); i++)
+  {
+    if(schedule_rules[i].effect)
+    {
+      effect_rules.push_back(i + 1);
+    }
+  }
+
+  for(size_t i = 0; i < edges.size(); i++)
+  {
+    int weight = edges[i].second;
+    int sign = (weight > 0) ? 1 : -1;
+    on += sign;
+    open += ((abs(weight) & 3) == 2) ? sign : 0;
+    effect_counts[abs(weight) >> 2] += sign;
+
+    // only once every edge at this time is in
+    if(i + 1 < edges.size() && edges[i + 1].first == edges[i].first)
+    {
+      continue;
+    }
+
+    // the first event in schedule.conf wins if several pick an effect
+    uint8_t now_on = on > 0;
+    uint8_t now_open = open > 0;
+    uint16_t now_rule = 0;
+    for(size_t j = 0; j < effect_rules.size() && !now_rule; j++)
+    {
+      now_rule = (effect_counts[effect_rules[j]] > 0) ? effect_rules[j] : 0;
+    }
+
+    if(now_on != was_on || now_open != was_open || now_rule != was_rule)
+    {
+      schedule_change change = { edges[i].first, now_on, now_open, now_rule };
+      schedule_changes.push_back(change);
+      was_on = now_on;
+      was_open = now_open;
+      was_rule = now_rule;
+    }
+  }
+
+  // far enough from the end that NextScheduleChange sees IDLE_MAX_SLEEP ahead
+  schedule_start = ScheduleTime(from + 1, 0);
+  schedule_end = ScheduleTime(to, 0) - IDLE_MAX_SLEEP;
+}
+
+const schedule_change *ScheduleLookup(time_t now)
+{
+  // the change in effect at now, NULL if nothing's been on yet
+  if(now < schedule_start || now >= schedule_end)
+  {
+    long day = LocalDay(now, NULL);
+    ScheduleCompile(day - 1, day + SCHEDULE_WINDOW);
+  }
+
+  schedule_change key = { now, 0, 0, 0 };
+  vector<schedule_change>::const_iterator it = std::upper_bound(schedule_changes.begin(), schedule_changes.end(), key,
+    [](const schedule_change &a, const schedule_change &b) { return a.at < b.at; });
+
+  return (it == schedule_changes.begin()) ? NULL : &*(it - 1);
+}
+
+uint8_t ScheduleActive(time_t now)
+{
+  const schedule_change *change = ScheduleLookup(now);
+  return change ? change->on : 0;
+}
+
+uint8_t ScheduleOpen(time_t now)
+{
+  const schedule_change *change = ScheduleLookup(now);
+  return change ? change->open : 0;
+}
+
+const schedule_rule *ScheduleEffect(time_t now)
+{
+  // the event picking the effect at now, NULL for random effects
+  const schedule_change *change = ScheduleLookup(now);
+  return (change && change->on && change->effect_rule) ? &schedule_rules[change->effect_rule - 1] : NULL;
+}
+
+uint64_t ScheduleSignature(void)
+{
+  // changes when schedule.conf or any calendar it names is written
+  uint64_t signature = 0;
+  struct stat st;
+
+  if(stat("schedule.conf", &st) == 0)
+  {
+    signature = uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec + st.st_size;
+  }
+  for(size_t i = 0; i < schedule.size(); i++)
+  {
+    if(schedule[i].calendar != "" && stat(schedule[i].calendar.c_str(), &st) == 0)
+    {
+      signature = signature * 31 + uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec + st.st_size;
+    }
+  }
+  return signature;
+}
+
+uint8_t InSchedule(void)
+{
+  /*
+    Function works out if it's currently time to turn on the lights or not,
+    reading the schedule again first if it's been written since last time.
+  */
+  uint64_t signature = ScheduleSignature();
+  if(signature != schedule_signature || !schedule_end)
+  {
+    LoadSchedule();
+    schedule_signature = ScheduleSignature();
+  }
+
+  time_t now = Now();
+  uint8_t open = ScheduleOpen(now);
+  if(open != schedule_open)
+  {
+    LOG(LOG_INFO, "shop %s", open ? "open" : "closed");
+    schedule_open = open;
+  }
+
+  return ScheduleActive(now);
+}
+
+time_t NextScheduleChange(time_t now)
+{
+  /*
+    Finds when the lights next go on or off in the compiled schedule. Gives
+    up after IDLE_MAX_SLEEP seconds.
+  */
+  uint8_t state = ScheduleActive(now);
+  schedule_change key = { now, 0, 0, 0 };
+  vector<schedule_change>::const_iterator it = std::upper_bound(schedule_changes.begin(), schedule_changes.end(), key,
+    [](const schedule_change &a, const schedule_change &b) { return a.at < b.at; });
+
+  for(; it != schedule_changes.end() && it->at < now + IDLE_MAX_SLEEP; it++)
+  {
+    if(it->on != state)
+    {
+      return it->at;
+    }
+  }
+
+  return now + IDLE_MAX_SLEEP;
+}
+
+// palettes
+
+// used when there's no palettes.conf
+const static char *default_palettes[][3] = {
+  { "Rainbow", "hsv", "#ff0000, #ffff00, #00ff00, #00ffff, #0000ff, #ff00ff" },
+  { "Sunset", "oklab", "#ff6000, #ff0040, #6000a0, #ffb000" },
+  { "Ocean", "oklab", "#0010a0, #00a0ff, #00ffa0, #0040ff" },
+  { "Forest", "oklab", "#004000, #40ff00, #a0a000, #00a040" },
+  { "Lava", "oklab", "#ff0000, #ff8000, #400000, #ff2000" },
+  { "Ice", "oklab", "#ffffff, #80c0ff, #0040ff, #c0e0ff" }
+};
+
+vector<palette> palettes;
+// made from the personal colors at the start of each turn
+palette personal_palette;
+
+int HexDigit(char c)
+{
+  if(c >= '0' && c <= '9') return c - '0';
+  if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+uint8_t ParseColor(const char *text, size_t len, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+  // "#rrggbb", black doesn't count as a color
+  if(len != 7 || text[0] != '#')
+  {
+    return 0;
+  }
+
+  int v[6];
+  for(int i = 0; i < 6; i++)
+  {
+    v[i] = HexDigit(text[i + 1]);
+    if(v[i] < 0)
+    {
+      return 0;
+    }
+  }
+
+  *r = v[0] * 16 + v[1];
+  *g = v[2] * 16 + v[3];
+  *b = v[4] * 16 + v[5];
+  return (*r || *g || *b);
+}
+
+float SrgbToLinear(float c)
+{
+  return (c <= 0.04045f) ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+float LinearToSrgb(float c)
+{
+  c = std::min(std::max(c, 0.0f), 1.0f);
+  return (c <= 0.0031308f) ? c * 12.92f : 1.055f * powf(c, 1 / 2.4f) - 0.055f;
+}
+
+void RgbToOklab(uint8_t r, uint8_t g, uint8_t b, float *lab)
+{
+  // Björn Ottosson's OKLab, where equal steps look equally far apart
+  float lr = SrgbToLinear(r / 255.0f), lg = SrgbToLinear(g / 255.0f), lb = SrgbToLinear(b / 255.0f);
+  float l = cbrtf(0.4122214708f * lr + 0.5363325363f * lg + 0.0514459929f * lb);
+  float m = cbrtf(0.2119034982f * lr + 0.6806995451f * lg + 0.1073969566f * lb);
+  float s = cbrtf(0.0883024619f * lr + 0.2817188376f * lg + 0.6299787005f * lb);
+
+  lab[0] = 0.2104542553f * l + 0.7936177850f * m - 0.0040720468f * s;
+  lab[1] = 1.9779984951f * l - 2.4285922050f * m + 0.4505937099f * s;
+  lab[2] = 0.0259040371f * l + 0.7827717662f * m - 0.8086757660f * s;
+}
+
+void OklabToRgb(const float *lab, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+  float l = lab[0] + 0.3963377774f * lab[1] + 0.2158037573f * lab[2];
+  float m = lab[0] - 0.1055613458f * lab[1] - 0.0638541728f * lab[2];
+  float s = lab[0] - 0.0894841775f * lab[1] - 1.2914855480f * lab[2];
+  l = l * l * l;
+  m = m * m * m;
+  s = s * s * s;
+
+  *r = lrintf(LinearToSrgb(4.0767416621f * l - 3.3077115913f * m + 0.2309699292f * s) * 255);
+  *g = lrintf(LinearToSrgb(-1.2684380046f * l + 2.6097574011f * m - 0.3413193965f * s) * 255);
+  *b = lrintf(LinearToSrgb(-0.0041960863f * l - 0.7034186147f * m + 1.7076147010f * s) * 255);
+}
+
+void RgbToHsv(uint8_t r, uint8_t g, uint8_t b, float *hsv)
+{
+  // hue 0 to 1
+  float hi = std::max(std::max(r, g), b), lo = std::min(std::min(r, g), b);
+  float range = hi - lo;
+  float h = 0;
+
+  if(range > 0)
+  {
+    h = (hi == r) ? (g - b) / range : (hi == g) ? 2 + (b - r) / range : 4 + (r - g) / range;
+  }
+  hsv[0] = (h < 0) ? h / 6 + 1 : h / 6;
+  hsv[1] = hi ? range / hi : 0;
+  hsv[2] = hi / 255;
+}
+
+void HsvToRgb(const float *hsv, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+  // the same hue to primaries as the shaders' hsv()
+  float h = hsv[0] - floorf(hsv[0]);
+  float val = hsv[2] * 255;
+  float fr = std::min(std::max(fabsf(h * 6 - 3) - 1, 0.0f), 1.0f);
+  float fg = std::min(std::max(2 - fabsf(h * 6 - 2), 0.0f), 1.0f);
+  float fb = std::min(std::max(2 - fabsf(h * 6 - 4), 0.0f), 1.0f);
+
+  *r = lrintf(val * (1 - hsv[1] + hsv[1] * fr));
+  *g = lrintf(val * (1 - hsv[1] + hsv[1] * fg));
+  *b = lrintf(val * (1 - hsv[1] + hsv[1] * fb));
+}
+
+void PaletteBuild(palette *p, const char *name, const uint8_t (*stops)[3], int count, uint8_t blend)
+{
+  /*
+    Fills the palette from count colors (red, green, blue) spread evenly
+    round it. HSV takes the short way round the color wheel and OKLab keeps
+    the steps even to the eye, RGB is a straight line as Fill draws.
+  */
+  snprintf(p->name, sizeof(p->name), "%s", name);
+
+  for(int i = 0; i < PALETTE_SIZE; i++)
+  {
+    float at = float(i) * count / PALETTE_SIZE;
+    int from = int(at);
+    int to = (from + 1) % count;
+    float t = at - from;
+    const uint8_t *c1 = stops[from], *c2 = stops[to];
+    uint8_t r, g, b;
+
+    if(blend == BLEND_OKLAB)
+    {
+      float lab1[3], lab2[3], lab[3];
+      RgbToOklab(c1[0], c1[1], c1[2], lab1);
+      RgbToOklab(c2[0], c2[1], c2[2], lab2);
+      for(int c = 0; c < 3; c++)
+      {
+        lab[c] = lab1[c] + (lab2[c] - lab1[c]) * t;
+      }
+      OklabToRgb(lab, &r, &g, &b);
+    }
+    else if(blend == BLEND_HSV)
+    {
+      float hsv1[3], hsv2[3], hsv[3];
+      RgbToHsv(c1[0], c1[1], c1[2], hsv1);
+      RgbToHsv(c2[0], c2[1], c2[2], hsv2);
+      float dh = hsv2[0] - hsv1[0];
+      dh -= roundf(dh);
+      hsv[0] = hsv1[0] + dh * t;
+      hsv[1] = hsv1[1] + (hsv2[1] - hsv1[1]) * t;
+      hsv[2] = hsv1[2] + (hsv2[2] - hsv1[2]) * t;
+      HsvToRgb(hsv, &r, &g, &b);
+    }
+    else
+    {
+      r = lrintf(c1[0] + (c2[0] - c1[0]) * t);
+      g = lrintf(c1[1] + (c2[1] - c1[1]) * t);
+      b = lrintf(c1[2] + (c2[2] - c1[2]) * t);
+    }
+
+    p->entries[i*3] = b;
+    p->entries[i*3+1] = g;
+    p->entries[i*3+2] = r;
+  }
+}
+
+void PaletteColor(const palette *p, uint8_t index, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+  *b = p->entries[index*3];
+  *g = p->entries[index*3+1];
+  *r = p->entries[index*3+2];
+}
+
+void PaletteFill(uint8_t *__restrict__ buffer, const palette *p, uint32_t phase, uint32_t step)
+{
+  // the first LED at phase along the palette and each next one step on
+  const uint8_t *__restrict__ entries = p->entries;
+  int n = num_leds;
+
+  for(int i = 0; i < n; i++)
+  {
+    const uint8_t *entry = &entries[(phase >> 24) * 3];
+    buffer[i*3] = entry[0];
+    buffer[i*3+1] = entry[1];
+    buffer[i*3+2] = entry[2];
+    phase += step;
+  }
+}
+
+uint32_t PaletteStep(int repeats)
+{
+  // the step that goes round the palette repeats times along the strip
+  return uint32_t((uint64_t(repeats) << 32) / std::max(num_leds, 1));
+}
+
+void PaletteCompanion(uint8_t r, uint8_t g, uint8_t b, uint8_t *r2, uint8_t *g2, uint8_t *b2)
+{
+  // a second color for someone who only picked one: darker, hue turned a bit
+  float lab[3];
+  RgbToOklab(r, g, b, lab);
+
+  float angle = 35 * PI / 180;
+  float a = lab[1] * cosf(angle) - lab[2] * sinf(angle);
+  float bb = lab[1] * sinf(angle) + lab[2] * cosf(angle);
+  lab[0] *= 0.6;
+  lab[1] = a;
+  lab[2] = bb;
+  OklabToRgb(lab, r2, g2, b2);
+}
+
+uint8_t PaletteParse(const char *text, uint8_t (*stops)[3])
+{
+  // "#rrggbb, #rrggbb, ..." into stops, returns how many
+  int count = 0;
+  const char *c = text;
+
+  while(count < PALETTE_STOPS && (c = strchr(c, '#')) != NULL)
+  {
+    if(strnlen(c, 7) == 7 && (ParseColor(c, 7, &stops[count][0], &stops[count][1], &stops[count][2]) || strncmp(c, "#000000", 7) == 0))
+    {
+      count++;
+    }
+    c++;
+  }
+  return count;
+}
+
+void PaletteAdd(const char *name, const char *blend, const char *colors)
+{
+  uint8_t stops[PALETTE_STOPS][3];
+  int count = PaletteParse(colors, stops);
+
+  if(count == 0)
+  {
+    LOG(LOG_ERROR, "palette %s: no colors", name);
+    return;
+  }
+
+  palette p;
+  PaletteBuild(&p, name, stops, count, (strcmp(blend, "hsv") == 0) ? BLEND_HSV : (strcmp(blend, "rgb") == 0) ? BLEND_RGB : BLEND_OKLAB);
+  palettes.push_back(p);
+}
+
+const palette *FindPalette(const char *name)
+{
+  for(size_t i = 0; i < palettes.size(); i++)
+  {
+    if(strcmp(palettes[i].name, name) == 0)
+    {
+      return &palettes[i];
+    }
+  }
+  return &palettes[0];
+}
+
+void LoadPalettes(void)
+{
+  /*
+    Function reads the palettes from YAML formatted palettes.conf, or uses
+    the built-in ones if there isn't one. Rainbow is always there for the
+    rainbow effects.
+  */
+  char key[PALETTE_NAME_SIZE] = "";
+  char name[PALETTE_NAME_SIZE] = "";
+  char blend[PALETTE_NAME_SIZE] = "";
+  char colors[SHADER_TEXT_SIZE] = "";
+  uint8_t have_key = 0;
+  uint8_t in_palettes = 0;
+  uint8_t failed = 0;
+
+  palettes.clear();
+
+  FILE *fh = fopen("palettes.conf", "r");
+  if(fh != NULL)
+  {
+    yaml_parser_t parser;
+    yaml_event_t event;
+    yaml_parser_initialize(&parser);
+    yaml_parser_set_input_file(&parser, fh);
+
+    do {
+      if(!yaml_parser_parse(&parser, &event))
+      {
+        failed = 1;
+        break;
+      }
+
+      switch(event.type)
+      {
+      case YAML_SEQUENCE_END_EVENT:
+        in_palettes = 0;
+        break;
+      case YAML_MAPPING_END_EVENT:
+        if(in_palettes && colors[0])
+        {
+          PaletteAdd(name[0] ? name : "unnamed", blend, colors);
+        }
+        name[0] = 0;
+        blend[0] = 0;
+        colors[0] = 0;
+        have_key = 0;
+        break;
+      case YAML_SCALAR_EVENT:
+      {
+        const char *value = reinterpret_cast<char*>(event.data.scalar.value);
+
+        if(!have_key)
+        {
+          snprintf(key, sizeof(key), "%s", value);
+          have_key = 1;
+          if(strcmp(key, "Palettes") == 0)
+          {
+            // a sequence of palettes follows, not a value
+            in_palettes = 1;
+            have_key = 0;
           }
-          if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "open_status") == 0)
+          break;
+        }
+        have_key = 0;
+
+        if(strcmp(key, "palette_name") == 0)
+        {
+          snprintf(name, sizeof(name), "%s", value);
+        }
+        else if(strcmp(key, "blend") == 0)
+        {
+          snprintf(blend, sizeof(blend), "%s", value);
+        }
+        else if(strcmp(key, "colors") == 0)
+        {
+          snprintf(colors, sizeof(colors), "%s", value);
+        }
+        break;
+      }
+      default:
+        break;
+      }
+
+      if(event.type != YAML_STREAM_END_EVENT)
+      {
+        yaml_event_delete(&event);
+      }
+    } while(event.type != YAML_STREAM_END_EVENT);
+
+    if(!failed)
+    {
+      yaml_event_delete(&event);
+    }
+    yaml_parser_delete(&parser);
+    fclose(fh);
+  }
+
+  if(failed || palettes.empty())
+  {
+    if(fh != NULL)
+    {
+      LOG(LOG_ERROR, "Failed to read palettes.conf, using the built-in palettes");
+    }
+    palettes.clear();
+    for(unsigned int j = 0; j < sizeof(default_palettes) / sizeof(default_palettes[0]); j++)
+    {
+      PaletteAdd(default_palettes[j][0], default_palettes[j][1], default_palettes[j][2]);
+    }
+  }
+
+  if(strcmp(FindPalette("Rainbow")->name, "Rainbow") != 0)
+  {
+    PaletteAdd(default_palettes[0][0], default_palettes[0][1], default_palettes[0][2]);
+  }
+}
+
+
+// personal effect requests
+
+void TriggerInit(void)
+{
+  for(int i = 0; i < TRIGGER_QUEUE_SIZE; i++)
+  {
+    trigger_queue[i].sequence.store(i, std::memory_order_relaxed);
+  }
+}
+
+uint8_t TriggerPush(const trigger_request *request)
+{
+  /*
+    Queues a request from any thread without blocking, returns 0 if the
+    queue is full
+  */
+  trigger_cell *cell;
+  uint32_t pos = trigger_enqueue_pos.load(std::memory_order_relaxed);
+  while(true)
+  {
+    cell = &trigger_queue[pos & (TRIGGER_QUEUE_SIZE - 1)];
+    int32_t diff = int32_t(cell->sequence.load(std::memory_order_acquire)) - int32_t(pos);
+
+    if(diff == 0)
+    {
+      if(trigger_enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+      {
+        break;
+      }
+    }
+    else if(diff < 0)
+    {
+      triggers_dropped.fetch_add(1, std::memory_order_relaxed);
+      return 0;
+    }
+    else
+    {
+      pos = trigger_enqueue_pos.load(std::memory_order_relaxed);
+    }
+  }
+
+  cell->request = *request;
+  cell->sequence.store(pos + 1, std::memory_order_release);
+  triggers_queued.fetch_add(1, std::memory_order_relaxed);
+  return 1;
+}
+
+uint8_t TriggerPop(trigger_request *request)
+{
+  // render loop only, so no need to compete for the dequeue position
+  trigger_cell *cell = &trigger_queue[trigger_dequeue_pos & (TRIGGER_QUEUE_SIZE - 1)];
+  if(cell->sequence.load(std::memory_order_acquire) != trigger_dequeue_pos + 1)
+  {
+    return 0;
+  }
+
+  *request = cell->request;
+  cell->sequence.store(trigger_dequeue_pos + TRIGGER_QUEUE_SIZE, std::memory_order_release);
+  trigger_dequeue_pos++;
+  return 1;
+}
+
+void AddTriggerColor(trigger_request *request, uint8_t *colors, const char *text, size_t len)
+{
+  // takes the first two valid colors
+  if(*colors == 0 && ParseColor(text, len, &request->r1, &request->g1, &request->b1))
+  {
+    (*colors)++;
+  }
+  else if(*colors == 1 && ParseColor(text, len, &request->r2, &request->g2, &request->b2))
+  {
+    (*colors)++;
+  }
+}
+
+void FinishTrigger(trigger_request *request, uint8_t colors)
+{
+  if(colors == 1)
+  {
+    // only one color found, so make a darker second color that goes with it
+    PaletteCompanion(request->r1, request->g1, request->b1, &request->r2, &request->g2, &request->b2);
+  }
+}
+
+void ParseTrigger(const char *text, size_t len, trigger_request *request)
+{
+  /*
+    Parses a semaphor file in place: lines with "#rrggbb" are colors, the
+    first other non-empty line is the user. Files from older web pages have
+    no user line and all count as the same anonymous user.
+  */
+  uint8_t colors = 0;
+
+  memset(request, 0, sizeof(trigger_request));
+  request->received = MicroTime();
+
+  const char *end = text + len;
+  while(text < end)
+  {
+    const char *eol = (const char *) memchr(text, '\n', end - text);
+    if(eol == NULL)
+    {
+      eol = end;
+    }
+
+    size_t line = eol - text;
+    if(line && text[line - 1] == '\r')
+    {
+      line--;
+    }
+
+    if(line && text[0] == '#')
+    {
+      AddTriggerColor(request, &colors, text, line);
+    }
+    else if(line && request->user[0] == 0)
+    {
+      size_t n = std::min(line, (size_t) TRIGGER_USER_SIZE - 1);
+      memcpy(request->user, text, n);
+      request->user[n] = 0;
+    }
+
+    text = eol + 1;
+  }
+
+  FinishTrigger(request, colors);
+}
+
+uint8_t InSemaphor(void)
+{
+  /*
+    Function reads in semaphor files to determine if we're being triggered to display.
+    The web page drops one file per swipe in SEMAPHOR_DIR, each is queued and removed.
+  */
+  uint8_t in_semaphor = 0;
+
+  DIR *dir = opendir(SEMAPHOR_DIR);
+  if(dir == NULL)
+  {
+    return(0);
+  }
+
+  char path[sizeof(SEMAPHOR_DIR) + 256];
+  char text[256];
+  struct dirent *entry;
+  while((entry = readdir(dir)) != NULL)
+  {
+    // dot files are still being written
+    if(entry->d_name[0] == '.')
+    {
+      continue;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", SEMAPHOR_DIR, entry->d_name);
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+      continue;
+    }
+
+    ssize_t len = read(fd, text, sizeof(text));
+    close(fd);
+    unlink(path);
+
+    if(len > 0)
+    {
+      trigger_request request;
+      ParseTrigger(text, len, &request);
+      in_semaphor += TriggerPush(&request);
+    }
+  }
+  closedir(dir);
+
+  if(in_semaphor)
+  {
+    LOG(LOG_INFO, "Found %d Semaphor files", in_semaphor);
+  }
+
+  return(in_semaphor);
+}
+
+uint8_t TriggerCollect(void)
+{
+  /*
+    Moves queued requests into the turn list. A user already waiting keeps
+    their place, takes the new colors and has their time topped back up.
+    Returns how many requests came in.
+  */
+  trigger_request request;
+  uint8_t collected = 0;
+  while(TriggerPop(&request))
+  {
+    collected++;
+
+    int i;
+    for(i = 0; i < personal_waiting; i++)
+    {
+      if(strcmp(personal_turns[i].request.user, request.user) == 0)
+      {
+        break;
+      }
+    }
+
+    if(i < personal_waiting)
+    {
+      triggers_coalesced.fetch_add(1, std::memory_order_relaxed);
+    }
+    else if(personal_waiting < TRIGGER_USERS)
+    {
+      personal_waiting++;
+    }
+    else
+    {
+      triggers_dropped.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    personal_turns[i].request = request;
+    personal_turns[i].remaining = PERSONAL_EFFECT_TIME;
+  }
+
+  return collected;
+}
+
+uint8_t PersonalTurn(int *current_effect, int *next_effect, uint32_t *effect_time, uint8_t swiped)
+{
+  /*
+    Sets up the turn of the person at the front of the queue: their colors,
+    a customizable effect and how long it runs. Right after a swipe the
+    effect is one that shows the colors straight away. Returns 0 if nobody
+    is waiting.
+  */
+  if(personal_waiting == 0)
+  {
+    return 0;
+  }
+
+  personal_turn *turn = &personal_turns[0];
+  p_r1 = turn->request.r1;
+  p_g1 = turn->request.g1;
+  p_b1 = turn->request.b1;
+  p_r2 = turn->request.r2;
+  p_g2 = turn->request.g2;
+  p_b2 = turn->request.b2;
+  uint8_t stops[3][3] = {
+    { p_r1, p_g1, p_b1 },
+    { p_r2, p_g2, p_b2 },
+    { p_r1, p_g1, p_b1 }
+  };
+  PaletteBuild(&personal_palette, "Personal", stops, 2, BLEND_OKLAB);
+  *effect_time = std::min(turn->remaining, (int32_t) PERSONAL_SLICE);
+  LOG(LOG_INFO, "personal effect for %s, %d s left, %d waiting", turn->request.user[0] ? turn->request.user : "(anonymous)", turn->remaining, personal_waiting);
+
+  while(*next_effect == *current_effect)
+  {
+    if(swiped)
+    {
+      *next_effect = swipe_effects[rand() % SWIPE_EFFECTS];
+    }
+    else
+    {
+      *next_effect = (RANDOM_EFFECTS - CUSTOM_EFFECTS) + (rand() % (CUSTOM_EFFECTS));
+    }
+  }
+  *current_effect = *next_effect;
+  return 1;
+}
+
+void TriggerRotate(int32_t elapsed)
+{
+  /*
+    Charges the person at the front for their turn. They go to the back after
+    a full slice, or leave once their time is used up. A turn cut short by a
+    new swipe stays at the front.
+  */
+  personal_turn turn = personal_turns[0];
+  turn.remaining -= elapsed;
+
+  if(turn.remaining > 0 && elapsed < PERSONAL_SLICE)
+  {
+    personal_turns[0] = turn;
+    return;
+  }
+
+  personal_waiting--;
+  memmove(&personal_turns[0], &personal_turns[1], personal_waiting * sizeof(personal_turn));
+
+  if(turn.remaining > 0)
+  {
+    personal_turns[personal_waiting++] = turn;
+  }
+}
+
+// badge http endpoint
+//
+// a small HTTP/1.1 server on its own thread so the badge readers can post
+// straight to the daemon instead of going through PHP, a semaphor file and
+// bl_sigusr1. requests are parsed in a fixed buffer per connection.
+
+struct http_client
+{
+  int fd;
+  size_t len;
+  char buf[HTTP_REQUEST_SIZE];
+};
+
+int KeepUser(int c) { return isalnum(c) || c == '_'; }
+int KeepReader(int c) { return isdigit(c); }
+int KeepColor(int c) { return isxdigit(c) || c == '#' || c == ','; }
+
+size_t FormField(const char *body, size_t len, const char *name, int (*keep)(int), char *out, size_t size)
+{
+  /*
+    Finds name in an urlencoded form, decodes it and keeps only the
+    characters keep() allows, the same as the preg_replace in
+    badger_access.php. Returns the length written to out.
+  */
+  size_t name_len = strlen(name);
+  size_t n = 0;
+  const char *end = body + len;
+  const char *field = body;
+
+  while(field < end)
+  {
+    const char *amp = (const char *) memchr(field, '&', end - field);
+    if(amp == NULL)
+    {
+      amp = end;
+    }
+
+    if(size_t(amp - field) > name_len && memcmp(field, name, name_len) == 0 && field[name_len] == '=')
+    {
+      for(const char *c = field + name_len + 1; c < amp; c++)
+      {
+        int ch = (unsigned char) *c;
+        if(ch == '+')
+        {
+          ch = ' ';
+        }
+        else if(ch == '%' && amp - c > 2 && HexDigit(c[1]) >= 0 && HexDigit(c[2]) >= 0)
+        {
+          ch = HexDigit(c[1]) * 16 + HexDigit(c[2]);
+          c += 2;
+        }
+
+        if(keep(ch) && n + 1 < size)
+        {
+          out[n++] = ch;
+        }
+      }
+      break;
+    }
+
+    field = amp + 1;
+  }
+
+  out[n] = 0;
+  return n;
+}
+
+void HttpTrigger(const char *body, size_t len, char *reply, size_t reply_size)
+{
+  /*
+    Handles one badge POST: logs it, queues the trigger and pokes the render
+    loop with SIGUSR1 like bl_sigusr1 did
+  */
+  char reader[16];
+  char color[64];
+  trigger_request request;
+  uint8_t colors = 0;
+
+  memset(&request, 0, sizeof(trigger_request));
+  request.received = MicroTime();
+
+  FormField(body, len, "user", KeepUser, request.user, TRIGGER_USER_SIZE);
+  FormField(body, len, "reader", KeepReader, reader, sizeof(reader));
+  size_t color_len = FormField(body, len, "color", KeepColor, color, sizeof(color));
+
+  snprintf(reply, reply_size, "%s:%s:%s\n", request.user, reader, color);
+  Log(NULL, LOG_ACCESS, "%s:%s:%s", request.user, reader, color);
+
+  const char *c = color;
+  const char *end = color + color_len;
+  while(c < end)
+  {
+    const char *comma = (const char *) memchr(c, ',', end - c);
+    if(comma == NULL)
+    {
+      comma = end;
+    }
+    AddTriggerColor(&request, &colors, c, comma - c);
+    c = comma + 1;
+  }
+  FinishTrigger(&request, colors);
+
+  if(TriggerPush(&request))
+  {
+    kill(getpid(), SIGUSR1);
+  }
+}
+
+const char *HeaderValue(const char *headers, const char *end, const char *name)
+{
+  // case insensitive header lookup, returns the start of the value or NULL
+  size_t name_len = strlen(name);
+  for(const char *line = headers; line < end; )
+  {
+    const char *eol = (const char *) memchr(line, '\n', end - line);
+    if(eol == NULL)
+    {
+      break;
+    }
+    if(size_t(eol - line) > name_len && strncasecmp(line, name, name_len) == 0 && line[name_len] == ':')
+    {
+      const char *value = line + name_len + 1;
+      while(*value == ' ')
+      {
+        value++;
+      }
+      return value;
+    }
+    line = eol + 1;
+  }
+  return NULL;
+}
+
+uint8_t ParseLength(const char *value, size_t *length)
+{
+  // a Content-Length of digits only, anything over HTTP_REQUEST_SIZE kept
+  // just over it so it can't wrap. 0 if it isn't a number.
+  size_t n = 0;
+  const char *c = value;
+
+  while(*c >= '0' && *c <= '9')
+  {
+    n = std::min(n * 10 + (*c - '0'), size_t(HTTP_REQUEST_SIZE) + 1);
+    c++;
+  }
+  if(c == value)
+  {
+    return 0;
+  }
+  while(*c == ' ' || *c == '\t')
+  {
+    c++;
+  }
+  if(*c != '\r' && *c != '\n')
+  {
+    return 0;
+  }
+
+  *length = n;
+  return 1;
+}
+
+uint8_t HttpRequest(http_client *client)
+{
+  /*
+    Answers every complete request in the client buffer. Returns 0 when the
+    connection should be closed.
+  */
+  while(true)
+  {
+    char *headers_end = (char *) memmem(client->buf, client->len, "\r\n\r\n", 4);
+    if(headers_end == NULL)
+    {
+      // a request that doesn't fit is refused
+      return (client->len < HTTP_REQUEST_SIZE);
+    }
+
+    const char *value = HeaderValue(client->buf, headers_end + 2, "Content-Length");
+    size_t content_length = 0;
+    size_t header_len = (headers_end + 4) - client->buf;
+    if(value && !ParseLength(value, &content_length))
+    {
+      const char *response = "HTTP/1.1 400 Bad Request\r\nContent-Type: text/plain\r\nContent-Length: 19\r\nConnection: close\r\n\r\nbad Content-Length\n";
+      send(client->fd, response, strlen(response), MSG_NOSIGNAL);
+      return 0;
+    }
+    if(content_length > HTTP_REQUEST_SIZE - header_len)
+    {
+      return 0;
+    }
+    if(client->len < header_len + content_length)
+    {
+      // body still coming
+      return 1;
+    }
+
+    uint8_t keep_alive = (memmem(client->buf, header_len, "HTTP/1.1", 8) != NULL);
+    value = HeaderValue(client->buf, headers_end + 2, "Connection");
+    if(value)
+    {
+      keep_alive = (strncasecmp(value, "keep-alive", 10) == 0);
+    }
+
+    char reply[128];
+    const char *status = "200 OK";
+    if(strncmp(client->buf, "POST ", 5) == 0)
+    {
+      HttpTrigger(client->buf + header_len, content_length, reply, sizeof(reply));
+      http_requests.fetch_add(1, std::memory_order_relaxed);
+    }
+    else
+    {
+      status = "405 Method Not Allowed";
+      snprintf(reply, sizeof(reply), "POST user, reader and color\n");
+    }
+
+    char response[256];
+    int response_len = snprintf(response, sizeof(response),
+      "HTTP/1.1 %s\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\nConnection: %s\r\n\r\n%s",
+      status, strlen(reply), keep_alive ? "keep-alive" : "close", reply);
+    send(client->fd, response, response_len, MSG_NOSIGNAL);
+
+    if(!keep_alive)
+    {
+      return 0;
+    }
+
+    // keep anything pipelined behind it
+    client->len -= header_len + content_length;
+    memmove(client->buf, client->buf + header_len + content_length, client->len);
+  }
+}
+
+int HttpListen(uint32_t addr, uint16_t port)
+{
+  int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if(fd < 0)
+  {
+    return -1;
+  }
+
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(addr);
+  sa.sin_port = htons(port);
+
+  if(bind(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0 || listen(fd, 64) < 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void HttpThread(int listen_fd)
+{
+  static http_client clients[HTTP_CLIENTS];
+  struct pollfd fds[HTTP_CLIENTS + 1];
+
+  BlockSignals();
+
+  for(int i = 0; i < HTTP_CLIENTS; i++)
+  {
+    clients[i].fd = -1;
+  }
+
+  while(true)
+  {
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    for(int i = 0; i < HTTP_CLIENTS; i++)
+    {
+      fds[i + 1].fd = clients[i].fd;
+      fds[i + 1].events = POLLIN;
+    }
+
+    if(poll(fds, HTTP_CLIENTS + 1, -1) < 0)
+    {
+      continue;
+    }
+
+    if(fds[0].revents & POLLIN)
+    {
+      int fd;
+      while((fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+      {
+        int slot = 0;
+        while(slot < HTTP_CLIENTS && clients[slot].fd >= 0)
+        {
+          slot++;
+        }
+        if(slot == HTTP_CLIENTS)
+        {
+          // busy, the reader will retry
+          close(fd);
+          continue;
+        }
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        clients[slot].fd = fd;
+        clients[slot].len = 0;
+      }
+    }
+
+    for(int i = 0; i < HTTP_CLIENTS; i++)
+    {
+      http_client *client = &clients[i];
+      if(client->fd < 0 || !fds[i + 1].revents)
+      {
+        continue;
+      }
+
+      ssize_t n = recv(client->fd, client->buf + client->len, HTTP_REQUEST_SIZE - client->len, 0);
+      if(n < 0 && (errno == EAGAIN || errno == EINTR))
+      {
+        continue;
+      }
+
+      if(n > 0)
+      {
+        client->len += n;
+      }
+
+      if(n <= 0 || !HttpRequest(client))
+      {
+        close(client->fd);
+        client->fd = -1;
+      }
+    }
+  }
+}
+
+
+// audio analysis
+//
+// the audio thread reads PCM from ALSA, a WAV file or stdin, runs a windowed
+// real FFT every AUDIO_HOP samples and publishes band levels through a
+// seqlock, so effects can read the latest levels every frame without locking
+
+#define AUDIO_FILE 1
+#define AUDIO_STDIN 2
+#define AUDIO_ALSA 3
+#define AUDIO_SYNTH 4
+
+struct audio_source
+{
+  uint8_t type;
+  // sleep so a file plays back at the rate it was recorded
+  uint8_t paced;
+  int rate;
+  int channels;
+  FILE *fh;
+  long data_start;
+  // bytes read while sniffing for a WAV header on stdin
+  uint8_t peek[4];
+  int peek_len;
+  uint64_t samples_read;
+#ifdef USE_ALSA
+  snd_pcm_t *pcm;
+#endif
+};
+
+struct audio_snapshot
+{
+  float bands[AUDIO_BANDS];
+  float level;
+  // MicroTime when the newest sample in the window was read
+  uint64_t captured;
+  uint32_t seq;
+};
+
+std::atomic<uint32_t> audio_seq;
+std::atomic<float> audio_bands[AUDIO_BANDS];
+std::atomic<float> audio_level;
+std::atomic<uint64_t> audio_captured;
+std::atomic<uint8_t> audio_running;
+
+// hann window, per stage twiddles and bit reversal for the half size complex fft
+float fft_window[AUDIO_FFT_SIZE];
+float fft_tw_re[AUDIO_FFT_SIZE / 2];
+float fft_tw_im[AUDIO_FFT_SIZE / 2];
+float fft_split_re[AUDIO_FFT_SIZE / 2];
+float fft_split_im[AUDIO_FFT_SIZE / 2];
+uint16_t fft_bitrev[AUDIO_FFT_SIZE / 2];
+int band_edges[AUDIO_BANDS + 1];
+
+void FFTInit(int rate)
+{
+  const int n = AUDIO_FFT_SIZE;
+  const int m = AUDIO_FFT_SIZE / 2;
+  int bits = 0;
+
+  while((1 << bits) < m)
+  {
+    bits++;
+  }
+
+  for(int i = 0; i < n; i++)
+  {
+    fft_window[i] = 0.5f - 0.5f * cosf(2 * PI * i / (n - 1));
+  }
+
+  for(int i = 0; i < m; i++)
+  {
+    int r = 0;
+    for(int b = 0; b < bits; b++)
+    {
+      r |= ((i >> b) & 1) << (bits - 1 - b);
+    }
+    fft_bitrev[i] = r;
+
+    // twiddles used to split the half size transform back into n real bins
+    fft_split_re[i] = cosf(2 * PI * i / n);
+    fft_split_im[i] = -sinf(2 * PI * i / n);
+  }
+
+  // the stage with butterflies of span half keeps its twiddles at [half - 1, 2*half - 1)
+  for(int half = 1; half < m; half *= 2)
+  {
+    for(int k = 0; k < half; k++)
+    {
+      fft_tw_re[half - 1 + k] = cosf(PI * k / half);
+      fft_tw_im[half - 1 + k] = -sinf(PI * k / half);
+    }
+  }
+
+  // log spaced bands from 40Hz to 16kHz
+  for(int b = 0; b <= AUDIO_BANDS; b++)
+  {
+    float freq = 40 * powf(16000.0f / 40, float(b) / AUDIO_BANDS);
+    band_edges[b] = std::min(std::max(int(freq * n / rate), 1), m);
+  }
+}
+
+void RealFFT(float *samples, float *power)
+{
+  /*
+    Power spectrum of AUDIO_FFT_SIZE windowed real samples. The samples are
+    packed into a half size complex transform, even samples in the real part
+    and odd samples in the imaginary part, which is then split into the
+    spectrum of the real signal. Real and imaginary parts are kept in separate
+    arrays so the butterfly loops vectorize.
+  */
+  const int m = AUDIO_FFT_SIZE / 2;
+  float re[m], im[m];
+
+  for(int i = 0; i < m; i++)
+  {
+    re[fft_bitrev[i]] = samples[i*2] * fft_window[i*2];
+    im[fft_bitrev[i]] = samples[i*2+1] * fft_window[i*2+1];
+  }
+
+  for(int half = 1; half < m; half *= 2)
+  {
+    const float *wr = &fft_tw_re[half - 1];
+    const float *wi = &fft_tw_im[half - 1];
+
+    for(int start = 0; start < m; start += half * 2)
+    {
+      float *are = &re[start], *aim = &im[start];
+      float *bre = &re[start + half], *bim = &im[start + half];
+
+      for(int k = 0; k < half; k++)
+      {
+        float tre = bre[k] * wr[k] - bim[k] * wi[k];
+        float tim = bre[k] * wi[k] + bim[k] * wr[k];
+
+        bre[k] = are[k] - tre;
+        bim[k] = aim[k] - tim;
+        are[k] = are[k] + tre;
+        aim[k] = aim[k] + tim;
+      }
+    }
+  }
+
+  for(int k = 0; k < m; k++)
+  {
+    int j = (m - k) & (m - 1);
+
+    // even and odd sample spectra
+    float ere = (re[k] + re[j]) * 0.5f;
+    float eim = (im[k] - im[j]) * 0.5f;
+    float ore = (im[k] + im[j]) * 0.5f;
+    float oim = (re[j] - re[k]) * 0.5f;
+
+    float xre = ere + ore * fft_split_re[k] - oim * fft_split_im[k];
+    float xim = eim + ore * fft_split_im[k] + oim * fft_split_re[k];
+
+    power[k] = xre * xre + xim * xim;
+  }
+}
+
+void AudioPublish(float *bands, float level, uint64_t captured)
+{
+  // odd sequence while writing, readers retry until they see the same even one
+  uint32_t seq = audio_seq.load(std::memory_order_relaxed);
+  audio_seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  for(int b = 0; b < AUDIO_BANDS; b++)
+  {
+    audio_bands[b].store(bands[b], std::memory_order_relaxed);
+  }
+  audio_level.store(level, std::memory_order_relaxed);
+  audio_captured.store(captured, std::memory_order_relaxed);
+
+  audio_seq.store(seq + 2, std::memory_order_release);
+}
+
+uint8_t AudioRead(audio_snapshot *snap)
+{
+  // returns 0 if there's no audio input running
+  uint32_t seq0, seq1;
+
+  if(!audio_running.load(std::memory_order_relaxed))
+  {
+    return 0;
+  }
+
+  do
+  {
+    seq0 = audio_seq.load(std::memory_order_acquire);
+    for(int b = 0; b < AUDIO_BANDS; b++)
+    {
+      snap->bands[b] = audio_bands[b].load(std::memory_order_relaxed);
+    }
+    snap->level = audio_level.load(std::memory_order_relaxed);
+    snap->captured = audio_captured.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    seq1 = audio_seq.load(std::memory_order_relaxed);
+  } while((seq0 & 1) || seq0 != seq1);
+
+  snap->seq = seq0;
+  return 1;
+}
+
+uint32_t ReadLE(uint8_t *bytes, int len)
+{
+  uint32_t val = 0;
+  for(int i = len - 1; i >= 0; i--)
+  {
+    val = (val << 8) | bytes[i];
+  }
+  return val;
+}
+
+uint8_t ReadWavHeader(audio_source *src)
+{
+  /*
+    Reads a RIFF/WAVE header up to the start of the data chunk. Only 16 bit
+    PCM is supported. Works on pipes, unknown chunks are read and skipped.
+  */
+  uint8_t header[12];
+  uint8_t chunk[8];
+  uint8_t fmt[16];
+
+  memcpy(header, src->peek, src->peek_len);
+  if(fread(header + src->peek_len, 1, 12 - src->peek_len, src->fh) != size_t(12 - src->peek_len)
+     || memcmp(header + 8, "WAVE", 4) != 0)
+  {
+    return 0;
+  }
+  src->peek_len = 0;
+
+  while(fread(chunk, 1, 8, src->fh) == 8)
+  {
+    uint32_t size = ReadLE(chunk + 4, 4);
+
+    if(memcmp(chunk, "fmt ", 4) == 0 && size >= 16)
+    {
+      if(fread(fmt, 1, 16, src->fh) != 16)
+      {
+        return 0;
+      }
+      if(ReadLE(fmt, 2) != 1 || ReadLE(fmt + 14, 2) != 16)
+      {
+        LOG(LOG_ERROR, "audio: only 16 bit PCM WAV files are supported");
+        return 0;
+      }
+      src->channels = ReadLE(fmt + 2, 2);
+      src->rate = ReadLE(fmt + 4, 4);
+      size -= 16;
+    }
+    else if(memcmp(chunk, "data", 4) == 0)
+    {
+      src->data_start = (src->type == AUDIO_FILE) ? ftell(src->fh) : 0;
+      return src->channels > 0;
+    }
+
+    // skip the rest of the chunk, chunks are padded to even sizes
+    for(uint32_t i = 0; i < size + (size & 1); i++)
+    {
+      if(fgetc(src->fh) == EOF)
+      {
+        return 0;
+      }
+    }
+  }
+
+  return 0;
+}
+
+uint8_t AudioOpen(const char *name, audio_source *src)
+{
+  /*
+    "-" reads stdin, either a WAV stream or raw 16 bit mono at AUDIO_RATE,
+    "synth" generates a test sweep, an existing file is read as a WAV, and
+    anything else is taken as an ALSA capture device.
+  */
+  memset(src, 0, sizeof(audio_source));
+  src->rate = AUDIO_RATE;
+  src->channels = 1;
+
+  if(strcmp(name, "synth") == 0)
+  {
+    src->type = AUDIO_SYNTH;
+    return 1;
+  }
+
+  if(strcmp(name, "-") == 0)
+  {
+    src->type = AUDIO_STDIN;
+    src->fh = stdin;
+    src->peek_len = fread(src->peek, 1, 4, stdin);
+    if(src->peek_len == 4 && memcmp(src->peek, "RIFF", 4) == 0)
+    {
+      return ReadWavHeader(src);
+    }
+    return 1;
+  }
+
+  if(access(name, R_OK) == 0)
+  {
+    src->type = AUDIO_FILE;
+    src->paced = 1;
+    src->fh = fopen(name, "rb");
+    if(src->fh == NULL)
+    {
+      return 0;
+    }
+    src->peek_len = fread(src->peek, 1, 4, src->fh);
+    if(src->peek_len != 4 || memcmp(src->peek, "RIFF", 4) != 0 || !ReadWavHeader(src))
+    {
+      LOG(LOG_ERROR, "audio: %s is not a WAV file", name);
+      fclose(src->fh);
+      return 0;
+    }
+    return 1;
+  }
+
+#ifdef USE_ALSA
+  src->type = AUDIO_ALSA;
+  if(snd_pcm_open(&src->pcm, name, SND_PCM_STREAM_CAPTURE, 0) < 0
+     || snd_pcm_set_params(src->pcm, SND_PCM_FORMAT_S16_LE, SND_PCM_ACCESS_RW_INTERLEAVED,
+                           1, AUDIO_RATE, 1, 50000) < 0)
+  {
+    LOG(LOG_ERROR, "audio: can't open ALSA device %s", name);
+    return 0;
+  }
+  return 1;
+#else
+  LOG(LOG_ERROR, "audio: %s not found, build with ALSA support to capture from a device", name);
+  return 0;
+#endif
+}
+
+int AudioReadSamples(audio_source *src, float *out, int count)
+{
+  /*
+    Reads count mono samples scaled to -1..1, mixing down any extra channels.
+    Returns fewer than count at the end of a stream. Files loop.
+  */
+  int16_t pcm[AUDIO_HOP * 8];
+  int frames = 0;
+
+  switch(src->type)
+  {
+  case AUDIO_SYNTH:
+    // a 40Hz to 10kHz sweep every 5 seconds with a 2Hz beat on top
+    for(int i = 0; i < count; i++)
+    {
+      double t = double(src->samples_read + i) / src->rate;
+      double sweep = fmod(t, 5.0);
+      double phase = 2 * PI * 40 * 5.0 / log(250.0) * (pow(250.0, sweep / 5.0) - 1);
+      double beat = (fmod(t, 0.5) < 0.1) ? 1.0 : 0.3;
+      out[i] = float(beat * sin(phase));
+    }
+    frames = count;
+    break;
+
+  case AUDIO_FILE:
+  case AUDIO_STDIN:
+    if(src->channels > 8)
+    {
+      return 0;
+    }
+    while(frames < count)
+    {
+      // use up any bytes left over from sniffing the header first
+      uint8_t *dst = reinterpret_cast<uint8_t *>(pcm);
+      int want = (count - frames) * src->channels * 2;
+      int got = 0;
+
+      if(src->peek_len)
+      {
+        memcpy(dst, src->peek, src->peek_len);
+        got = src->peek_len;
+        src->peek_len = 0;
+      }
+      got += fread(dst + got, 1, want - got, src->fh);
+
+      int got_frames = got / (src->channels * 2);
+      for(int i = 0; i < got_frames; i++)
+      {
+        int sum = 0;
+        for(int c = 0; c < src->channels; c++)
+        {
+          sum += pcm[i * src->channels + c];
+        }
+        out[frames + i] = float(sum) / (32768.0f * src->channels);
+      }
+      frames += got_frames;
+
+      if(got < want)
+      {
+        if(src->type == AUDIO_FILE && fseek(src->fh, src->data_start, SEEK_SET) == 0)
+        {
+          continue;
+        }
+        break;
+      }
+    }
+    break;
+
+#ifdef USE_ALSA
+  case AUDIO_ALSA:
+    while(frames < count)
+    {
+      snd_pcm_sframes_t got = snd_pcm_readi(src->pcm, pcm, count - frames);
+      if(got < 0)
+      {
+        if(snd_pcm_recover(src->pcm, got, 1) < 0)
+        {
+          break;
+        }
+        continue;
+      }
+      for(int i = 0; i < got; i++)
+      {
+        out[frames + i] = pcm[i] / 32768.0f;
+      }
+      frames += got;
+    }
+    break;
+#endif
+  }
+
+  src->samples_read += frames;
+  return frames;
+}
+
+void AudioAnalyse(float *window, float *bands, float *level)
+{
+  /*
+    Turns a window of samples into AUDIO_BANDS levels from 0 to 1. Each band
+    is scaled against its own slowly decaying peak so quiet music still moves
+    the lights.
+  */
+  static float peaks[AUDIO_BANDS];
+  float power[AUDIO_FFT_SIZE / 2];
+  float total = 0;
+
+  RealFFT(window, power);
+
+  for(int b = 0; b < AUDIO_BANDS; b++)
+  {
+    float energy = 0;
+    for(int k = band_edges[b]; k < band_edges[b + 1]; k++)
+    {
+      energy += power[k];
+    }
+    energy = log10f(1 + energy);
+
+    peaks[b] = std::max(std::max(energy, peaks[b] * 0.995f), 0.5f);
+    bands[b] = energy / peaks[b];
+    total += bands[b];
+  }
+
+  *level = total / AUDIO_BANDS;
+}
+
+void AudioThread(audio_source *src)
+{
+  float window[AUDIO_FFT_SIZE];
+  float bands[AUDIO_BANDS];
+  float level;
+  uint64_t start = MicroTime();
+
+  BlockSignals();
+  FFTInit(src->rate);
+  memset(window, 0, sizeof(window));
+  audio_running = 1;
+
+  while(true)
+  {
+    // slide the window along by a hop
+    memmove(window, window + AUDIO_HOP, (AUDIO_FFT_SIZE - AUDIO_HOP) * sizeof(float));
+    if(AudioReadSamples(src, window + AUDIO_FFT_SIZE - AUDIO_HOP, AUDIO_HOP) < AUDIO_HOP)
+    {
+      break;
+    }
+    uint64_t captured = MicroTime();
+
+    AudioAnalyse(window, bands, &level);
+    AudioPublish(bands, level, captured);
+    HistogramObserve(&audio_analysis_time, MicroTime() - captured);
+
+    if(src->paced)
+    {
+      // hold a file to real time
+      uint64_t due = start + (src->samples_read * 1000000) / src->rate;
+      uint64_t now = MicroTime();
+      if(due > now)
+      {
+        usleep(due - now);
+      }
+    }
+  }
+
+  LOG(LOG_WARN, "audio: input ended");
+  audio_running = 0;
+}
+
+
+// effect sub functions
+//
+// the per frame buffer kernels are templates on the LED count so the usual
+// NUM_LEDS build gets loops with a constant trip count the compiler can
+// unroll and vectorize, N = 0 is the generic version for other layouts.
+
+#define SPECIALIZED(kernel, ...) \
+  do { if(num_leds == NUM_LEDS) kernel<NUM_LEDS>(NUM_LEDS, __VA_ARGS__); else kernel<0>(num_leds, __VA_ARGS__); } while(0)
+
+template<int N> void FadeBufferKernel(int leds, uint8_t *buffer, uint8_t fade_val)
+{
+  leds = N ? N : leds;
+  for(int i = 0; i < leds * 3; i++)
+  {
+    if(buffer[i] > fade_val)
+    {
+      buffer[i] = buffer[i] - fade_val;
+    }
+    else if(buffer[i] > 0)
+    {
+      buffer[i] = 0;
+    }
+  }
+}
+
+void FadeBuffer(uint8_t *buffer, uint8_t fade_val)
+{
+  SPECIALIZED(FadeBufferKernel, buffer, fade_val);
+}
+
+template<int N> void MixBuffersKernel(int leds, uint8_t *buffer1, uint8_t *buffer2, uint8_t *mixed_buffer, uint8_t mix_effect)
+{
+  leds = N ? N : leds;
+  if(mix_effect == REPLACE)
+  {
+    for(int i = 0; i < leds; i++)
+    {
+      switch(mix_effect)
+      {
+      case REPLACE:
+        if(buffer2[i*3] || buffer2[i*3+1] || buffer2[i*3+2])
+        {
+          mixed_buffer[i*3] = buffer2[i*3];
+          mixed_buffer[i*3+1] = buffer2[i*3+1];
+          mixed_buffer[i*3+2] = buffer2[i*3+2];
+        }
+        else
+        {
+          mixed_buffer[i*3] = buffer1[i*3];
+          mixed_buffer[i*3+1] = buffer1[i*3+1];
+          mixed_buffer[i*3+2] = buffer1[i*3+2];
+        }
+        break;
+      }
+    }
+  }
+  else
+  {
+    for(int i = 0; i < leds * 3; i++)
+    {
+      switch(mix_effect)
+      {
+      case HARD_MIX:
+        mixed_buffer[i] = std::min((buffer1[i] + buffer2[i]), 255);
+
+        break;
+
+      case SUBTRACT:
+        mixed_buffer[i] = std::max((buffer1[i] - buffer2[i]), 0);
+
+        break;
+
+      case XOR:
+        mixed_buffer[i] = buffer1[i] ^ buffer2[i];
+
+        break;
+      case MAX:
+        mixed_buffer[i] = std::max(buffer1[i], buffer2[i]);
+
+        break;
+      }
+    }
+  }
+}
+
+void MixBuffers(uint8_t *buffer1, uint8_t *buffer2, uint8_t *mixed_buffer, uint8_t mix_effect)
+{
+  TRACE_BEGIN("MixBuffers");
+  SPECIALIZED(MixBuffersKernel, buffer1, buffer2, mixed_buffer, mix_effect);
+  TRACE_END("MixBuffers");
+}
+
+template<int N> void FadeToBufferKernel(int leds, uint8_t *buffer1, uint8_t *buffer2, uint8_t mix_percentage)
+{
+  float diff = 0;
+
+  leds = N ? N : leds;
+  for(int i = 0; i < leds * 3; i++)
+  {
+    diff = ((float(buffer2[i]) - float(buffer1[i])) * (float (mix_percentage)/100));
+//    printf("%i %i %i\n", buffer1[i], buffer2[i], diff);
+    buffer1[i] = uint8_t(float(buffer1[i]) + diff);
+  }
+}
+
+void FadeToBuffer(uint8_t *buffer1, uint8_t *buffer2, uint8_t mix_percentage)
+{
+  SPECIALIZED(FadeToBufferKernel, buffer1, buffer2, mix_percentage);
+}
+
+uint8_t RandomColor(uint8_t seed)
+{
+  if((rand() % 255) < seed)
+  {
+    return rand() % 255;
+  }
+  else
+  {
+    return 0;
+  }
+}
+
+void Rotate(uint8_t *buffer, uint8_t direction)
+{
+  uint8_t r, g, b;
+
+  if(direction)
+  {
+    b = buffer[0];
+    g = buffer[1];
+    r = buffer[2];
+    for(int i = 0; i < (num_leds - 1); i++)
+    {
+      buffer[i*3]   = buffer[(i+1)*3];
+      buffer[i*3+1] = buffer[(i+1)*3+1];
+      buffer[i*3+2] = buffer[(i+1)*3+2];
+    }
+    buffer[(num_leds-1)*3]   = b;
+    buffer[(num_leds-1)*3+1] = g;
+    buffer[(num_leds-1)*3+2] = r;
+  }
+  else
+  {
+    b = buffer[(num_leds-1)*3];
+    g = buffer[(num_leds-1)*3+1];
+    r = buffer[(num_leds-1)*3+2];
+    for(int i = (num_leds - 1); i > 0; i--)
+    {
+      buffer[i*3]   = buffer[(i-1)*3];
+      buffer[i*3+1] = buffer[(i-1)*3+1];
+      buffer[i*3+2] = buffer[(i-1)*3+2];
+    }
+    buffer[0] = b;
+    buffer[1] = g;
+    buffer[2] = r;
+  }
+}
+
+void Fill(uint8_t *buffer, int start_led, int end_led, float r1, float g1, float b1, float r2, float g2, float b2)
+{
+  float r, g, b, r_inc, g_inc, b_inc;
+  int steps;
+
+  steps = end_led - start_led;
+
+  if(steps)
+  {
+    r_inc = (r2 - r1)/steps;
+    g_inc = (g2 - g1)/steps;
+    b_inc = (b2 - b1)/steps;
+
+    r = r1;
+    g = g1;
+    b = b1;
+
+    for(int i = start_led; i <= end_led; i++)
+    {
+      buffer[i*3] = b;
+      buffer[i*3+1] = g;
+      buffer[i*3+2] = r;
+      r = r + r_inc;
+      g = g + g_inc;
+      b = b + b_inc;
+    }
+  }
+  else
+  {
+    // we can't divide by zero so just set the start LED to color 1
+    buffer[start_led*3] = b1;
+    buffer[start_led*3+1] = g1;
+    buffer[start_led*3+2] = r1;
+  }
+}
+
+void SinFade(uint8_t *buffer, uint8_t mode, int start_led, int size, float r1, float g1, float b1, float r2, float g2, float b2)
+{
+  // sine fade color 1 to color 2 to color 1
+  float r, g, b;
+  float result;
+  float adjval;
+
+  for(int i = 0; i <= size; i++)
+  {
+    adjval = (180/size)*i;
+    result = sin(adjval * PI / 180);
+
+    r = (r2 * result) + (r1 * (1-result));
+    g = (g2 * result) + (g1 * (1-result));
+    b = (b2 * result) + (b1 * (1-result));
+    int led_num = (start_led + i) % num_leds;
+
+    if(mode)
+    {
+      buffer[led_num*3] = uint8_t (std::max(b, float(buffer[led_num*3])));
+      buffer[led_num*3+1] = uint8_t (std::max(g, float(buffer[led_num*3+1])));
+      buffer[led_num*3+2] = uint8_t (std::max(r, float(buffer[led_num*3+2])));
+    }
+    else
+    {
+      buffer[led_num*3] = uint8_t (b);
+      buffer[led_num*3+1] = uint8_t (g);
+      buffer[led_num*3+2] = uint8_t (r);
+    }
+  }
+}
+
+
+template<int N> void CrossfadeKernel(int leds, uint8_t *buffer1, uint8_t *buffer2, uint8_t *mixed_buffer, uint16_t progress)
+{
+  leds = N ? N : leds;
+  for(int i = 0; i < leds * 3; i++)
+  {
+    mixed_buffer[i] = (buffer1[i] * (256 - progress) + buffer2[i] * progress) >> 8;
+  }
+}
+
+// spatial sub functions
+//
+// the Fill and SinFade of spatial effects. instead of an LED range they take
+// a per LED coordinate (x, y, angle, distance from a point, ...) laid out as
+// a plain float array, so the loops are straight line math the compiler can
+// vectorize, with a polynomial sine in place of sin().
+
+inline float SinBump(float t)
+{
+  // sin(PI * t) for t in 0..1, within 0.1%
+  float y = 4 * t * (1 - t);
+  return y + 0.225f * (y * y - y);
+}
+
+inline float SinCycle(float t)
+{
+  // sin(2 * PI * t) for any t
+  t = t - floorf(t);
+  float half = (t < 0.5f) ? 1.0f : -1.0f;
+  float u = 2 * t - ((t < 0.5f) ? 0.0f : 1.0f);
+  return half * SinBump(u);
+}
+
+void SpatialProject(float *field, float dx, float dy)
+{
+  // position of each LED along the direction (dx, dy)
+  for(int i = 0; i < num_leds; i++)
+  {
+    field[i] = led_x[i] * dx + led_y[i] * dy;
+  }
+}
+
+void SpatialDistance(float *field, float x, float y)
+{
+  // distance of each LED from (x, y)
+  for(int i = 0; i < num_leds; i++)
+  {
+    float dx = led_x[i] - x;
+    float dy = led_y[i] - y;
+    field[i] = sqrtf(dx * dx + dy * dy);
+  }
+}
+
+void SpatialFill(uint8_t *buffer, const float *field, float from, float to, float r1, float g1, float b1, float r2, float g2, float b2)
+{
+  // color 1 where field is at or below from, fading to color 2 at or above to
+  float scale = (to != from) ? 1 / (to - from) : 0;
+
+  for(int i = 0; i < num_leds; i++)
+  {
+    float t = std::min(std::max((field[i] - from) * scale, 0.0f), 1.0f);
+    buffer[i*3] = uint8_t(b1 + (b2 - b1) * t);
+    buffer[i*3+1] = uint8_t(g1 + (g2 - g1) * t);
+    buffer[i*3+2] = uint8_t(r1 + (r2 - r1) * t);
+  }
+}
+
+void SpatialSinFade(uint8_t *buffer, uint8_t mode, const float *field, float center, float width, float period, float r1, float g1, float b1, float r2, float g2, float b2)
+{
+  /*
+    Sine fade color 1 to color 2 to color 1 across the LEDs whose field is
+    within width / 2 of center, leaving the rest alone. A non-zero period
+    wraps the field, for angles. mode 1 keeps the brighter of the fade and
+    what's already there like SinFade.
+  */
+  float inv_width = 1 / width;
+
+  for(int i = 0; i < num_leds; i++)
+  {
+    float d = field[i] - center;
+    if(period)
+    {
+      d = d - period * floorf(d / period + 0.5f);
+    }
+
+    float t = d * inv_width + 0.5f;
+    if(t <= 0 || t >= 1)
+    {
+      continue;
+    }
+
+    float result = SinBump(t);
+    float r = (r2 * result) + (r1 * (1 - result));
+    float g = (g2 * result) + (g1 * (1 - result));
+    float b = (b2 * result) + (b1 * (1 - result));
+
+    if(mode)
+    {
+      buffer[i*3] = std::max(uint8_t(b), buffer[i*3]);
+      buffer[i*3+1] = std::max(uint8_t(g), buffer[i*3+1]);
+      buffer[i*3+2] = std::max(uint8_t(r), buffer[i*3+2]);
+    }
+    else
+    {
+      buffer[i*3] = uint8_t(b);
+      buffer[i*3+1] = uint8_t(g);
+      buffer[i*3+2] = uint8_t(r);
+    }
+  }
+}
+
+void SpatialWave(uint8_t *buffer, const float *field, float wavelength, float phase, float r1, float g1, float b1, float r2, float g2, float b2)
+{
+  // a sine wave between color 1 and 2 along field, moving as phase goes up
+  float inv_wavelength = 1 / wavelength;
+
+  for(int i = 0; i < num_leds; i++)
+  {
+    float t = 0.5f + 0.5f * SinCycle(field[i] * inv_wavelength - phase);
+    buffer[i*3] = uint8_t(b1 + (b2 - b1) * t);
+    buffer[i*3+1] = uint8_t(g1 + (g2 - g1) * t);
+    buffer[i*3+2] = uint8_t(r1 + (r2 - r1) * t);
+  }
+}
+
+// particle sub functions
+
+void ParticleClear(particle_system *ps, uint8_t wrap, float drag)
+{
+  ps->count = 0;
+  ps->wrap = wrap;
+  ps->drag = drag;
+
+  for(int i = 0; i < MAX_LEDS * 3; i++)
+  {
+    ps->accum[i] = 0;
+  }
+}
+
+int ParticleSpawn(particle_system *ps, float pos, float vel, float size, float life, float r, float g, float b)
+{
+  // adds a particle at full brightness, returns its index or -1 when full
+  unsigned int i = ps->count;
+  if(i >= MAX_PARTICLES)
+  {
+    return(-1);
+  }
+  ps->count = i + 1;
+
+  ps->pos[i] = pos;
+  ps->vel[i] = vel;
+  ps->size[i] = size;
+  ps->growth[i] = 0;
+  ps->life[i] = life;
+  ps->bright[i] = 1;
+  ps->fade[i] = 1;
+  ps->r[i] = r;
+  ps->g[i] = g;
+  ps->b[i] = b;
+  ps->group[i] = 0;
+
+  return(i);
+}
+
+void ParticleUpdate(particle_system *ps)
+{
+  /*
+    Moves, grows, fades and ages every particle, then drops the ones that
+    burned out, went dark or left the strip by moving the last ones into
+    their place
+  */
+  int count = ps->count;
+  float drag = ps->drag;
+  float leds = num_leds;
+
+  for(int i = 0; i < count; i++)
+  {
+    ps->vel[i] = ps->vel[i] * drag;
+    ps->pos[i] = ps->pos[i] + ps->vel[i];
+    ps->size[i] = ps->size[i] + ps->growth[i];
+    ps->bright[i] = ps->bright[i] * ps->fade[i];
+    ps->life[i] = ps->life[i] - 1;
+  }
+
+  if(ps->wrap)
+  {
+    for(int i = 0; i < count; i++)
+    {
+      ps->pos[i] = ps->pos[i] - leds * floorf(ps->pos[i] / leds);
+    }
+  }
+
+  for(int i = 0; i < count; )
+  {
+    if(ps->life[i] > 0 && ps->bright[i] > 1.0f / 256 && ps->size[i] > 0 &&
+       (ps->wrap || (ps->pos[i] > -ps->size[i] && ps->pos[i] < leds + ps->size[i])))
+    {
+      i++;
+      continue;
+    }
+
+    count--;
+    ps->pos[i] = ps->pos[count];
+    ps->vel[i] = ps->vel[count];
+    ps->size[i] = ps->size[count];
+    ps->growth[i] = ps->growth[count];
+    ps->life[i] = ps->life[count];
+    ps->bright[i] = ps->bright[count];
+    ps->fade[i] = ps->fade[count];
+    ps->r[i] = ps->r[count];
+    ps->g[i] = ps->g[count];
+    ps->b[i] = ps->b[count];
+    ps->group[i] = ps->group[count];
+  }
+
+  ps->count = count;
+}
+
+inline void ParticleSplat(float *accum, int led, uint8_t mode, float r, float g, float b)
+{
+  if(mode == PARTICLE_ADD)
+  {
+    accum[led*3] += b;
+    accum[led*3+1] += g;
+    accum[led*3+2] += r;
+  }
+  else
+  {
+    accum[led*3] = std::max(accum[led*3], b);
+    accum[led*3+1] = std::max(accum[led*3+1], g);
+    accum[led*3+2] = std::max(accum[led*3+2], r);
+  }
+}
+
+void ParticleDraw(particle_system *ps, int i, int lo, int hi, uint8_t mode, float gain, float size_scale)
+{
+  /*
+    Draws particle i into the LEDs from lo up to hi of accum as a sine bump
+    size LEDs wide centered on its position, sampled at the middle of each
+    LED so it moves smoothly between LEDs. Particles under 2 LEDs wide are
+    split between the two nearest LEDs instead.
+  */
+  int leds = num_leds;
+  float level = ps->bright[i] * gain;
+  float r = ps->r[i] * level;
+  float g = ps->g[i] * level;
+  float b = ps->b[i] * level;
+  float pos = ps->pos[i];
+  float size = ps->size[i] * size_scale;
+
+  if(size < 2)
+  {
+    int led = int(floorf(pos));
+    float frac = pos - led;
+    int next = led + 1;
+
+    if(ps->wrap)
+    {
+      led = (led + leds) % leds;
+      next = (next + leds) % leds;
+    }
+    if(led >= lo && led < hi)
+    {
+      ParticleSplat(ps->accum, led, mode, r * (1 - frac), g * (1 - frac), b * (1 - frac));
+    }
+    if(next >= lo && next < hi)
+    {
+      ParticleSplat(ps->accum, next, mode, r * frac, g * frac, b * frac);
+    }
+    return;
+  }
+
+  float inv_size = 1 / size;
+  int first = int(ceilf(pos - size / 2));
+  int last = int(floorf(pos + size / 2));
+
+  // the bump as it is, then the bits off either end wrapped round
+  for(int pass = 0; pass < (ps->wrap ? 3 : 1); pass++)
+  {
+    int shift = (pass == 0) ? 0 : (pass == 1) ? leds : -leds;
+    int from = std::max(first, lo - shift);
+    int to = std::min(last, hi - 1 - shift);
+
+    for(int j = from; j <= to; j++)
+    {
+      float result = SinBump((j - pos) * inv_size + 0.5f);
+      ParticleSplat(ps->accum, j + shift, mode, r * result, g * result, b * result);
+    }
+  }
+}
+
+struct particle_job
+{
+  particle_system *ps;
+  uint8_t mode;
+  float gain, size_scale;
+  // furthest any particle reaches from its middle, in LEDs
+  int reach;
+};
+
+void ParticleChunk(void *arg, int worker, int chunk)
+{
+  // draws every particle that reaches into one chunk, clipped to it
+  particle_job *job = (particle_job *) arg;
+  particle_system *ps = job->ps;
+  int chunks = (num_leds + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK;
+  int lo = chunk * PARTICLE_CHUNK;
+  int hi = std::min(lo + PARTICLE_CHUNK, num_leds);
+  float mid = (lo + hi) / 2.0f;
+  float half = (hi - lo) / 2.0f + 1;
+
+  int from, to;
+  if(2 * job->reach + PARTICLE_CHUNK >= num_leds)
+  {
+    from = 0;
+    to = chunks - 1;
+  }
+  else if(ps->wrap)
+  {
+    from = (((lo - job->reach) % num_leds + num_leds) % num_leds) / PARTICLE_CHUNK;
+    to = ((hi - 1 + job->reach) % num_leds) / PARTICLE_CHUNK;
+  }
+  else
+  {
+    from = std::max(lo - job->reach, 0) / PARTICLE_CHUNK;
+    to = std::min(hi - 1 + job->reach, num_leds - 1) / PARTICLE_CHUNK;
+  }
+
+  for(int bin = from; ; bin = (bin + 1) % chunks)
+  {
+    for(int j = ps->bin_start[bin]; j < ps->bin_start[bin + 1]; j++)
+    {
+      // skip the ones in the next bins over that don't reach this far
+      int i = ps->bins[j];
+      float distance = fabsf(ps->pos[i] - mid);
+      if(ps->wrap)
+      {
+        distance = std::min(distance, fabsf(num_leds - distance));
+      }
+      if(distance > half + ps->size[i] * job->size_scale / 2)
+      {
+        continue;
+      }
+      ParticleDraw(ps, i, lo, hi, job->mode, job->gain, job->size_scale);
+    }
+    if(bin == to)
+    {
+      break;
+    }
+  }
+}
+
+void ParticleRender(particle_system *ps, int group, uint8_t mode, float gain, float size_scale)
+{
+  /*
+    Draws the particles of group (-1 for all) into accum. With a render
+    pool they're sorted into PARTICLE_CHUNK LED bins by where their middle
+    is, then each chunk is drawn from the bins close enough to reach it.
+  */
+  int chunks = (num_leds + PARTICLE_CHUNK - 1) / PARTICLE_CHUNK;
+  particle_job job = { ps, mode, gain, size_scale, 1 };
+  float widest = 0;
+
+  if(pool.threads < 2 || ps->count < PARTICLE_POOL_MIN)
+  {
+    for(int i = 0; i < ps->count; i++)
+    {
+      if(group < 0 || ps->group[i] == group)
+      {
+        ParticleDraw(ps, i, 0, num_leds, mode, gain, size_scale);
+      }
+    }
+    return;
+  }
+
+  for(int c = 0; c <= chunks; c++)
+  {
+    ps->bin_start[c] = 0;
+  }
+  for(int i = 0; i < ps->count; i++)
+  {
+    if(group >= 0 && ps->group[i] != group)
+    {
+      continue;
+    }
+    int led = std::min(std::max(int(ps->pos[i]), 0), num_leds - 1);
+    ps->bin_start[led / PARTICLE_CHUNK + 1]++;
+    widest = std::max(widest, ps->size[i]);
+  }
+  for(int c = 0; c < chunks; c++)
+  {
+    ps->bin_start[c + 1] += ps->bin_start[c];
+  }
+  for(int i = 0; i < ps->count; i++)
+  {
+    if(group >= 0 && ps->group[i] != group)
+    {
+      continue;
+    }
+    // bin_start[c] walks up to the next bin's start, then is put back
+    int led = std::min(std::max(int(ps->pos[i]), 0), num_leds - 1);
+    ps->bins[ps->bin_start[led / PARTICLE_CHUNK]++] = i;
+  }
+  for(int c = chunks; c > 0; c--)
+  {
+    ps->bin_start[c] = ps->bin_start[c - 1];
+  }
+  ps->bin_start[0] = 0;
+
+  job.reach = int(ceilf(widest * size_scale / 2)) + 2;
+  PoolRun(chunks, ParticleChunk, &job);
+}
+
+void ParticleResolve(particle_system *ps, uint8_t *buffer)
+{
+  // copies the rendered particles into an LED buffer and clears accum
+  for(int i = 0; i < num_leds * 3; i++)
+  {
+    buffer[i] = uint8_t(std::min(ps->accum[i], 255.0f));
+    ps->accum[i] = 0;
+  }
+}
+
+// shader compiler
+
+struct shader_function
+{
+  const char *name;
+  uint8_t op, args;
+};
+
+const static shader_function shader_functions[] = {
+  { "sin", SH_SIN, 1 },
+  { "cos", SH_COS, 1 },
+  { "abs", SH_ABS, 1 },
+  { "floor", SH_FLOOR, 1 },
+  { "fract", SH_FRACT, 1 },
+  { "sqrt", SH_SQRT, 1 },
+  { "pow", SH_POW, 2 },
+  { "min", SH_MIN, 2 },
+  { "max", SH_MAX, 2 },
+  { "step", SH_STEP, 2 },
+  { "clamp", SH_CLAMP, 3 },
+  { "mix", SH_MIX, 3 }
+};
+
+// the colors of the effect, 0 to 1
+const static char *shader_params[] = { "r1", "g1", "b1", "r2", "g2", "b2" };
+
+// used when there's no shaders.conf
+const static char *default_shaders[][2] = {
+  { "Rainbow", "hsv(i/N - t*10/N, 1, 1)" },
+  { "Breathing Rainbow", "hsv(i/N + t*0.1, 1, sin(i*0.05+t)*0.5+0.5)" },
+  { "Plasma", "hsv(sin(x*0.02+t)*0.3 + sin(y*0.03-t*0.7)*0.3 + t*0.05, 1, 0.6+0.4*sin(angle*3+t))" },
+  { "Two Color Waves", "mix(r1, r2, 0.5+0.5*sin(i*0.1-t*2)), mix(g1, g2, 0.5+0.5*sin(i*0.1-t*2)), mix(b1, b2, 0.5+0.5*sin(i*0.1-t*2))" }
+};
+
+struct shader_parser
+{
+  const char *text;
+  int pos;
+  shader_program *prog;
+  const char *error;
+};
+
+float ShaderScalar(uint8_t op, float a, float b, float c)
+{
+  // one op on one value, for folding constants and the per frame program
+  switch(op)
+  {
+    case SH_NEG: return(-a);
+    case SH_ADD: return(a + b);
+    case SH_SUB: return(a - b);
+    case SH_MUL: return(a * b);
+    case SH_DIV: return(a / b);
+    case SH_MOD: return(a - b * floorf(a / b));
+    case SH_POW: return(powf(a, b));
+    case SH_SIN: return(SinCycle(a * float(0.5 / PI)));
+    case SH_COS: return(SinCycle(a * float(0.5 / PI) + 0.25f));
+    case SH_ABS: return(fabsf(a));
+    case SH_FLOOR: return(floorf(a));
+    case SH_FRACT: return(a - floorf(a));
+    case SH_SQRT: return(sqrtf(std::max(a, 0.0f)));
+    case SH_MIN: return(std::min(a, b));
+    case SH_MAX: return(std::max(a, b));
+    case SH_STEP: return((b < a) ? 0.0f : 1.0f);
+    case SH_CLAMP: return(std::min(std::max(a, b), c));
+    case SH_MIX: return(a + (b - a) * c);
+  }
+  return(0);
+}
+
+void ShaderBatch(uint8_t op, float *d, const float *a, const float *b, const float *c, int n)
+{
+  // one op over a batch of LEDs, each a plain loop the compiler can vectorize
+  switch(op)
+  {
+    case SH_NEG: for(int k = 0; k < n; k++) d[k] = -a[k]; break;
+    case SH_ADD: for(int k = 0; k < n; k++) d[k] = a[k] + b[k]; break;
+    case SH_SUB: for(int k = 0; k < n; k++) d[k] = a[k] - b[k]; break;
+    case SH_MUL: for(int k = 0; k < n; k++) d[k] = a[k] * b[k]; break;
+    case SH_DIV: for(int k = 0; k < n; k++) d[k] = a[k] / b[k]; break;
+    case SH_MOD: for(int k = 0; k < n; k++) d[k] = a[k] - b[k] * floorf(a[k] / b[k]); break;
+    case SH_POW: for(int k = 0; k < n; k++) d[k] = powf(a[k], b[k]); break;
+    case SH_SIN: for(int k = 0; k < n; k++) d[k] = SinCycle(a[k] * float(0.5 / PI)); break;
+    case SH_COS: for(int k = 0; k < n; k++) d[k] = SinCycle(a[k] * float(0.5 / PI) + 0.25f); break;
+    case SH_ABS: for(int k = 0; k < n; k++) d[k] = fabsf(a[k]); break;
+    case SH_FLOOR: for(int k = 0; k < n; k++) d[k] = floorf(a[k]); break;
+    case SH_FRACT: for(int k = 0; k < n; k++) d[k] = a[k] - floorf(a[k]); break;
+    case SH_SQRT: for(int k = 0; k < n; k++) d[k] = sqrtf(std::max(a[k], 0.0f)); break;
+    case SH_MIN: for(int k = 0; k < n; k++) d[k] = std::min(a[k], b[k]); break;
+    case SH_MAX: for(int k = 0; k < n; k++) d[k] = std::max(a[k], b[k]); break;
+    case SH_STEP: for(int k = 0; k < n; k++) d[k] = (b[k] < a[k]) ? 0.0f : 1.0f; break;
+    case SH_CLAMP: for(int k = 0; k < n; k++) d[k] = std::min(std::max(a[k], b[k]), c[k]); break;
+    case SH_MIX: for(int k = 0; k < n; k++) d[k] = a[k] + (b[k] - a[k]) * c[k]; break;
+  }
+}
+
+int ShaderNode(shader_parser *p, uint8_t op, int a, int b, int c, float value)
+{
+  /*
+    Adds a node, folding it into a constant straight away when all of its
+    arguments are constants. Returns the node number or -1 when full.
+  */
+  shader_program *prog = p->prog;
+  int args[3] = { a, b, c };
+
+  if(a < 0 && op >= SH_NEG)
+  {
+    return(-1);
+  }
+  if(prog->nodes_used >= SHADER_NODES)
+  {
+    p->error = "too long";
+    return(-1);
+  }
+
+  shader_node *node = &prog->nodes[prog->nodes_used];
+  memset(node, 0, sizeof(shader_node));
+  node->op = op;
+  node->value = value;
+  node->uniform = (op == SH_CONST || op == SH_N || op == SH_T || op == SH_PARAM);
+
+  if(op >= SH_NEG)
+  {
+    uint8_t constant = 1;
+    node->uniform = 1;
+    for(int j = 0; j < 3; j++)
+    {
+      node->args[j] = args[j];
+      if(args[j] >= 0)
+      {
+        constant = constant && (prog->nodes[args[j]].op == SH_CONST);
+        node->uniform = node->uniform && prog->nodes[args[j]].uniform;
+      }
+    }
+
+    if(constant)
+    {
+      float values[3] = { 0, 0, 0 };
+      for(int j = 0; j < 3; j++)
+      {
+        if(args[j] >= 0)
+        {
+          values[j] = prog->nodes[args[j]].value;
+        }
+      }
+      node->value = ShaderScalar(op, values[0], values[1], values[2]);
+      node->op = SH_CONST;
+    }
+  }
+
+  return(prog->nodes_used++);
+}
+
+void ShaderSpace(shader_parser *p)
+{
+  while(isspace(p->text[p->pos]))
+  {
+    p->pos++;
+  }
+}
+
+int ShaderExpr(shader_parser *p);
+
+int ShaderArgs(shader_parser *p, int *args, int count)
+{
+  // reads (arg, arg, ...), returns the number of arguments or -1
+  int n = 0;
+
+  ShaderSpace(p);
+  if(p->text[p->pos] != '(')
+  {
+    p->error = "expected (";
+    return(-1);
+  }
+  p->pos++;
+
+  while(n < count)
+  {
+    args[n] = ShaderExpr(p);
+    if(args[n] < 0)
+    {
+      return(-1);
+    }
+    n++;
+
+    ShaderSpace(p);
+    if(p->text[p->pos] != ',')
+    {
+      break;
+    }
+    p->pos++;
+  }
+
+  ShaderSpace(p);
+  if(p->text[p->pos] != ')')
+  {
+    p->error = "expected )";
+    return(-1);
+  }
+  p->pos++;
+
+  return(n);
+}
+
+int ShaderPrimary(shader_parser *p)
+{
+  // number, variable, function(...) or (expression)
+  ShaderSpace(p);
+  const char *start = p->text + p->pos;
+
+  if(*start == '(')
+  {
+    p->pos++;
+    int node = ShaderExpr(p);
+    ShaderSpace(p);
+    if(node < 0 || p->text[p->pos] != ')')
+    {
+      p->error = p->error ? p->error : "expected )";
+      return(-1);
+    }
+    p->pos++;
+    return(node);
+  }
+
+  if(isdigit(*start) || *start == '.')
+  {
+    char *end;
+    float value = strtof(start, &end);
+    p->pos += end - start;
+    return(ShaderNode(p, SH_CONST, -1, -1, -1, value));
+  }
+
+  if(!isalpha(*start))
+  {
+    p->error = "expected a value";
+    return(-1);
+  }
+
+  int len = 0;
+  while(isalnum(start[len]) || start[len] == '_')
+  {
+    len++;
+  }
+  string name(start, len);
+  p->pos += len;
+
+  if(name == "i") return(ShaderNode(p, SH_I, -1, -1, -1, 0));
+  if(name == "N") return(ShaderNode(p, SH_N, -1, -1, -1, 0));
+  if(name == "t") return(ShaderNode(p, SH_T, -1, -1, -1, 0));
+  if(name == "x") return(ShaderNode(p, SH_X, -1, -1, -1, 0));
+  if(name == "y") return(ShaderNode(p, SH_Y, -1, -1, -1, 0));
+  if(name == "angle") return(ShaderNode(p, SH_ANGLE, -1, -1, -1, 0));
+  if(name == "pi") return(ShaderNode(p, SH_CONST, -1, -1, -1, PI));
+
+  for(unsigned int j = 0; j < sizeof(shader_params) / sizeof(shader_params[0]); j++)
+  {
+    if(name == shader_params[j])
+    {
+      return(ShaderNode(p, SH_PARAM, -1, -1, -1, j));
+    }
+  }
+
+  for(unsigned int j = 0; j < sizeof(shader_functions) / sizeof(shader_function); j++)
+  {
+    const shader_function *f = &shader_functions[j];
+    if(name != f->name)
+    {
+      continue;
+    }
+
+    int args[3] = { -1, -1, -1 };
+    int n = ShaderArgs(p, args, 3);
+    if(n < 0)
+    {
+      return(-1);
+    }
+    if(n != f->args)
+    {
+      p->error = "wrong number of arguments";
+      return(-1);
+    }
+    return(ShaderNode(p, f->op, args[0], args[1], args[2], 0));
+  }
+
+  p->error = "unknown name";
+  return(-1);
+}
+
+int ShaderUnary(shader_parser *p)
+{
+  // -value and value^power
+  ShaderSpace(p);
+  if(p->text[p->pos] == '-')
+  {
+    p->pos++;
+    return(ShaderNode(p, SH_NEG, ShaderUnary(p), -1, -1, 0));
+  }
+
+  int node = ShaderPrimary(p);
+  ShaderSpace(p);
+  if(node >= 0 && p->text[p->pos] == '^')
+  {
+    p->pos++;
+    node = ShaderNode(p, SH_POW, node, ShaderUnary(p), -1, 0);
+  }
+  return(node);
+}
+
+int ShaderTerm(shader_parser *p)
+{
+  int node = ShaderUnary(p);
+
+  while(node >= 0)
+  {
+    ShaderSpace(p);
+    char c = p->text[p->pos];
+    if(c != '*' && c != '/' && c != '%')
+    {
+      break;
+    }
+    p->pos++;
+    node = ShaderNode(p, (c == '*') ? SH_MUL : (c == '/') ? SH_DIV : SH_MOD, node, ShaderUnary(p), -1, 0);
+  }
+  return(node);
+}
+
+int ShaderExpr(shader_parser *p)
+{
+  int node = ShaderTerm(p);
+
+  while(node >= 0)
+  {
+    ShaderSpace(p);
+    char c = p->text[p->pos];
+    if(c != '+' && c != '-')
+    {
+      break;
+    }
+    p->pos++;
+    node = ShaderNode(p, (c == '+') ? SH_ADD : SH_SUB, node, ShaderTerm(p), -1, 0);
+  }
+  return(node);
+}
+
+uint8_t ShaderEmit(shader_program *prog, int n)
+{
+  // lists the nodes under n and then n, into the per frame or per batch
+  // program, each node only once. 0 if the program doesn't fit.
+  shader_node *node = &prog->nodes[n];
+
+  if(node->emitted)
+  {
+    return(1);
+  }
+  node->emitted = 1;
+
+  if(node->op >= SH_NEG)
+  {
+    for(int j = 0; j < 3; j++)
+    {
+      if(node->args[j] < 0)
+      {
+        continue;
+      }
+      if(!ShaderEmit(prog, node->args[j]))
+      {
+        return(0);
+      }
+      if(!node->uniform)
+      {
+        // per frame value used per LED, copied into its register
+        prog->nodes[node->args[j]].broadcast = 1;
+      }
+    }
+  }
+
+  if(node->uniform)
+  {
+    if(prog->uniform_len >= SHADER_NODES)
+    {
+      return(0);
+    }
+    prog->uniform_code[prog->uniform_len++] = n;
+  }
+  else
+  {
+    if(prog->varying_len >= SHADER_NODES)
+    {
+      return(0);
+    }
+    prog->varying_code[prog->varying_len++] = n;
+  }
+  return(1);
+}
+
+uint8_t ShaderCompile(shader_program *prog, const char *name, const char *text)
+{
+  /*
+    Parses text into prog, which is either hsv(h, s, v), rgb(r, g, b), three
+    comma separated expressions for red, green and blue, or one for white,
+    all 0 to 1. Returns 0 and logs where it went wrong on a bad expression.
+  */
+  shader_parser p = { text, 0, prog, NULL };
+  int out[3] = { -1, -1, -1 };
+  int n = 0;
+
+  memset(prog, 0, sizeof(shader_program));
+  snprintf(prog->name, SHADER_NAME_SIZE, "%s", name);
+  snprintf(prog->text, SHADER_TEXT_SIZE, "%s", text);
+
+  ShaderSpace(&p);
+  if(strncmp(text + p.pos, "hsv", 3) == 0 || strncmp(text + p.pos, "rgb", 3) == 0)
+  {
+    prog->hsv = (text[p.pos] == 'h');
+    p.pos += 3;
+    n = ShaderArgs(&p, out, 3);
+  }
+  else
+  {
+    while(n < 3)
+    {
+      out[n] = ShaderExpr(&p);
+      if(out[n] < 0)
+      {
+        n = -1;
+        break;
+      }
+      n++;
+
+      ShaderSpace(&p);
+      if(text[p.pos] != ',')
+      {
+        break;
+      }
+      p.pos++;
+    }
+  }
+
+  ShaderSpace(&p);
+  if(n > 0 && n != 3 && !(n == 1 && !prog->hsv))
+  {
+    p.error = "expected 3 colors";
+  }
+  else if(n > 0 && text[p.pos] != 0)
+  {
+    p.error = "unexpected text";
+  }
+
+  if(n < 0 || p.error)
+  {
+    LOG(LOG_ERROR, "shader %s: %s at column %d", name, p.error ? p.error : "expected a value", p.pos + 1);
+    return(0);
+  }
+
+  // white uses the same node three times, emitted once
+  for(int j = 0; j < 3; j++)
+  {
+    prog->out[j] = out[(n == 1) ? 0 : j];
+    if(!ShaderEmit(prog, prog->out[j]))
+    {
+      LOG(LOG_ERROR, "shader %s: too long", name);
+      return(0);
+    }
+    prog->nodes[prog->out[j]].broadcast = 1;
+  }
+
+  return(1);
+}
+
+vector<shader_program> shaders;
+
+void ShaderAdd(const char *name, const char *text)
+{
+  shader_program prog;
+
+  if(ShaderCompile(&prog, name, text))
+  {
+    shaders.push_back(prog);
+  }
+}
+
+void LoadShaders(void)
+{
+  /*
+    Function reads the shaders from YAML formatted shaders.conf, or uses the
+    built-in ones if there isn't one
+  */
+  char key[SHADER_NAME_SIZE] = "";
+  char name[SHADER_NAME_SIZE] = "";
+  char text[SHADER_TEXT_SIZE] = "";
+  uint8_t have_key = 0;
+  uint8_t in_shaders = 0;
+  uint8_t failed = 0;
+
+  shaders.clear();
+
+  FILE *fh = fopen("shaders.conf", "r");
+  if(fh != NULL)
+  {
+    yaml_parser_t parser;
+    yaml_event_t event;
+    yaml_parser_initialize(&parser);
+    yaml_parser_set_input_file(&parser, fh);
+
+    do {
+      if(!yaml_parser_parse(&parser, &event))
+      {
+        failed = 1;
+        break;
+      }
+
+      switch(event.type)
+      {
+      case YAML_SEQUENCE_END_EVENT:
+        in_shaders = 0;
+        break;
+      case YAML_MAPPING_END_EVENT:
+        if(in_shaders && text[0])
+        {
+          ShaderAdd(name[0] ? name : "unnamed", text);
+        }
+        name[0] = 0;
+        text[0] = 0;
+        have_key = 0;
+        break;
+      case YAML_SCALAR_EVENT:
+      {
+        const char *value = reinterpret_cast<char*>(event.data.scalar.value);
+
+        if(!have_key)
+        {
+          snprintf(key, sizeof(key), "%s", value);
+          have_key = 1;
+          if(strcmp(key, "Shaders") == 0)
           {
-            // read in Open Status
-            in_read = 10;
+            // a sequence of shaders follows, not a value
+            in_shaders = 1;
+            have_key = 0;
           }
+          break;
+        }
+        have_key = 0;
+
+        if(strcmp(key, "shader_name") == 0)
+        {
+          snprintf(name, sizeof(name), "%s", value);
+        }
+        else if(strcmp(key, "expression") == 0)
+        {
+          snprintf(text, sizeof(text), "%s", value);
+        }
+        break;
+      }
+      default:
+        break;
+      }
+
+      if(event.type != YAML_STREAM_END_EVENT)
+      {
+        yaml_event_delete(&event);
+      }
+    } while(event.type != YAML_STREAM_END_EVENT);
+
+    if(!failed)
+    {
+      yaml_event_delete(&event);
+    }
+    yaml_parser_delete(&parser);
+    fclose(fh);
+  }
+
+  if(failed || shaders.empty())
+  {
+    if(fh != NULL)
+    {
+      LOG(LOG_ERROR, "Failed to read shaders.conf, using the built-in shaders");
+    }
+    shaders.clear();
+    for(unsigned int j = 0; j < sizeof(default_shaders) / sizeof(default_shaders[0]); j++)
+    {
+      ShaderAdd(default_shaders[j][0], default_shaders[j][1]);
+    }
+  }
+}
+
+struct shader_job
+{
+  effect_state *s;
+  const shader_program *prog;
+  uint8_t *buffer;
+};
+
+inline float *ShaderReg(effect_state *s, const shader_program *prog, int worker, int n)
+{
+  return(prog->nodes[n].uniform ? s->shader_regs[n] : s->shader_work[worker][n]);
+}
+
+void ShaderChunk(void *arg, int worker, int chunk)
+{
+  // runs the per batch program over one SHADER_BATCH LEDs and stores the colors
+  shader_job *job = (shader_job *) arg;
+  effect_state *s = job->s;
+  const shader_program *prog = job->prog;
+  int base = chunk * SHADER_BATCH;
+  int count = std::min(SHADER_BATCH, num_leds - base);
+
+  for(int j = 0; j < prog->varying_len; j++)
+  {
+    int n = prog->varying_code[j];
+    const shader_node *node = &prog->nodes[n];
+    float *d = s->shader_work[worker][n];
+
+    switch(node->op)
+    {
+      case SH_I: for(int k = 0; k < count; k++) d[k] = base + k; break;
+      case SH_X: for(int k = 0; k < count; k++) d[k] = led_x[base + k]; break;
+      case SH_Y: for(int k = 0; k < count; k++) d[k] = led_y[base + k]; break;
+      case SH_ANGLE: for(int k = 0; k < count; k++) d[k] = led_angle[base + k]; break;
+      default:
+        ShaderBatch(node->op, d, ShaderReg(s, prog, worker, node->args[0]),
+                    ShaderReg(s, prog, worker, (node->args[1] >= 0) ? node->args[1] : node->args[0]),
+                    ShaderReg(s, prog, worker, (node->args[2] >= 0) ? node->args[2] : node->args[0]), count);
+        break;
+    }
+  }
+
+  const float *c0 = ShaderReg(s, prog, worker, prog->out[0]);
+  const float *c1 = ShaderReg(s, prog, worker, prog->out[1]);
+  const float *c2 = ShaderReg(s, prog, worker, prog->out[2]);
+  uint8_t *led = job->buffer + base * 3;
+
+  if(prog->hsv)
+  {
+    // hue round the color wheel from the distance to each primary
+    for(int k = 0; k < count; k++)
+    {
+      float h = c0[k] - floorf(c0[k]);
+      float sat = std::min(std::max(c1[k], 0.0f), 1.0f);
+      float val = std::min(std::max(c2[k], 0.0f), 1.0f) * 255;
+      float r = std::min(std::max(fabsf(h * 6 - 3) - 1, 0.0f), 1.0f);
+      float g = std::min(std::max(2 - fabsf(h * 6 - 2), 0.0f), 1.0f);
+      float b = std::min(std::max(2 - fabsf(h * 6 - 4), 0.0f), 1.0f);
+      led[k*3] = uint8_t(val * (1 - sat + sat * b));
+      led[k*3+1] = uint8_t(val * (1 - sat + sat * g));
+      led[k*3+2] = uint8_t(val * (1 - sat + sat * r));
+    }
+  }
+  else
+  {
+    for(int k = 0; k < count; k++)
+    {
+      led[k*3] = uint8_t(std::min(std::max(c2[k], 0.0f), 1.0f) * 255);
+      led[k*3+1] = uint8_t(std::min(std::max(c1[k], 0.0f), 1.0f) * 255);
+      led[k*3+2] = uint8_t(std::min(std::max(c0[k], 0.0f), 1.0f) * 255);
+    }
+  }
+}
+
+void ShaderRender(effect_state *s, const shader_program *prog, float t, uint8_t *buffer)
+{
+  /*
+    Runs the per frame program, copies the per frame values the LEDs need
+    into their registers, then the render pool runs the per batch program
+    over the LEDs SHADER_BATCH at a time
+  */
+  float *u = s->shader_uniforms;
+  float params[6] = { s->r1 / 255.0f, s->g1 / 255.0f, s->b1 / 255.0f, s->r2 / 255.0f, s->g2 / 255.0f, s->b2 / 255.0f };
+
+  for(int j = 0; j < prog->uniform_len; j++)
+  {
+    int n = prog->uniform_code[j];
+    const shader_node *node = &prog->nodes[n];
+
+    switch(node->op)
+    {
+      case SH_CONST: u[n] = node->value; break;
+      case SH_N: u[n] = num_leds; break;
+      case SH_T: u[n] = t; break;
+      case SH_PARAM: u[n] = params[int(node->value)]; break;
+      default:
+        u[n] = ShaderScalar(node->op, u[node->args[0]], (node->args[1] >= 0) ? u[node->args[1]] : 0, (node->args[2] >= 0) ? u[node->args[2]] : 0);
+        break;
+    }
+
+    if(node->broadcast)
+    {
+      for(int k = 0; k < SHADER_BATCH; k++)
+      {
+        s->shader_regs[n][k] = u[n];
+      }
+    }
+  }
+
+  shader_job job = { s, prog, buffer };
+  PoolRun((num_leds + SHADER_BATCH - 1) / SHADER_BATCH, ShaderChunk, &job);
+}
+
+void TransitionBuffers(uint8_t *buffer1, uint8_t *buffer2, uint8_t *mixed_buffer, uint8_t transition, uint16_t progress)
+{
+  // progress runs from 0 (all of buffer1) to 256 (all of buffer2)
+  int edge;
+  uint8_t *src;
+
+  switch(transition)
+  {
+  case CROSSFADE:
+    SPECIALIZED(CrossfadeKernel, buffer1, buffer2, mixed_buffer, progress);
+    break;
+
+  case WIPE:
+    edge = (num_leds * progress) >> 8;
+    memcpy(mixed_buffer, buffer2, edge * 3);
+    memcpy(mixed_buffer + edge * 3, buffer1 + edge * 3, (num_leds - edge) * 3);
+    break;
+
+  case DISSOLVE:
+    for(int i = 0; i < num_leds; i++)
+    {
+      src = (dissolve_order[i] < progress) ? buffer2 : buffer1;
+      mixed_buffer[i*3] = src[i*3];
+      mixed_buffer[i*3+1] = src[i*3+1];
+      mixed_buffer[i*3+2] = src[i*3+2];
+    }
+    break;
+  }
+}
+
+
+// media playback
+
+// the file the schedule or --media asked for, and the ring the media thread
+// fills from it. generation goes up with every new file so the thread can
+// drop what it was doing.
+char media_path[MEDIA_PATH_SIZE] = "";
+struct media_ring
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  char path[MEDIA_PATH_SIZE];
+  uint32_t generation;
+  uint32_t head, tail;
+  int delay[MEDIA_RING];
+  uint8_t frames[MEDIA_RING][MAX_LEDS * 3];
+} media = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+int MediaWord(FILE *fh)
+{
+  // GIF numbers are little endian
+  int lo = fgetc(fh);
+  int hi = fgetc(fh);
+  return lo | (hi << 8);
+}
+
+void MediaSkipBlocks(FILE *fh)
+{
+  // skips GIF data sub-blocks up to the empty one that ends them
+  int len;
+  while((len = fgetc(fh)) > 0)
+  {
+    fseek(fh, len, SEEK_CUR);
+  }
+}
+
+int MediaPpmNumber(FILE *fh)
+{
+  // the next number of a PPM header, skipping white space and comments
+  int c = fgetc(fh);
+  while(c == '#' || isspace(c))
+  {
+    if(c == '#')
+    {
+      while(c != '\n' && c != EOF)
+      {
+        c = fgetc(fh);
+      }
+    }
+    c = fgetc(fh);
+  }
+
+  int value = -1;
+  while(c >= '0' && c <= '9')
+  {
+    value = ((value < 0) ? 0 : value * 10) + (c - '0');
+    c = fgetc(fh);
+  }
+  // the single white space after the last number is eaten here
+  return value;
+}
+
+uint8_t MediaPpmHeader(media_decoder *d)
+{
+  // reads "P6 width height 255", 0 at the end of the file or if it's wrong
+  if(fgetc(d->fh) != 'P' || fgetc(d->fh) != '6')
+  {
+    return 0;
+  }
+  int width = MediaPpmNumber(d->fh);
+  int height = MediaPpmNumber(d->fh);
+  int maxval = MediaPpmNumber(d->fh);
+  if(maxval != 255 || (d->width && (width != d->width || height != d->height)))
+  {
+    return 0;
+  }
+  d->width = width;
+  d->height = height;
+  return 1;
+}
+
+void MediaMap(media_decoder *d)
+{
+  /*
+    Works out which pixel each LED shows. A still goes along the strip, the
+    first LED at the left of each row and the last at the right. Frames of
+    an animation are stretched over the wall's layout, the top of the image
+    at the largest y.
+  */
+  float min_x = led_x[0], max_x = led_x[0], min_y = led_y[0], max_y = led_y[0];
+  for(int i = 1; i < num_leds; i++)
+  {
+    min_x = std::min(min_x, led_x[i]);
+    max_x = std::max(max_x, led_x[i]);
+    min_y = std::min(min_y, led_y[i]);
+    max_y = std::max(max_y, led_y[i]);
+  }
+  float sx = (d->width - 1) / std::max(max_x - min_x, 1.0f);
+  float sy = (d->height - 1) / std::max(max_y - min_y, 1.0f);
+
+  d->map.resize(num_leds);
+  for(int i = 0; i < num_leds; i++)
+  {
+    if(d->still)
+    {
+      d->map[i] = (uint32_t(i) * d->width / num_leds) * 3;
+    }
+    else
+    {
+      uint32_t px = lrintf((led_x[i] - min_x) * sx);
+      uint32_t py = lrintf((max_y - led_y[i]) * sy);
+      d->map[i] = (py * d->width + px) * 3;
+    }
+  }
+}
+
+void MediaResample(media_decoder *d, const uint8_t *src)
+{
+  const uint32_t *map = &d->map[0];
+  for(int i = 0; i < num_leds; i++)
+  {
+    d->leds[i*3] = src[map[i]];
+    d->leds[i*3+1] = src[map[i]+1];
+    d->leds[i*3+2] = src[map[i]+2];
+  }
+}
+
+uint8_t MediaOpen(media_decoder *d, FILE *fh)
+{
+  /*
+    Reads the header of a GIF or PPM stream, looks ahead to see if there's
+    more than one frame and sets up the canvas and LED map. Returns 0 if
+    it's neither or too big. Nothing is decoded yet.
+  */
+  char magic[6] = { 0 };
+  int frames = 0;
+
+  d->fh = fh;
+  d->width = d->height = 0;
+  d->delay = 0;
+  d->transparent = -1;
+  d->disposal = 0;
+
+  if(fread(magic, 1, 6, fh) == 6 && (memcmp(magic, "GIF87a", 6) == 0 || memcmp(magic, "GIF89a", 6) == 0))
+  {
+    d->format = MEDIA_GIF;
+    d->width = MediaWord(fh);
+    d->height = MediaWord(fh);
+    int packed = fgetc(fh);
+    fgetc(fh);
+    fgetc(fh);
+
+    memset(d->global_table, 0, sizeof(d->global_table));
+    if(packed & 0x80)
+    {
+      fread(d->global_table, 3, 2 << (packed & 7), fh);
+    }
+    d->data_start = ftell(fh);
+
+    // count images, up to two, without decoding them
+    int c;
+    while(frames < 2 && (c = fgetc(fh)) != EOF && c != 0x3b)
+    {
+      if(c == 0x21)
+      {
+        fgetc(fh);
+        MediaSkipBlocks(fh);
+      }
+      else if(c == 0x2c)
+      {
+        fseek(fh, 8, SEEK_CUR);
+        packed = fgetc(fh);
+        if(packed & 0x80)
+        {
+          fseek(fh, 3 * (2 << (packed & 7)), SEEK_CUR);
+        }
+        fgetc(fh);
+        MediaSkipBlocks(fh);
+        frames++;
+      }
+      else
+      {
+        break;
+      }
+    }
+  }
+  else
+  {
+    d->format = MEDIA_PPM;
+    rewind(fh);
+    d->data_start = 0;
+    while(frames < 2 && MediaPpmHeader(d))
+    {
+      fseek(fh, long(d->width) * d->height * 3, SEEK_CUR);
+      frames++;
+    }
+  }
+
+  if(frames == 0 || d->width <= 0 || d->height <= 0 || long(d->width) * d->height > MEDIA_MAX_PIXELS)
+  {
+    return 0;
+  }
+
+  d->still = (frames == 1);
+  d->canvas.assign(size_t(d->width) * (d->still ? 1 : d->height) * 3, 0);
+  MediaMap(d);
+  fseek(fh, d->data_start, SEEK_SET);
+  return 1;
+}
+
+int MediaGifByte(media_decoder *d)
+{
+  // the next byte of LZW data, -1 once the sub-blocks run out
+  if(d->block_left == 0)
+  {
+    int len = fgetc(d->fh);
+    if(len <= 0)
+    {
+      d->block_left = -1;
+    }
+    else
+    {
+      d->block_left = len;
+    }
+  }
+  if(d->block_left < 0)
+  {
+    return -1;
+  }
+  d->block_left--;
+  return fgetc(d->fh);
+}
+
+uint8_t MediaGifImage(media_decoder *d, media_sink sink, void *ctx)
+{
+  /*
+    Decodes one image: reads its descriptor and color table and unpacks the
+    LZW codes straight onto the canvas. A still hands each row on as soon
+    as it's done (all of them at the end if it's interlaced, when the whole
+    image has to be kept), an animation the whole frame. Returns 0 if the
+    sink wants to stop or the data is broken.
+  */
+  int fx = MediaWord(d->fh);
+  int fy = MediaWord(d->fh);
+  int fw = MediaWord(d->fh);
+  int fh = MediaWord(d->fh);
+  int packed = fgetc(d->fh);
+  uint8_t interlaced = packed & 0x40;
+  const uint8_t *table = d->global_table;
+  int delay = (d->delay < 2) ? 100000 : d->delay * 10000;
+
+  if(packed & 0x80)
+  {
+    memset(d->local_table, 0, sizeof(d->local_table));
+    fread(d->local_table, 3, 2 << (packed & 7), d->fh);
+    table = d->local_table;
+  }
+
+  // clip the image to the screen
+  fw = std::min(fw, d->width - fx);
+  fh = std::min(fh, d->height - fy);
+  if(fw <= 0 || fh <= 0)
+  {
+    fgetc(d->fh);
+    MediaSkipBlocks(d->fh);
+    return 1;
+  }
+
+  if(d->still && interlaced && d->canvas.size() < size_t(d->width) * d->height * 3)
+  {
+    d->canvas.assign(size_t(d->width) * d->height * 3, 0);
+  }
+  uint8_t whole = !d->still || interlaced;
+  if(d->disposal == 3 && whole)
+  {
+    d->previous = d->canvas;
+  }
+
+  int min_size = fgetc(d->fh);
+  if(min_size < 2 || min_size > 8)
+  {
+    return 0;
+  }
+  int clear = 1 << min_size;
+  int size = min_size + 1, next = clear + 2, old = -1;
+  uint8_t first = 0;
+  uint32_t bits = 0;
+  int nbits = 0;
+  int x = 0, row = 0, pass = 0;
+  const static int pass_start[] = { 0, 4, 2, 1 };
+  const static int pass_step[] = { 8, 8, 4, 2 };
+  uint8_t ok = 1;
+
+  d->block_left = 0;
+  while(row < fh && ok)
+  {
+    while(nbits < size)
+    {
+      int byte = MediaGifByte(d);
+      if(byte < 0)
+      {
+        break;
+      }
+      bits |= uint32_t(byte) << nbits;
+      nbits += 8;
+    }
+    if(nbits < size)
+    {
+      break;
+    }
+
+    int code = bits & ((1 << size) - 1);
+    bits >>= size;
+    nbits -= size;
+
+    if(code == clear)
+    {
+      size = min_size + 1;
+      next = clear + 2;
+      old = -1;
+      continue;
+    }
+    if(code == clear + 1 || code > next || (old < 0 && code >= clear))
+    {
+      break;
+    }
+
+    // the code's pixels come out of the table backwards
+    int sp = 0;
+    if(old < 0)
+    {
+      d->stack[sp++] = code;
+      first = code;
+    }
+    else
+    {
+      int c = code;
+      if(code == next)
+      {
+        d->stack[sp++] = first;
+        c = old;
+      }
+      while(c >= clear)
+      {
+        d->stack[sp++] = d->suffix[c];
+        c = d->prefix[c];
+      }
+      d->stack[sp++] = c;
+      first = c;
+      if(next < 4096)
+      {
+        d->prefix[next] = old;
+        d->suffix[next] = first;
+        next++;
+        if(next == (1 << size) && size < 12)
+        {
+          size++;
+        }
+      }
+    }
+    old = code;
+
+    while(sp && row < fh)
+    {
+      uint8_t index = d->stack[--sp];
+      if(index != d->transparent)
+      {
+        uint8_t *pixel = &d->canvas[((whole ? size_t(fy + row) * d->width : 0) + fx + x) * 3];
+        pixel[0] = table[index*3+2];
+        pixel[1] = table[index*3+1];
+        pixel[2] = table[index*3];
+      }
+
+      if(++x < fw)
+      {
+        continue;
+      }
+      x = 0;
+      if(!whole)
+      {
+        MediaResample(d, &d->canvas[0]);
+        ok = sink(ctx, d->leds, 1000000 / MEDIA_FPS);
+      }
+      if(interlaced)
+      {
+        row += pass_step[pass];
+        while(row >= fh && pass < 3)
+        {
+          pass++;
+          row = pass_start[pass];
+        }
+      }
+      else
+      {
+        row++;
+      }
+      if(interlaced && pass == 3 && row >= fh)
+      {
+        row = fh;
+      }
+    }
+  }
+
+  // whatever's left of the data, then the empty block after it
+  if(d->block_left > 0)
+  {
+    fseek(d->fh, d->block_left, SEEK_CUR);
+  }
+  if(d->block_left >= 0)
+  {
+    MediaSkipBlocks(d->fh);
+  }
+  if(!ok)
+  {
+    return 0;
+  }
+
+  if(d->still && interlaced)
+  {
+    for(int y = 0; y < d->height && ok; y++)
+    {
+      MediaResample(d, &d->canvas[size_t(y) * d->width * 3]);
+      ok = sink(ctx, d->leds, 1000000 / MEDIA_FPS);
+    }
+  }
+  else if(!d->still)
+  {
+    MediaResample(d, &d->canvas[0]);
+    ok = sink(ctx, d->leds, delay);
+
+    // get the canvas ready for the next image
+    if(d->disposal == 2)
+    {
+      for(int y = fy; y < fy + fh; y++)
+      {
+        memset(&d->canvas[(size_t(y) * d->width + fx) * 3], 0, fw * 3);
+      }
+    }
+    else if(d->disposal == 3 && d->previous.size() == d->canvas.size())
+    {
+      d->canvas.swap(d->previous);
+    }
+  }
+
+  // the graphic control extension only covers one image
+  d->delay = 0;
+  d->transparent = -1;
+  d->disposal = 0;
+  return ok;
+}
+
+uint8_t MediaDecode(media_decoder *d, media_sink sink, void *ctx)
+{
+  /*
+    One pass through the file from the first frame: every frame, or every
+    row of a still, resampled and handed to sink. Returns 0 if sink wanted
+    to stop or nothing could be decoded, so the caller doesn't spin on a
+    broken file.
+  */
+  int frames = 0;
+
+  fseek(d->fh, d->data_start, SEEK_SET);
+  if(d->format == MEDIA_PPM)
+  {
+    while(MediaPpmHeader(d))
+    {
+      for(int y = 0; y < (d->still ? d->height : 1); y++)
+      {
+        if(fread(&d->canvas[0], 1, d->canvas.size(), d->fh) != d->canvas.size())
+        {
+          return frames > 0;
+        }
+        // PPM is red, green, blue
+        for(size_t i = 0; i < d->canvas.size(); i += 3)
+        {
+          std::swap(d->canvas[i], d->canvas[i+2]);
         }
+        MediaResample(d, &d->canvas[0]);
+        frames++;
+        if(!sink(ctx, d->leds, 1000000 / MEDIA_FPS))
+        {
+          return 0;
+        }
+      }
+    }
+    return frames > 0;
+  }
+
+  // GIF: the canvas starts each pass black
+  std::fill(d->canvas.begin(), d->canvas.end(), 0);
+  int c;
+  while((c = fgetc(d->fh)) != EOF && c != 0x3b)
+  {
+    if(c == 0x21)
+    {
+      int label = fgetc(d->fh);
+      if(label == 0xf9)
+      {
+        // graphic control extension: disposal, delay and transparency
+        fgetc(d->fh);
+        int packed = fgetc(d->fh);
+        d->delay = MediaWord(d->fh);
+        int transparent = fgetc(d->fh);
+        d->disposal = (packed >> 2) & 7;
+        d->transparent = (packed & 1) ? transparent : -1;
+      }
+      MediaSkipBlocks(d->fh);
+    }
+    else if(c == 0x2c)
+    {
+      if(!MediaGifImage(d, sink, ctx))
+      {
+        return 0;
+      }
+      frames++;
+    }
+    else
+    {
+      break;
+    }
+  }
+  return frames > 0;
+}
+
+uint8_t MediaPush(void *ctx, const uint8_t *leds, int delay)
+{
+  // sink for the media thread: waits for room in the ring, 0 if the file's
+  // been changed meanwhile
+  uint32_t generation = *(uint32_t *) ctx;
+
+  pthread_mutex_lock(&media.mutex);
+  while(media.head - media.tail == MEDIA_RING && media.generation == generation)
+  {
+    pthread_cond_wait(&media.cond, &media.mutex);
+  }
+  uint8_t current = (media.generation == generation);
+  if(current)
+  {
+    memcpy(media.frames[media.head % MEDIA_RING], leds, num_leds * 3);
+    media.delay[media.head % MEDIA_RING] = delay;
+    media.head++;
+  }
+  pthread_mutex_unlock(&media.mutex);
+  return current;
+}
+
+void MediaThread(void)
+{
+  /*
+    Decodes the requested file round and round into the ring, sleeping while
+    the ring is full and nothing else has been asked for. Started once, as
+    an ordinary thread.
+  */
+  static media_decoder decoder;
+  uint32_t seen = 0;
+  char path[MEDIA_PATH_SIZE];
+
+  pthread_mutex_lock(&media.mutex);
+  while(1)
+  {
+    while(media.generation == seen)
+    {
+      pthread_cond_wait(&media.cond, &media.mutex);
+    }
+    seen = media.generation;
+    snprintf(path, sizeof(path), "%s", media.path);
+    pthread_mutex_unlock(&media.mutex);
+
+    FILE *fh = fopen(path, "rb");
+    if(fh == NULL)
+    {
+      LOG(LOG_ERROR, "Failed to open media %s", path);
+    }
+    else if(!MediaOpen(&decoder, fh))
+    {
+      LOG(LOG_ERROR, "media %s isn't a GIF or PPM, or is too big", path);
+    }
+    else
+    {
+      LOG(LOG_INFO, "media %s: %dx%d %s", path, decoder.width, decoder.height, decoder.still ? "still, a row per frame" : "animation");
+      while(MediaDecode(&decoder, MediaPush, &seen))
+      {
+      }
+    }
+    if(fh != NULL)
+    {
+      fclose(fh);
+    }
+
+    pthread_mutex_lock(&media.mutex);
+  }
+}
+
+void MediaStart(const char *path)
+{
+  // asks the media thread for path unless it's already playing it
+  pthread_mutex_lock(&media.mutex);
+  if(strcmp(media.path, path) != 0)
+  {
+    snprintf(media.path, sizeof(media.path), "%s", path);
+    media.generation++;
+    media.head = media.tail = 0;
+    pthread_cond_signal(&media.cond);
+  }
+  pthread_mutex_unlock(&media.mutex);
+}
+
+int MediaPop(uint8_t *buffer)
+{
+  // the next decoded frame into buffer and how long to show it, -1 if
+  // there isn't one yet
+  int delay = -1;
+
+  pthread_mutex_lock(&media.mutex);
+  if(media.head != media.tail)
+  {
+    memcpy(buffer, media.frames[media.tail % MEDIA_RING], num_leds * 3);
+    delay = media.delay[media.tail % MEDIA_RING];
+    media.tail++;
+    pthread_cond_signal(&media.cond);
+  }
+  pthread_mutex_unlock(&media.mutex);
+  return delay;
+}
+
+
+// effect functions
+//
+// each effect has an Init function that picks its colors and sets up its
+// state, and a Frame function that renders one frame into s->layer. effects
+// only touch their own state so two of them can run during a transition.
+
+void OffInit(effect_state *s)
+{
+  s->frame_delay = 20;
+}
+
+void OffFrame(effect_state *s)
+{
+  // layer is cleared by EffectInit and stays black
+}
+
+void SparkleInit(effect_state *s)
+{
+  LOG(LOG_INFO, "Random Sparkle");
+
+  s->frame_delay = 20;
+}
+
+void SparkleFrame(effect_state *s)
+{
+  uint8_t red_val = 0;
+  uint8_t green_val = 0;
+  uint8_t blue_val = 0;
+
+  FadeBuffer(s->layer, FADE_VAL);
+
+  int pwmnum = rand() % num_leds;
+  red_val = RandomColor(128);
+  green_val = RandomColor(128);
+  blue_val = RandomColor(128);
+
+  s->layer[pwmnum*3] = blue_val;
+  s->layer[pwmnum*3+1] = green_val;
+  s->layer[pwmnum*3+2] = red_val;
+}
+
+void SlowSparkleInit(effect_state *s)
+{
+  LOG(LOG_INFO, "Slow Sparkle");
+
+  s->frame_delay = 20;
+}
+
+void SlowSparkleFrame(effect_state *s)
+{
+  uint8_t red_val = 0;
+  uint8_t green_val = 0;
+  uint8_t blue_val = 0;
+
+  int pwmnum = rand() % num_leds;
+  red_val = RandomColor(128);
+  green_val = RandomColor(128);
+  blue_val = RandomColor(128);
+
+  s->buffer2[pwmnum*3] = blue_val;
+  s->buffer2[pwmnum*3+1] = green_val;
+  s->buffer2[pwmnum*3+2] = red_val;
+
+  pwmnum = rand() % num_leds;
+
+  s->buffer2[pwmnum*3] = 0;
+  s->buffer2[pwmnum*3+1] = 0;
+  s->buffer2[pwmnum*3+2] = 0;
+
+  pwmnum = rand() % num_leds;
+
+  s->buffer2[pwmnum*3] = 0;
+  s->buffer2[pwmnum*3+1] = 0;
+  s->buffer2[pwmnum*3+2] = 0;
+
+  FadeToBuffer(s->layer, s->buffer2, 1);
+}
+
+void PickColors(effect_state *s)
+{
+  // use the personal colors if someone badged in, otherwise random ones
+  if(p_r1 || p_r2 || p_g1 || p_g2 || p_b1 || p_b2)
+  {
+    s->r1 = p_r1;
+    s->g1 = p_g1;
+    s->b1 = p_b1;
+    s->b2 = p_b2;
+    s->g2 = p_g2;
+    s->r2 = p_r2;
+  }
+  else
+  {
+    // two colors from opposite sides of a random palette, so they go together
+    const palette *p = &palettes[rand() % palettes.size()];
+    uint8_t index = rand() % PALETTE_SIZE;
+    PaletteColor(p, index, &s->r1, &s->g1, &s->b1);
+    PaletteColor(p, index + PALETTE_SIZE / 2, &s->r2, &s->g2, &s->b2);
+  }
+}
+
+void RandomTwoColorSparkleInit(effect_state *s)
+{
+  PickColors(s);
+
+  LOG(LOG_INFO, "Random Two Color Sparkle");
+
+  s->frame_delay = 20;
+}
+
+void RandomTwoColorSparkleFrame(effect_state *s)
+{
+  FadeBuffer(s->layer, FADE_VAL);
+
+  int pwmnum = rand() % num_leds;
+
+  if(rand() % 255 > 128)
+  {
+    s->layer[pwmnum*3] = s->b1;
+    s->layer[pwmnum*3+1] = s->g1;
+    s->layer[pwmnum*3+2] = s->r1;
+  }
+  else
+  {
+    s->layer[pwmnum*3] = s->b2;
+    s->layer[pwmnum*3+1] = s->g2;
+    s->layer[pwmnum*3+2] = s->r2;
+  }
+}
+
+void SlowTwoColorSparkleInit(effect_state *s)
+{
+  PickColors(s);
+
+  LOG(LOG_INFO, "Slow Two Color Sparkle");
+
+  s->frame_delay = 20;
+}
+
+void SlowTwoColorSparkleFrame(effect_state *s)
+{
+  int pwmnum = rand() % num_leds;
+
+  if(rand() % 255 > 128)
+  {
+    s->buffer2[pwmnum*3] = s->b1;
+    s->buffer2[pwmnum*3+1] = s->g1;
+    s->buffer2[pwmnum*3+2] = s->r1;
+  }
+  else
+  {
+    s->buffer2[pwmnum*3] = s->b2;
+    s->buffer2[pwmnum*3+1] = s->g2;
+    s->buffer2[pwmnum*3+2] = s->r2;
+  }
+
+  pwmnum = rand() % num_leds;
+
+  s->buffer2[pwmnum*3] = 0;
+  s->buffer2[pwmnum*3+1] = 0;
+  s->buffer2[pwmnum*3+2] = 0;
+
+  pwmnum = rand() % num_leds;
+
+  s->buffer2[pwmnum*3] = 0;
+  s->buffer2[pwmnum*3+1] = 0;
+  s->buffer2[pwmnum*3+2] = 0;
+
+  FadeToBuffer(s->layer, s->buffer2, 1);
+}
+
+void RandomTwoColorFadeInit(effect_state *s)
+{
+  s->direction = rand() % 2;
+
+  LOG(LOG_INFO, "Random Two Color Fade %s", s->direction ? "Right" : "Left");
+
+  PickColors(s);
+
+  // one half fades color 1 to 2, the other back again
+  int half = num_leds / 2;
+  Fill(s->layer, 0, half - 1, s->r1,s->g1,s->b1,s->r2,s->g2,s->b2);
+  Fill(s->layer, half, num_leds - 1, s->r2,s->g2,s->b2,s->r1,s->g1,s->b1);
+
+  s->frame_delay = 100;
+}
+
+void RandomTwoColorFadeFrame(effect_state *s)
+{
+  Rotate(s->layer, s->direction);
+}
+
+void RedAlertInit(effect_state *s)
+{
+  LOG(LOG_INFO, "Red Alert");
+
+  PickColors(s);
+
+  // a pulse along each wall, walls in pairs alternating color 1 and 2
+  // starting with one of each so neighbouring walls meet in the same color
+  for(int i = 0; i < num_segments; i++)
+  {
+    layout_segment *seg = &segments[i];
+    if(((i + 1) / 2) % 2 == 0)
+    {
+      SinFade(s->layer, 0, seg->first, seg->count - seg->corner, 0,0,0,s->r1,s->g1,s->b1);
+    }
+    else
+    {
+      SinFade(s->layer, 0, seg->first, seg->count - seg->corner, 0,0,0,s->r2,s->g2,s->b2);
+    }
+  }
+
+  s->frame_delay = 100;
+}
+
+void RedAlertFrame(effect_state *s)
+{
+  // static effect, nothing to do
+}
+
+void RainbowInit(effect_state *s)
+{
+  s->direction = rand() % 2;
+
+  LOG(LOG_INFO, "Rainbow Cycle %s", s->direction ? "Right" : "Left");
+
+  PaletteFill(s->layer, FindPalette("Rainbow"), 0, PaletteStep(1));
+
+  s->frame_delay = 100;
+}
+
+void RainbowFrame(effect_state *s)
+{
+  Rotate(s->layer, s->direction);
+}
+
+
+void RainbowSparklesInit(effect_state *s)
+{
+  s->direction = rand() % 2;
+
+  if(p_r1 || p_r2 || p_g1 || p_g2 || p_b1 || p_b2)
+  {
+    s->r1 = p_r1;
+    s->g1 = p_g1;
+    s->b1 = p_b1;
+    s->mixval = REPLACE;
+  }
+  else
+  {
+    s->r1 = 255;
+    s->g1 = 255;
+    s->b1 = 255;
+    s->mixval = HARD_MIX;
+  }
+
+  LOG(LOG_INFO, "Rainbow Sparkles %s", s->direction ? "Right" : "Left");
+
+  PaletteFill(s->buffer1, FindPalette("Rainbow"), 0, PaletteStep(1));
+
+  s->frame_delay = 100;
+}
+
+void RainbowSparklesFrame(effect_state *s)
+{
+  int pwmnum = rand() % num_leds;
+
+  s->buffer3[pwmnum*3] = s->b1;
+  s->buffer3[pwmnum*3+1] = s->g1;
+  s->buffer3[pwmnum*3+2] = s->r1;
+
+  FadeToBuffer(s->buffer2, s->buffer3, 75);
+
+  for(int i = 0 ; i < num_leds ; i++)
+  {
+    if(s->buffer2[pwmnum*3] >= (s->buffer3[pwmnum*3] - 100)
+       && s->buffer2[pwmnum*3+1] >= (s->buffer3[pwmnum*3+1] - 100)
+       && s->buffer2[pwmnum*3+2] >= (s->buffer3[pwmnum*3+2] - 100) )
+    {
+      s->buffer3[pwmnum*3] = 0;
+      s->buffer3[pwmnum*3+1] = 0;
+      s->buffer3[pwmnum*3+2] = 0;
+    }
+  }
+
+  MixBuffers(s->buffer1, s->buffer2, s->layer, s->mixval);
+
+  Rotate(s->buffer1, s->direction);
+}
+
+
+void LavaLampInit(effect_state *s)
+{
+  s->blend = rand() % 4 + 1;
+
+  if(p_r1 || p_r2 || p_g1 || p_g2 || p_b1 || p_b2)
+  {
+    PickColors(s);
+  }
+  else
+  {
+    s->r1 = std::max(RandomColor(128), RandomColor(128));
+    s->g1 = RandomColor(128);
+    s->b1 = RandomColor(128);
+    s->r2 = RandomColor(128);
+    s->g2 = RandomColor(128);
+    s->b2 = RandomColor(128);
+  }
+
+  LOG(LOG_INFO, "Lava Lamp");
+
+  // seven to thirteen blobs drifting round the strip, group is the color
+  particle_system *ps = &s->particles;
+  ParticleClear(ps, 1, 1);
+
+  int total_blobs = rand() % 7 + 7;
+  for(int i=0 ; i < total_blobs ; i++)
+  {
+    int color = rand() % 2;
+    int p = ParticleSpawn(ps, rand() % num_leds, float((rand() % 150)-75)/100, rand() % 80 + 10, PARTICLE_FOREVER,
+                          color ? s->r1 : s->r2, color ? s->g1 : s->g2, color ? s->b1 : s->b2);
+    ps->group[p] = color;
+  }
+
+  s->frame_delay = 100;
+}
+
+void LavaLampFrame(effect_state *s)
+{
+  particle_system *ps = &s->particles;
+
+  ParticleUpdate(ps);
+
+  ParticleRender(ps, 1, PARTICLE_MAX, 1, 1);
+  ParticleResolve(ps, s->buffer1);
+  ParticleRender(ps, 0, PARTICLE_MAX, 1, 1);
+  ParticleResolve(ps, s->buffer2);
+
+  MixBuffers(s->buffer1, s->buffer2, s->layer, s->blend);
+}
+
+void ColorOrganInit(effect_state *s)
+{
+  s->blend = MAX;
+
+  if(p_r1 || p_r2 || p_g1 || p_g2 || p_b1 || p_b2)
+  {
+    PickColors(s);
+    s->r3 = RandomColor(128);
+    s->g3 = RandomColor(128);
+    s->b3 = RandomColor(128);
+  }
+  else
+  {
+    s->r1 = 255;
+    s->g1 = 0;
+    s->b1 = 0;
+    s->r2 = 0;
+    s->g2 = 255;
+    s->b2 = 0;
+    s->r3 = 0;
+    s->g3 = 0;
+    s->b3 = 255;
+  }
+
+  LOG(LOG_INFO, "Color Organ");
+
+  // one blob per color, group is the blob's layer
+  particle_system *ps = &s->particles;
+  ParticleClear(ps, 1, 1);
+
+  uint8_t colors[3][3] = { { s->r1, s->g1, s->b1 }, { s->r2, s->g2, s->b2 }, { s->r3, s->g3, s->b3 } };
+  for(int i=0 ; i < 3 ; i++)
+  {
+    int p = ParticleSpawn(ps, rand() % num_leds, float((rand() % 150)-75)/100, rand() % 20 + (num_leds / 4), PARTICLE_FOREVER,
+                          colors[i][0], colors[i][1], colors[i][2]);
+    ps->group[p] = i;
+  }
+
+  s->frame_delay = 100;
+}
+
+void ColorOrganFrame(effect_state *s)
+{
+  particle_system *ps = &s->particles;
+
+  // with audio input the three blobs follow bass, mids and treble
+  audio_snapshot snap;
+  uint8_t audio = AudioRead(&snap);
+  float levels[3] = { 1, 1, 1 };
+
+  if(audio)
+  {
+    levels[0] = std::max(snap.bands[0], snap.bands[1]);
+    levels[1] = (snap.bands[2] + snap.bands[3] + snap.bands[4]) / 3;
+    levels[2] = (snap.bands[5] + snap.bands[6] + snap.bands[7]) / 3;
+
+    if(snap.seq != s->audio_seq)
+    {
+      HistogramObserve(&audio_latency, MicroTime() - snap.captured);
+      s->audio_seq = snap.seq;
+    }
+  }
+
+  ParticleUpdate(ps);
+
+  // paint blobs, shrunk and dimmed to the audio level
+  uint8_t *layers[3] = { s->buffer1, s->buffer2, s->buffer3 };
+  for(int i=0 ; i < 3 ; i++)
+  {
+    ParticleRender(ps, i, PARTICLE_MAX, levels[i], audio ? (0.5 + levels[i] * 0.5) : 1);
+    ParticleResolve(ps, layers[i]);
+  }
+
+  MixBuffers(s->buffer1, s->buffer2, s->buffer4, s->blend);
+  MixBuffers(s->buffer4, s->buffer3, s->layer, s->blend);
+}
+
+
+void RandomWhiteInit(effect_state *s)
+{
+  LOG(LOG_INFO, "Random White");
+
+  if(p_r1 || p_r2 || p_g1 || p_g2 || p_b1 || p_b2)
+  {
+    s->r1 = p_r1;
+    s->g1 = p_g1;
+    s->b1 = p_b1;
+  }
+  else
+  {
+    s->r1 = 255;
+    s->g1 = 255;
+    s->b1 = 255;
+  }
+
+  s->frame_delay = 20;
+}
+
+void RandomWhiteFrame(effect_state *s)
+{
+  FadeBuffer(s->layer, FADE_VAL);
+
+  int pwmnum = rand() % num_leds;
+
+  s->layer[pwmnum*3] = s->b1;
+  s->layer[pwmnum*3+1] = s->g1;
+  s->layer[pwmnum*3+2] = s->r1;
+}
+
+
+void RadialSweepInit(effect_state *s)
+{
+  s->direction = rand() % 2;
+
+  LOG(LOG_INFO, "Radial Sweep %s", s->direction ? "Right" : "Left");
+
+  PickColors(s);
+
+  s->phase = float(rand() % 360) * PI / 180;
+  s->speed = (s->direction ? 1 : -1) * 0.01;
+  s->width = PI / 2;
+  s->frame_delay = 20;
+}
+
+void RadialSweepFrame(effect_state *s)
+{
+  // a beam of color 1 turning round the middle of the room over a dim color 2
+  Fill(s->layer, 0, num_leds - 1, s->r2 / 4, s->g2 / 4, s->b2 / 4, s->r2 / 4, s->g2 / 4, s->b2 / 4);
+  SpatialSinFade(s->layer, 1, led_angle, s->phase, s->width, 2 * PI, 0,0,0, s->r1,s->g1,s->b1);
+
+  s->phase = s->phase + s->speed;
+}
+
+void PlaneWaveInit(effect_state *s)
+{
+  LOG(LOG_INFO, "Plane Wave");
+
+  PickColors(s);
+
+  // bands across the room in a random direction, 1 to 3 m apart
+  float angle = float(rand() % 360) * PI / 180;
+  SpatialProject(s->field, cosf(angle), sinf(angle));
+  s->width = 100 + rand() % 200;
+  s->speed = 0.002 + float(rand() % 100) / 20000;
+  s->frame_delay = 20;
+}
+
+void PlaneWaveFrame(effect_state *s)
+{
+  SpatialWave(s->layer, s->field, s->width, s->phase, s->r1,s->g1,s->b1, s->r2,s->g2,s->b2);
+
+  s->phase = s->phase + s->speed;
+}
+
+void DoorWaveInit(effect_state *s)
+{
+  LOG(LOG_INFO, "Door Wave");
+
+  PickColors(s);
+
+  // pulses start at the door and spread round the room
+  SpatialDistance(s->field, door_x, door_y);
+  s->width = 60;
+  s->speed = 1.5;
+  s->phase = 0;
+  s->frame_delay = 20;
+}
+
+void DoorWaveFrame(effect_state *s)
+{
+  FadeBuffer(s->layer, FADE_VAL);
+  SpatialSinFade(s->layer, 1, s->field, s->phase, s->width, 0, 0,0,0, s->r1,s->g1,s->b1);
+
+  s->phase = s->phase + s->speed;
+  if(s->phase > 2 * layout_radius + s->width)
+  {
+    // next pulse in the other color
+    s->phase = 0;
+    std::swap(s->r1, s->r2);
+    std::swap(s->g1, s->g2);
+    std::swap(s->b1, s->b2);
+  }
+}
+
+
+void FireworksInit(effect_state *s)
+{
+  LOG(LOG_INFO, "Fireworks");
+
+  PickColors(s);
+  s->r3 = RandomColor(128);
+  s->g3 = RandomColor(128);
+  s->b3 = RandomColor(128);
+
+  // sparks slow down as they spread, group 1 is the rockets
+  ParticleClear(&s->particles, 1, 0.96);
+  s->frame_delay = 20;
+}
+
+void FireworksFrame(effect_state *s)
+{
+  particle_system *ps = &s->particles;
+
+  // rockets on their last frame burst into a few hundred sparks
+  int count = ps->count;
+  for(int i = 0; i < count; i++)
+  {
+    if(ps->group[i] != 1 || ps->life[i] > 1)
+    {
+      continue;
+    }
+
+    int sparks = rand() % 400 + 200;
+    int color = rand() % 3;
+    uint8_t r = (color == 0) ? s->r1 : (color == 1) ? s->r2 : s->r3;
+    uint8_t g = (color == 0) ? s->g1 : (color == 1) ? s->g2 : s->g3;
+    uint8_t b = (color == 0) ? s->b1 : (color == 1) ? s->b2 : s->b3;
+
+    for(int j = 0; j < sparks; j++)
+    {
+      int p = ParticleSpawn(ps, ps->pos[i], float((rand() % 400) - 200) / 100, 1.5, rand() % 60 + 40, r, g, b);
+      if(p < 0)
+      {
+        break;
       }
+      ps->fade[p] = 0.97;
+    }
+  }
 
-      if(strcmp(reinterpret_cast<const char *>(event.data.scalar.value), "Events") == 0)
+  // launch a rocket every second or so
+  if(rand() % 50 == 0)
+  {
+    int p = ParticleSpawn(ps, rand() % num_leds, float((rand() % 200) - 100) / 50, 1, rand() % 40 + 30, 255, 255, 255);
+    if(p >= 0)
+    {
+      ps->group[p] = 1;
+      ps->bright[p] = 0.5;
+    }
+  }
+
+  ParticleUpdate(ps);
+  ParticleRender(ps, -1, PARTICLE_ADD, 1, 1);
+  ParticleResolve(ps, s->layer);
+}
+
+void RainInit(effect_state *s)
+{
+  LOG(LOG_INFO, "Rain");
+
+  PickColors(s);
+
+  // drops land, spread out and fade
+  ParticleClear(&s->particles, 1, 1);
+  s->frame_delay = 20;
+}
+
+void RainFrame(effect_state *s)
+{
+  particle_system *ps = &s->particles;
+
+  int drops = rand() % 4;
+  for(int i = 0; i < drops; i++)
+  {
+    float mix = float(rand() % 256) / 255;
+    int p = ParticleSpawn(ps, float(rand() % (num_leds * 16)) / 16, 0, 1, 200,
+                          s->r1 + (s->r2 - s->r1) * mix, s->g1 + (s->g2 - s->g1) * mix, s->b1 + (s->b2 - s->b1) * mix);
+    if(p < 0)
+    {
+      break;
+    }
+    ps->growth[p] = 0.25;
+    ps->fade[p] = 0.95;
+  }
+
+  ParticleUpdate(ps);
+  ParticleRender(ps, -1, PARTICLE_ADD, 1, 1);
+  ParticleResolve(ps, s->layer);
+}
+
+void CometsInit(effect_state *s)
+{
+  LOG(LOG_INFO, "Comets");
+
+  PickColors(s);
+
+  // heads are group 1 and leave a fading tail particle behind every frame
+  particle_system *ps = &s->particles;
+  ParticleClear(ps, 1, 1);
+
+  int comets = rand() % 4 + 3;
+  for(int i = 0; i < comets; i++)
+  {
+    float speed = float(rand() % 200 + 50) / 100;
+    int color = rand() % 2;
+    int p = ParticleSpawn(ps, rand() % num_leds, (rand() % 2) ? speed : -speed, 3, PARTICLE_FOREVER,
+                          color ? s->r1 : s->r2, color ? s->g1 : s->g2, color ? s->b1 : s->b2);
+    ps->group[p] = 1;
+  }
+
+  s->frame_delay = 20;
+}
+
+void CometsFrame(effect_state *s)
+{
+  particle_system *ps = &s->particles;
+
+  int count = ps->count;
+  for(int i = 0; i < count; i++)
+  {
+    if(ps->group[i] != 1)
+    {
+      continue;
+    }
+
+    int p = ParticleSpawn(ps, ps->pos[i], ps->vel[i] * 0.05f, 2, 120, ps->r[i], ps->g[i], ps->b[i]);
+    if(p >= 0)
+    {
+      ps->bright[p] = 0.6;
+      ps->fade[p] = 0.92;
+    }
+  }
+
+  ParticleUpdate(ps);
+  ParticleRender(ps, 0, PARTICLE_ADD, 1, 1);
+  ParticleRender(ps, 1, PARTICLE_MAX, 1, 1);
+  ParticleResolve(ps, s->layer);
+}
+
+
+void ShaderInit(effect_state *s)
+{
+  PickColors(s);
+
+  s->shader = shaders.empty() ? NULL : &shaders[rand() % shaders.size()];
+  s->phase = 0;
+  s->frame_delay = 20;
+  s->frame_time = EffectTime();
+
+  LOG(LOG_INFO, "Shader %s", s->shader ? s->shader->name : "(none)");
+}
+
+void ShaderFrame(effect_state *s)
+{
+  if(!s->shader)
+  {
+    Fill(s->layer, 0, num_leds - 1, 0,0,0, 0,0,0);
+    return;
+  }
+
+  // t is seconds of effect time, so it runs the same in the simulator
+  ShaderRender(s, s->shader, s->phase, s->layer);
+
+  uint64_t now = EffectTime();
+  s->phase = s->phase + (now - s->frame_time) / 1e6f;
+  s->frame_time = now;
+}
+
+void PaletteInit(effect_state *s)
+{
+  // someone's own colors if they badged in, otherwise any palette
+  if(p_r1 || p_r2 || p_g1 || p_g2 || p_b1 || p_b2)
+  {
+    s->pal = &personal_palette;
+  }
+  else
+  {
+    s->pal = &palettes[rand() % palettes.size()];
+  }
+
+  s->pal_phase = uint32_t(rand()) << 8;
+  s->pal_step = PaletteStep(1 + rand() % 3);
+  // a whole palette takes 10 to 40 seconds to go past, however fast the
+  // frames come
+  s->frame_delay = 20;
+  s->frame_time = EffectTime();
+  s->pal_speed = uint32_t((uint64_t(1) << 32) / (10 + rand() % 30));
+  if(rand() % 2)
+  {
+    s->pal_speed = -s->pal_speed;
+  }
+
+  LOG(LOG_INFO, "Palette %s", s->pal->name);
+}
+
+void PaletteFrame(effect_state *s)
+{
+  PaletteFill(s->layer, s->pal, s->pal_phase, s->pal_step);
+
+  uint64_t now = EffectTime();
+  s->pal_phase += uint32_t(int64_t(int32_t(s->pal_speed)) * int64_t(now - s->frame_time) / 1000000);
+  s->frame_time = now;
+}
+
+void PlaybackInit(effect_state *s)
+{
+  // carries on from where the media thread is if it's the same file
+  if(media_path[0])
+  {
+    MediaStart(media_path);
+  }
+  s->frame_delay = 1000000 / MEDIA_FPS;
+
+  LOG(LOG_INFO, "Playback %s", media_path[0] ? media_path : "(no media)");
+}
+
+void PlaybackFrame(effect_state *s)
+{
+  // each frame stays up as long as it asks, the last one again if the
+  // next isn't decoded yet. with no media it stays black.
+  if(!media_path[0])
+  {
+    return;
+  }
+  int delay = MediaPop(s->layer);
+  if(delay < 0)
+  {
+    media_underruns.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  s->frame_delay = std::max(delay, 10000);
+}
+
+
+// effect dispatch
+
+void EffectInit(effect_state *s, int effect)
+{
+  // start every effect from black with clean work buffers
+  memset(s, 0, sizeof(effect_state));
+  s->effect = effect;
+
+  switch(effect)
+  {
+    case 0:  OffInit(s); break;
+    /* non-customizable effects */
+    case 1:  RainbowInit(s); break;
+    case 2:  SparkleInit(s); break;
+    /* customizable effects */
+    case 3:  RandomWhiteInit(s); break;
+    case 4:  RandomTwoColorFadeInit(s); break;
+    case 5:  RandomTwoColorSparkleInit(s); break;
+    case 6:  RedAlertInit(s); break;
+    case 7:  RainbowSparklesInit(s); break;
+    case 8:  LavaLampInit(s); break;
+    case 9:  ColorOrganInit(s); break;
+    case 10: SlowSparkleInit(s); break;
+    case 11: SlowTwoColorSparkleInit(s); break;
+    /* spatial effects */
+    case 12: RadialSweepInit(s); break;
+    case 13: PlaneWaveInit(s); break;
+    case 14: DoorWaveInit(s); break;
+    /* particle effects */
+    case 15: FireworksInit(s); break;
+    case 16: RainInit(s); break;
+    case 17: CometsInit(s); break;
+    case 18: ShaderInit(s); break;
+    case 19: PaletteInit(s); break;
+    /* scheduled only */
+    case 20: PlaybackInit(s); break;
+  }
+}
+
+void EffectFrame(effect_state *s)
+{
+  switch(s->effect)
+  {
+    case 0:  OffFrame(s); break;
+    case 1:  RainbowFrame(s); break;
+    case 2:  SparkleFrame(s); break;
+    case 3:  RandomWhiteFrame(s); break;
+    case 4:  RandomTwoColorFadeFrame(s); break;
+    case 5:  RandomTwoColorSparkleFrame(s); break;
+    case 6:  RedAlertFrame(s); break;
+    case 7:  RainbowSparklesFrame(s); break;
+    case 8:  LavaLampFrame(s); break;
+    case 9:  ColorOrganFrame(s); break;
+    case 10: SlowSparkleFrame(s); break;
+    case 11: SlowTwoColorSparkleFrame(s); break;
+    case 12: RadialSweepFrame(s); break;
+    case 13: PlaneWaveFrame(s); break;
+    case 14: DoorWaveFrame(s); break;
+    case 15: FireworksFrame(s); break;
+    case 16: RainFrame(s); break;
+    case 17: CometsFrame(s); break;
+    case 18: ShaderFrame(s); break;
+    case 19: PaletteFrame(s); break;
+    case 20: PlaybackFrame(s); break;
+  }
+}
+
+void FadeOut(void) {
+  // fade out, a sixteenth of the light that was showing each frame
+  for (uint8_t loops=0; loops < 16; loops++)
+  {
+    for(int i = 0; i < num_leds * 3; i++)
+    {
+      display_light[i] = (display_light[i] * (15 - loops)) / (16 - loops);
+    }
+    DisplayLight(display_light);
+    Sleep(20);
+  }
+  memset(display_buffer, 0, num_leds * 3);
+}
+
+void RunEffect(int effect, long num_seconds, int transition_frames)
+{
+  /*
+    Runs an effect for num_seconds. For the first transition_frames frames the
+    effect that was on the wall keeps rendering into its own layer and the two
+    are blended, so effects change without going through black. A signal
+    stops it at the end of the frame being rendered.
+  */
+  effect_state *outgoing = current_state;
+  effect_state *incoming = (current_state == &effect_states[0]) ? &effect_states[1] : &effect_states[0];
+  uint8_t transition = 1 + (rand() % TRANSITIONS);
+
+  EffectInit(incoming, effect);
+  current_state = incoming;
+  effect_runs[effect].fetch_add(1, std::memory_order_relaxed);
+
+  time_t until = Now() + num_seconds;
+  uint64_t budget = 1000000 / TARGET_FPS;
+  uint64_t frame_start, render_done, composite_done, last_frame_start = 0;
+
+  in_frame = 1;
+  for(long frame = 0; frame < transition_frames || Now() < until; frame++)
+  {
+    frame_start = MicroTime();
+    if(last_frame_start)
+    {
+      HistogramObserve(&frame_interval, frame_start - last_frame_start);
+      if((frame_start - last_frame_start) > (budget * 2))
       {
-        in_events = 1;
-        // puts("Found Events");
+        dropped_frames.fetch_add(1, std::memory_order_relaxed);
       }
+    }
+    last_frame_start = frame_start;
+
+    TRACE_BEGIN("render");
+    EffectFrame(incoming);
+    if(frame < transition_frames)
+    {
+      EffectFrame(outgoing);
+    }
+    TRACE_END("render");
+    render_done = MicroTime();
+    HistogramObserve(&render_time, render_done - frame_start);
+
+    // crossfades are mixed as 16 bit light, unless a trigger probe is
+    // looking for the 8 bit colors
+    uint8_t light = (frame < transition_frames) && transition == CROSSFADE && !trigger_probe.armed.load(std::memory_order_relaxed);
+
+    TRACE_BEGIN("composite");
+    if(light)
+    {
+      CrossfadeLight(outgoing->layer, incoming->layer, display_light, ((frame + 1) * 256) / transition_frames);
+    }
+    else if(frame < transition_frames)
+    {
+      TransitionBuffers(outgoing->layer, incoming->layer, display_buffer, transition, ((frame + 1) * 256) / transition_frames);
+    }
+    else
+    {
+      memcpy(display_buffer, incoming->layer, num_leds * 3);
+    }
+    TRACE_END("composite");
+    composite_done = MicroTime();
+    HistogramObserve(&composite_time, composite_done - render_done);
+
+    if(light)
+    {
+      DisplayLight(display_light);
+    }
+    else
+    {
+      DisplayBuffer(display_buffer);
+    }
+    HistogramObserve(&transmit_time, MicroTime() - composite_done);
+
+    TRACE_BEGIN("sleep");
+    uint64_t sleep_start = MicroTime();
+    Sleep(incoming->frame_delay);
+    uint64_t woke = MicroTime();
+    HistogramObserve(&frame_jitter, woke - std::min(woke, sleep_start + incoming->frame_delay));
+    TRACE_END("sleep");
+    if(signaled)
+    {
       break;
     }
-    if(event.type != YAML_STREAM_END_EVENT)
-      yaml_event_delete(&event);
-  } while(event.type != YAML_STREAM_END_EVENT);
-  yaml_event_delete(&event);
-  /* END new code */
+  }
+  in_frame = 0;
+}
+
+void SetOutputIdle(uint8_t idle)
+{
+  pthread_mutex_lock(&metrics_mutex);
+  output_idle = idle;
+  pthread_cond_signal(&metrics_cond);
+  pthread_mutex_unlock(&metrics_mutex);
+}
+
+void IdleOutput(void)
+{
+  /*
+    Called once the last black frame is out. Drops the LED supply and stops
+    sending frames until WakeOutput.
+  */
+  if(output_idle)
+  {
+    return;
+  }
+
+  digitalWrite(2, 0);
+  SetOutputIdle(1);
+}
+
+void WakeOutput(void)
+{
+  // bring the supply back up and give the strip a black frame to sync on
+  if(!output_idle)
+  {
+    return;
+  }
+
+  digitalWrite(2, 1);
+  Sleep(PSU_WARMUP);
+  memset(display_buffer, 0, num_leds * 3);
+  DisplayBuffer(display_buffer);
+  SetOutputIdle(0);
+}
+
+void Idle(void)
+{
+  /*
+    Blocks with no periodic wakeups until the schedule next changes, a signal
+    arrives, or something in the schedule directory is written.
+  */
+  time_t start = Now();
+  time_t wake = NextScheduleChange(start);
+  uint64_t wakeups = 0;
+  char s[100];
+
+  strftime(s, 100, "%c", localtime(&wake));
+  LOG(LOG_INFO, "idle until %s", s);
+
+#ifdef SIMULATOR
+  if(sim_fast)
+  {
+    // skip straight to the change
+    Sleep(uint64_t(wake - start) * 1000000);
+    return;
+  }
+#endif
+
+  // only let the signals in while we're inside ppoll so none are missed
+  sigset_t mask, orig_mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGUSR1);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGRTMIN);
+  sigprocmask(SIG_BLOCK, &mask, &orig_mask);
+
+  struct pollfd fds[1];
+  fds[0].fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  fds[0].events = POLLIN;
+  if(fds[0].fd >= 0)
+  {
+    inotify_add_watch(fds[0].fd, ".", IN_CLOSE_WRITE | IN_MOVED_TO);
+  }
+
+  while(!signaled && time(0) < wake)
+  {
+    struct timespec timeout = { wake - time(0), 0 };
+
+    int ready = ppoll(fds, (fds[0].fd >= 0) ? 1 : 0, &timeout, &orig_mask);
+    wakeups++;
+
+    if(ready > 0)
+    {
+      // schedule may have changed, go back and re-read it
+      break;
+    }
+  }
+
+  if(fds[0].fd >= 0)
+  {
+    close(fds[0].fd);
+  }
+  sigprocmask(SIG_SETMASK, &orig_mask, NULL);
+
+  time_t idle_for = time(0) - start;
+  idle_wakeups.fetch_add(wakeups, std::memory_order_relaxed);
+  idle_seconds.fetch_add(idle_for, std::memory_order_relaxed);
+
+  LOG(LOG_INFO, "idle for %ld s, %llu wakeups (%.1f/hour)", (long) idle_for, (unsigned long long) wakeups,
+      idle_for ? (wakeups * 3600.0 / idle_for) : 0.0);
+}
+
+
+// external frames
+
+void ShmInit(void)
+{
+  /*
+    Creates the shared memory frame ring. Any ring left by an earlier run is
+    unlinked first so a producer still mapping it can't confuse the new one.
+  */
+  shm_unlink(SHM_NAME);
 
-  /* Cleanup */
-  yaml_parser_delete(&parser);
-  fclose(fh);
+  int fd = shm_open(SHM_NAME, O_RDWR | O_CREAT | O_EXCL, 0660);
+  if(fd < 0)
+  {
+    LOG(LOG_ERROR, "Failed to create shared memory %s", SHM_NAME);
+    return;
+  }
 
-  return in_schedule;
+  if(ftruncate(fd, sizeof(shm_ring)) == 0)
+  {
+    void *mem = mmap(NULL, sizeof(shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(mem != MAP_FAILED)
+    {
+      frame_ring = new(mem) shm_ring();
+      frame_ring->num_leds = num_leds;
+      frame_ring->slots = SHM_SLOTS;
+      frame_ring->daemon_pid = getpid();
+      frame_ring->magic = SHM_MAGIC;
+    }
+  }
+  close(fd);
 }
 
+int32_t ShmProducer(void)
+{
+  // pid of a live attached producer, or 0
+  if(frame_ring == NULL)
+  {
+    return 0;
+  }
 
-uint8_t InSemaphor(void)
+  int32_t pid = frame_ring->producer_pid.load(std::memory_order_acquire);
+  if(pid && kill(pid, 0) != 0 && errno == ESRCH)
+  {
+    // died without detaching
+    frame_ring->producer_pid.compare_exchange_strong(pid, 0);
+    return 0;
+  }
+  return pid;
+}
+
+void RunExternal(void)
 {
   /*
-    Function reads in semaphor files to determine if we're being triggered to display
+    Sends frames from the attached producer straight out of shared memory
+    until it detaches or a signal comes in. Only the newest frame is shown if
+    several are waiting. When the producer goes away the last frame is left
+    in the current layer so the schedule transitions away from it.
   */
-  uint8_t in_semaphor = 0;
+  shm_ring *ring = frame_ring;
+  uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+  uint8_t have_frame = 0;
 
-  time_t now = time(0);
+  LOG(LOG_INFO, "External frames from pid %d", ring->producer_pid.load());
+  shm_attaches.fetch_add(1, std::memory_order_relaxed);
 
-  ifstream ifile("/var/www/html/bl_semaphor/outfile.txt");
-  if(ifile)
+  while(!signaled)
   {
-    puts("Found Semaphor file");
+    uint32_t bell = ring->doorbell.load(std::memory_order_acquire);
+    uint32_t head = ring->head.load(std::memory_order_acquire);
+    uint32_t next = have_frame ? (tail + 1) : tail;
 
-    uint8_t cnum = 0;
-    std::string line;
-    while(std::getline(ifile,line))
+    if(head == next)
     {
-      // read in colors
-      if(line.substr(0,1) == "#"
-         && line != "#000000"
-         && line.find_first_not_of("0123456789abcdefABCDEF",1) == std::string::npos
-         && line.length() == 7)
+      if(!ShmProducer())
       {
-        // valid color string
-        cnum++;
-
-        if(cnum == 1)
-        {
-          p_r1 = std::stoi(line.substr(1,2), 0, 16);
-          p_g1 = std::stoi(line.substr(3,2), 0, 16);
-          p_b1 = std::stoi(line.substr(5,2), 0, 16);
-        }
-        if(cnum == 2)
-        {
-          p_r2 = std::stoi(line.substr(1,2), 0, 16);
-          p_g2 = std::stoi(line.substr(3,2), 0, 16);
-          p_b2 = std::stoi(line.substr(5,2), 0, 16);
-        }
+        break;
       }
-    }
 
-    if(cnum == 1)
-    {
-      // only one color found, so set the second color 1/3 the value
-      p_r2 = p_r1 / 3;
-      p_g2 = p_g1 / 3;
-      p_b2 = p_b1 / 3;
+      // sleep on the doorbell, waking now and then to check the producer is alive
+      struct timespec timeout = { 1, 0 };
+      syscall(SYS_futex, &ring->doorbell, FUTEX_WAIT, bell, &timeout, NULL, 0);
+      continue;
     }
 
-    in_semaphor = 1;
+    shm_dropped.fetch_add(head - next - 1, std::memory_order_relaxed);
+
+    // keep the shown slot as tail so the producer can't overwrite it under us
+    tail = head - 1;
+    shm_frame *frame = &ring->frames[tail % SHM_SLOTS];
 
-    personal_effect_until = now + PERSONAL_EFFECT_TIME;
+    DisplayBuffer(frame->pixels);
+    HistogramObserve(&shm_latency, MicroTime() - frame->produced);
+    shm_frames.fetch_add(1, std::memory_order_relaxed);
 
+    ring->tail.store(tail, std::memory_order_release);
+    have_frame = 1;
   }
-  remove("/var/www/html/bl_semaphor/outfile.txt");
 
-  return(in_semaphor);
+  if(have_frame)
+  {
+    memcpy(display_buffer, ring->frames[tail % SHM_SLOTS].pixels, num_leds * 3);
+    memcpy(current_state->layer, display_buffer, num_leds * 3);
+    current_state->effect = 0;
+  }
+
+  // hand every slot back
+  ring->tail.store(ring->head.load(std::memory_order_acquire), std::memory_order_release);
 }
 
+void ShmDemo(void)
+{
+  /*
+    Test producer: attaches to a running daemon's ring and streams a moving
+    pattern at TARGET_FPS until interrupted.
+  */
+  int fd = shm_open(SHM_NAME, O_RDWR, 0);
+  if(fd < 0)
+  {
+    printf("no frame ring at %s, is blinkenlights running?\n", SHM_NAME);
+    return;
+  }
 
-// effect sub functions
+  shm_ring *ring = static_cast<shm_ring *>(mmap(NULL, sizeof(shm_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+  close(fd);
+  if(ring == MAP_FAILED || ring->magic != SHM_MAGIC || ring->num_leds > MAX_LEDS)
+  {
+    printf("frame ring doesn't match this build\n");
+    return;
+  }
 
-void FadeBuffer(uint8_t *buffer, uint8_t fade_val)
-{
-  for(int i = 0; i < NUM_LEDS * 3; i++)
+  int32_t none = 0;
+  if(!ring->producer_pid.compare_exchange_strong(none, getpid()))
   {
-    if(buffer[i] > fade_val)
+    printf("pid %d is already producing frames\n", none);
+    return;
+  }
+  kill(ring->daemon_pid, SIGRTMIN);
+
+  signal(SIGINT, signalHandler);
+
+  // draw for the daemon's layout
+  int leds = ring->num_leds;
+  uint64_t sent = 0, skipped = 0;
+  for(uint32_t t = 0; !signaled; t++)
+  {
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+
+    if(head - ring->tail.load(std::memory_order_acquire) < SHM_SLOTS)
     {
-      buffer[i] = buffer[i] - fade_val;
+      shm_frame *frame = &ring->frames[head % SHM_SLOTS];
+
+      for(int i = 0; i < leds; i++)
+      {
+        int d = abs(i - int(t % leds));
+        uint8_t val = (d < 32) ? (255 - d * 8) : 0;
+        frame->pixels[i*3] = val;
+        frame->pixels[i*3+1] = (i * 255) / leds;
+        frame->pixels[i*3+2] = 255 - val;
+      }
+      frame->produced = MicroTime();
+
+      ring->head.store(head + 1, std::memory_order_release);
+      ring->doorbell.fetch_add(1, std::memory_order_release);
+      syscall(SYS_futex, &ring->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0);
+      sent++;
     }
-    else if(buffer[i] > 0)
+    else
     {
-      buffer[i] = 0;
+      skipped++;
     }
+
+    usleep(1000000 / TARGET_FPS);
   }
+
+  ring->producer_pid.store(0, std::memory_order_release);
+  ring->doorbell.fetch_add(1, std::memory_order_release);
+  syscall(SYS_futex, &ring->doorbell, FUTEX_WAKE, 1, NULL, NULL, 0);
+
+  printf("sent %llu frames, %llu skipped with the ring full\n", (unsigned long long) sent, (unsigned long long) skipped);
 }
 
-void MixBuffers(uint8_t *buffer1, uint8_t *buffer2, uint8_t *mixed_buffer, uint8_t mix_effect)
+
+// benchmarks
+
+void BenchTransitions(void)
 {
-  if(mix_effect == REPLACE)
+  /*
+    Renders the transition between every pair of effects without touching the
+    SPI bus and reports how long the two effects plus the blend take per frame
+    against the frame budget of TARGET_FPS.
+  */
+  uint64_t budget = 1000000 / TARGET_FPS;
+  uint64_t worst = 0;
+
+  // keep the effect names out of the report
+  log_level = LOG_ERROR;
+
+  printf("transition render time, budget %llu us/frame (%d fps)\n", (unsigned long long) budget, TARGET_FPS);
+
+  for(int from = 1; from < EFFECTS; from++)
   {
-    for(int i = 0; i < NUM_LEDS; i++)
+    for(int to = 1; to < EFFECTS; to++)
     {
-      switch(mix_effect)
+      if(from == to)
       {
-      case REPLACE:
-        if(buffer2[i*3] || buffer2[i*3+1] || buffer2[i*3+2])
-        {
-          mixed_buffer[i*3] = buffer2[i*3];
-          mixed_buffer[i*3+1] = buffer2[i*3+1];
-          mixed_buffer[i*3+2] = buffer2[i*3+2];
-        }
-        else
-        {
-          mixed_buffer[i*3] = buffer1[i*3];
-          mixed_buffer[i*3+1] = buffer1[i*3+1];
-          mixed_buffer[i*3+2] = buffer1[i*3+2];
-        }
-        break;
+        continue;
       }
-    }
-  }
-  else
-  {
-    for(int i = 0; i < NUM_LEDS * 3; i++)
-    {
-      switch(mix_effect)
-      {
-      case HARD_MIX:
-        mixed_buffer[i] = std::min((buffer1[i] + buffer2[i]), 255);
 
-        break;
+      EffectInit(&effect_states[0], from);
+      EffectInit(&effect_states[1], to);
 
-      case SUBTRACT:
-        mixed_buffer[i] = std::max((buffer1[i] - buffer2[i]), 0);
+      // let the outgoing effect build up like it would have on the wall
+      for(int i = 0; i < TRANSITION_FRAMES; i++)
+      {
+        EffectFrame(&effect_states[0]);
+      }
 
-        break;
+      uint64_t total = 0;
+      uint64_t max_frame = 0;
 
-      case XOR:
-        mixed_buffer[i] = buffer1[i] ^ buffer2[i];
+      for(int frame = 0; frame < TRANSITION_FRAMES; frame++)
+      {
+        uint64_t start = MicroTime();
 
-        break;
-      case MAX:
-        mixed_buffer[i] = std::max(buffer1[i], buffer2[i]);
+        EffectFrame(&effect_states[1]);
+        EffectFrame(&effect_states[0]);
+        TransitionBuffers(effect_states[0].layer, effect_states[1].layer, display_buffer, 1 + (frame % TRANSITIONS), ((frame + 1) * 256) / TRANSITION_FRAMES);
 
-        break;
+        uint64_t elapsed = MicroTime() - start;
+        total += elapsed;
+        max_frame = std::max(max_frame, elapsed);
       }
+
+      worst = std::max(worst, max_frame);
+
+      printf("%-22s -> %-22s avg %6llu us  max %6llu us\n", effects[from].c_str(), effects[to].c_str(),
+             (unsigned long long) (total / TRANSITION_FRAMES), (unsigned long long) max_frame);
     }
   }
+
+  printf("worst frame %llu us of %llu us budget: %s\n", (unsigned long long) worst, (unsigned long long) budget,
+         (worst <= budget) ? "ok" : "OVER BUDGET");
 }
 
-void FadeToBuffer(uint8_t *buffer1, uint8_t *buffer2, uint8_t mix_percentage)
+uint64_t Percentile(vector<uint64_t> &samples, int percent)
 {
-  float diff = 0;
-
-  for(int i = 0; i < NUM_LEDS * 3; i++)
+  if(samples.empty())
   {
-    diff = ((float(buffer2[i]) - float(buffer1[i])) * (float (mix_percentage)/100));
-//    printf("%i %i %i\n", buffer1[i], buffer2[i], diff);
-    buffer1[i] = uint8_t(float(buffer1[i]) + diff);
+    return 0;
   }
+  std::sort(samples.begin(), samples.end());
+  return samples[((samples.size() - 1) * percent) / 100];
 }
 
-uint8_t RandomColor(uint8_t seed)
+void BenchAudio(const char *name)
 {
-  if((rand() % 255) < seed)
+  /*
+    Measures the FFT analysis cost per hop running through the input as fast
+    as it will go, then plays AUDIO_BENCH_SECONDS of it in real time under the
+    color organ to see how old the levels are by the time a frame renders
+    them. With no input given it uses the synthesized test sweep.
+  */
+  audio_source src;
+  float window[AUDIO_FFT_SIZE];
+  float bands[AUDIO_BANDS];
+  float level;
+  vector<uint64_t> costs;
+
+  log_level = LOG_ERROR;
+
+  if(!AudioOpen(name, &src))
   {
-    return rand() % 255;
+    printf("can't open audio input %s\n", name);
+    return;
   }
-  else
+  src.paced = 0;
+  FFTInit(src.rate);
+  memset(window, 0, sizeof(window));
+
+  for(int i = 0; i < (10 * src.rate) / AUDIO_HOP; i++)
   {
-    return 0;
+    memmove(window, window + AUDIO_HOP, (AUDIO_FFT_SIZE - AUDIO_HOP) * sizeof(float));
+    if(AudioReadSamples(&src, window + AUDIO_FFT_SIZE - AUDIO_HOP, AUDIO_HOP) < AUDIO_HOP)
+    {
+      break;
+    }
+
+    uint64_t start = MicroTime();
+    AudioAnalyse(window, bands, &level);
+    costs.push_back(MicroTime() - start);
   }
-}
 
-void Rotate(uint8_t *buffer, uint8_t direction)
-{
-  uint8_t r, g, b;
+  uint64_t hop_time = (uint64_t(AUDIO_HOP) * 1000000) / src.rate;
+  uint64_t total = 0;
+  for(size_t i = 0; i < costs.size(); i++)
+  {
+    total += costs[i];
+  }
 
-  if(direction)
+  printf("analysis: %zu hops of %d samples at %d Hz\n", costs.size(), AUDIO_HOP, src.rate);
+  printf("  p50 %llu us  p99 %llu us per %llu us hop, %.2f%% of one core\n",
+         (unsigned long long) Percentile(costs, 50), (unsigned long long) Percentile(costs, 99),
+         (unsigned long long) hop_time, costs.empty() ? 0.0 : (100.0 * total) / (costs.size() * hop_time));
+
+  if(src.type == AUDIO_STDIN)
   {
-    b = buffer[0];
-    g = buffer[1];
-    r = buffer[2];
-    for(int i = 0; i < (NUM_LEDS - 1); i++)
+    return;
+  }
+
+  // real time playback under the color organ
+  static audio_source live;
+  if(!AudioOpen(name, &live))
+  {
+    return;
+  }
+  live.paced = 1;
+  std::thread(AudioThread, &live).detach();
+  while(!audio_running)
+  {
+    usleep(1000);
+  }
+
+  // effect 9 is ColorOrgan
+  EffectInit(&effect_states[0], 9);
+
+  vector<uint64_t> ages;
+  audio_snapshot snap;
+  uint32_t last_seq = 0;
+  uint64_t until = MicroTime() + uint64_t(AUDIO_BENCH_SECONDS) * 1000000;
+
+  while(MicroTime() < until && audio_running)
+  {
+    EffectFrame(&effect_states[0]);
+
+    if(AudioRead(&snap) && snap.seq != last_seq)
     {
-      buffer[i*3]   = buffer[(i+1)*3];
-      buffer[i*3+1] = buffer[(i+1)*3+1];
-      buffer[i*3+2] = buffer[(i+1)*3+2];
+      ages.push_back(MicroTime() - snap.captured);
+      last_seq = snap.seq;
     }
-    buffer[(NUM_LEDS-1)*3]   = b;
-    buffer[(NUM_LEDS-1)*3+1] = g;
-    buffer[(NUM_LEDS-1)*3+2] = r;
+    usleep(1000000 / TARGET_FPS);
   }
-  else
+
+  printf("audio to frame: p50 %llu us  p99 %llu us at %d fps, plus %llu us of window\n",
+         (unsigned long long) Percentile(ages, 50), (unsigned long long) Percentile(ages, 99), TARGET_FPS,
+         (unsigned long long) ((uint64_t(AUDIO_FFT_SIZE) * 1000000) / src.rate));
+}
+
+void HttpBenchClient(uint16_t port, uint64_t until, vector<uint64_t> *latencies)
+{
+  // one keep-alive connection posting swipes back to back
+  BlockSignals();
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sin_family = AF_INET;
+  sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sa.sin_port = htons(port);
+  if(connect(fd, (struct sockaddr *) &sa, sizeof(sa)) < 0)
+  {
+    close(fd);
+    return;
+  }
+  int one = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  char request[256];
+  char reply[512];
+  for(int n = 0; MicroTime() < until; n++)
   {
-    b = buffer[(NUM_LEDS-1)*3];
-    g = buffer[(NUM_LEDS-1)*3+1];
-    r = buffer[(NUM_LEDS-1)*3+2];
-    for(int i = (NUM_LEDS - 1); i > 0; i--)
+    char body[96];
+    int body_len = snprintf(body, sizeof(body), "user=bench%d&reader=1&color=%%23%06x%%2C%%23ff0000", n % 8, (n * 2654435761u) & 0xffffff);
+    int len = snprintf(request, sizeof(request),
+      "POST /badger_access.php HTTP/1.1\r\nHost: localhost\r\nContent-Type: application/x-www-form-urlencoded\r\nContent-Length: %d\r\n\r\n%s",
+      body_len, body);
+
+    uint64_t start = MicroTime();
+    if(send(fd, request, len, 0) != len)
     {
-      buffer[i*3]   = buffer[(i-1)*3];
-      buffer[i*3+1] = buffer[(i-1)*3+1];
-      buffer[i*3+2] = buffer[(i-1)*3+2];
+      break;
     }
-    buffer[0] = b;
-    buffer[1] = g;
-    buffer[2] = r;
+
+    // read until the whole reply body is in
+    size_t got = 0;
+    size_t want = sizeof(reply);
+    while(got < want)
+    {
+      ssize_t r = recv(fd, reply + got, sizeof(reply) - got, 0);
+      if(r <= 0)
+      {
+        close(fd);
+        return;
+      }
+      got += r;
+
+      char *headers_end = (char *) memmem(reply, got, "\r\n\r\n", 4);
+      const char *value = headers_end ? HeaderValue(reply, headers_end + 2, "Content-Length") : NULL;
+      if(value)
+      {
+        want = (headers_end + 4 - reply) + strtoul(value, NULL, 10);
+      }
+    }
+    latencies->push_back(MicroTime() - start);
   }
+  close(fd);
 }
 
-void Fill(uint8_t *buffer, int start_led, int end_led, float r1, float g1, float b1, float r2, float g2, float b2)
+void BenchHttp(int num_clients)
 {
-  float r, g, b, r_inc, g_inc, b_inc;
-  int steps;
-
-  steps = end_led - start_led;
+  /*
+    Posts badge swipes over loopback from num_clients keep-alive connections
+    for HTTP_BENCH_SECONDS while this thread stands in for the render loop,
+    rendering at TARGET_FPS and woken early by the SIGUSR1 each post sends.
+    Reports requests per second, response time and the time from a post
+    being parsed to the frame that picks it up.
+  */
+  log_level = LOG_ERROR;
+  signal(SIGUSR1, signalHandler);
 
-  if(steps)
+  int fd = HttpListen(INADDR_LOOPBACK, 0);
+  if(fd < 0)
   {
-    r_inc = (r2 - r1)/steps;
-    g_inc = (g2 - g1)/steps;
-    b_inc = (b2 - b1)/steps;
-
-    r = r1;
-    g = g1;
-    b = b1;
+    printf("can't listen on loopback\n");
+    return;
+  }
+  struct sockaddr_in sa;
+  socklen_t sa_len = sizeof(sa);
+  getsockname(fd, (struct sockaddr *) &sa, &sa_len);
+  std::thread(HttpThread, fd).detach();
+
+  uint64_t start = MicroTime();
+  uint64_t until = start + uint64_t(HTTP_BENCH_SECONDS) * 1000000;
+  vector<vector<uint64_t>> latencies(num_clients);
+  vector<std::thread> clients;
+  for(int i = 0; i < num_clients; i++)
+  {
+    clients.push_back(std::thread(HttpBenchClient, ntohs(sa.sin_port), until, &latencies[i]));
+  }
 
-    for(int i = start_led; i <= end_led; i++)
+  vector<uint64_t> first_frame;
+  trigger_request request;
+  while(MicroTime() < until)
+  {
+    uint64_t frame = MicroTime();
+    while(TriggerPop(&request))
     {
-      buffer[i*3] = b;
-      buffer[i*3+1] = g;
-      buffer[i*3+2] = r;
-      r = r + r_inc;
-      g = g + g_inc;
-      b = b + b_inc;
+      first_frame.push_back(frame - request.received);
     }
+    Sleep(1000000 / TARGET_FPS - std::min(MicroTime() - frame, uint64_t(1000000 / TARGET_FPS)));
   }
-  else
+
+  vector<uint64_t> responses;
+  for(int i = 0; i < num_clients; i++)
   {
-    // we can't divide by zero so just set the start LED to color 1
-    buffer[start_led*3] = b1;
-    buffer[start_led*3+1] = g1;
-    buffer[start_led*3+2] = r1;
+    clients[i].join();
+    responses.insert(responses.end(), latencies[i].begin(), latencies[i].end());
   }
+  double seconds = (MicroTime() - start) / 1000000.0;
+
+  printf("%d clients: %zu requests in %.1f s, %.0f requests/s\n", num_clients, responses.size(), seconds, responses.size() / seconds);
+  printf("  response p50 %llu us  p99 %llu us\n",
+         (unsigned long long) Percentile(responses, 50), (unsigned long long) Percentile(responses, 99));
+  printf("  trigger to first frame p50 %llu us  p99 %llu us at %d fps, %llu dropped with the queue full\n",
+         (unsigned long long) Percentile(first_frame, 50), (unsigned long long) Percentile(first_frame, 99), TARGET_FPS,
+         (unsigned long long) triggers_dropped.load());
 }
 
-void SinFade(uint8_t *buffer, uint8_t mode, int start_led, int size, float r1, float g1, float b1, float r2, float g2, float b2)
+void BenchTriggerInjector(vector<uint64_t> *latencies, int *missed, std::atomic<uint8_t> *done)
 {
-  // sine fade color 1 to color 2 to color 1
-  float r, g, b;
-  float result;
-  float adjval;
+  // swipes with fresh colors at random moments, waiting for each to show up
+  BlockSignals();
 
-  for(int i = 0; i <= size; i++)
+  for(int i = 0; i < TRIGGER_BENCH_SAMPLES; i++)
   {
-    adjval = (180/size)*i;
-    result = sin(adjval * PI / 180);
+    usleep(200000 + rand() % 300000);
+
+    trigger_request request;
+    memset(&request, 0, sizeof(trigger_request));
+    strcpy(request.user, "bench");
+    request.r1 = 1 + rand() % 255;
+    request.g1 = rand() % 256;
+    request.b1 = rand() % 256;
+    request.r2 = rand() % 256;
+    request.g2 = 1 + rand() % 255;
+    request.b2 = rand() % 256;
+    request.received = MicroTime();
+
+    trigger_probe.r1 = request.r1;
+    trigger_probe.g1 = request.g1;
+    trigger_probe.b1 = request.b1;
+    trigger_probe.r2 = request.r2;
+    trigger_probe.g2 = request.g2;
+    trigger_probe.b2 = request.b2;
+    trigger_probe.injected = request.received;
+    trigger_probe.armed.store(1, std::memory_order_release);
+
+    TriggerPush(&request);
+    kill(getpid(), SIGUSR1);
+
+    uint64_t timeout = request.received + 2000000;
+    while(trigger_probe.armed.load(std::memory_order_acquire) && MicroTime() < timeout)
+    {
+      usleep(500);
+    }
 
-    r = (r2 * result) + (r1 * (1-result));
-    g = (g2 * result) + (g1 * (1-result));
-    b = (b2 * result) + (b1 * (1-result));
-    int led_num = (start_led + i) % NUM_LEDS;
+    uint8_t armed = 1;
+    if(trigger_probe.armed.compare_exchange_strong(armed, 0))
+    {
+      (*missed)++;
+    }
+    else
+    {
+      latencies->push_back(trigger_probe.latency);
+    }
+  }
+
+  done->store(1);
+  kill(getpid(), SIGUSR1);
+}
+
+void BenchTrigger(void)
+{
+  /*
+    Swipes with random colors while the normal effect rotation runs and
+    times each one from being queued to the first frame holding either color
+    going out to the strip, once with a hard cut and once with the
+    --trigger-transition length. Frames take as long as the SPI transfer
+    would but nothing is sent.
+  */
+  log_level = LOG_ERROR;
+  bench_output = 1;
+  OutputInit();
+  signal(SIGUSR1, signalHandler);
+
+  int transitions[2] = { 0, trigger_transition };
+  for(int pass = 0; pass < 2; pass++)
+  {
+    trigger_transition = transitions[pass];
+
+    vector<uint64_t> latencies;
+    int missed = 0;
+    std::atomic<uint8_t> done(0);
+    std::thread injector(BenchTriggerInjector, &latencies, &missed, &done);
+
+    int current_effect = 0;
+    int next_effect = 0;
+    while(!done)
+    {
+      signaled = 0;
+      uint8_t swiped = TriggerCollect();
+      uint32_t effect_time = EFFECT_DELAY;
+
+      if(PersonalTurn(&current_effect, &next_effect, &effect_time, swiped))
+      {
+        RunEffect(current_effect, effect_time, swiped ? trigger_transition : TRANSITION_FRAMES);
+      }
+      else
+      {
+        RunEffect(1 + rand() % (RANDOM_EFFECTS - 1), EFFECT_DELAY, TRANSITION_FRAMES);
+      }
+    }
+    injector.join();
+    personal_waiting = 0;
+
+    printf("transition %2d frames: swipe to colors on the wire p50 %llu us  p99 %llu us, %d of %d never showed within 2 s\n",
+           trigger_transition, (unsigned long long) Percentile(latencies, 50), (unsigned long long) Percentile(latencies, 99),
+           missed, TRIGGER_BENCH_SAMPLES);
+  }
+}
+
+void BenchOutputs(void)
+{
+  /*
+    Pushes test frames through every output with transfers taking as long as
+    they would on the bus, checks each output's wire frame holds its segment
+    of the display buffer, to within one PWM step at its global brightness
+    (two with the dithering error added), and reports per output and whole
+    frame transmit times against sending every LED down one output.
+  */
+  const int frames = 600;
+  vector<uint64_t> frame_times;
+  vector<uint64_t> output_times[OUTPUTS];
+  uint64_t mismatches = 0;
 
-    if(mode)
+  log_level = LOG_ERROR;
+  bench_output = 1;
+  OutputInit();
+
+  for(int f = 0; f < frames; f++)
+  {
+    for(int i = 0; i < num_leds * 3; i++)
     {
-      buffer[led_num*3] = uint8_t (std::max(b, float(buffer[led_num*3])));
-      buffer[led_num*3+1] = uint8_t (std::max(g, float(buffer[led_num*3+1])));
-      buffer[led_num*3+2] = uint8_t (std::max(r, float(buffer[led_num*3+2])));
+      display_buffer[i] = (i * 7 + f * 13) & 0xff;
     }
-    else
+
+    uint64_t start = MicroTime();
+    DisplayBuffer(display_buffer);
+    frame_times.push_back(MicroTime() - start);
+
+    for(int o = 0; o < OUTPUTS; o++)
     {
-      buffer[led_num*3] = uint8_t (b);
-      buffer[led_num*3+1] = uint8_t (g);
-      buffer[led_num*3+2] = uint8_t (r);
+      output_state *out = &outputs[o];
+      output_times[o].push_back(out->transmit_time);
+
+      for(int i = 0; i < out->count; i++)
+      {
+        const uint8_t *led = &out->wire[4 + i*4];
+        const uint8_t *pixel = &display_buffer[(out->first + i) * 3];
+        int level = led[0] & 0b00011111;
+        int tolerance = (output_dither ? 2 : 1) * level * 65535 / (255 * LED_BRIGHTNESS) + 1;
+        uint8_t wrong = (led[0] & 0b11100000) != 0b11100000;
+        for(int c = 0; c < 3; c++)
+        {
+          int light = led[1 + c] * level * 65535 / (255 * LED_BRIGHTNESS);
+          wrong |= abs(light - output_lut[c][pixel[c]]) > tolerance;
+        }
+        mismatches += wrong;
+      }
     }
   }
-}
 
+  uint64_t serial = (uint64_t(WIRE_FRAME_SIZE) * 8 * 1000000) / SPI_SPEED;
+  for(int o = 0; o < OUTPUTS; o++)
+  {
+    printf("output %d %s LEDs %d-%d: transmit p50 %llu us  p99 %llu us\n", o, outputs[o].map->device,
+           outputs[o].first, outputs[o].first + outputs[o].count - 1,
+           (unsigned long long) Percentile(output_times[o], 50), (unsigned long long) Percentile(output_times[o], 99));
+  }
 
-// effect functions
+  uint64_t p50 = Percentile(frame_times, 50);
+  printf("frame p50 %llu us  p99 %llu us, %.0f fps max; one output would be %llu us, %.0f fps\n",
+         (unsigned long long) p50, (unsigned long long) Percentile(frame_times, 99), 1000000.0 / std::max(p50, uint64_t(1)),
+         (unsigned long long) serial, 1000000.0 / serial);
+  printf("segment contents: %llu of %d LEDs wrong\n", (unsigned long long) mismatches, frames * num_leds);
+}
 
-void FadeOut(void) {
-  // fade out
-  for (uint8_t loops=0; loops < 16; loops++)
+void BenchDither(void)
+{
+  /*
+    What the temporal dithering costs and buys: serialize time of a frame
+    with and without it against the TARGET_FPS budget, and how far the
+    light an LED averages over DITHER_BENCH_FRAMES frames is from what was
+    asked for at the dim end, where one PWM step is the biggest part of it
+  */
+  const int frames = 2000;
+  const uint64_t budget = 1000000 / TARGET_FPS;
+  output_state *o = &outputs[0];
+
+  log_level = LOG_ERROR;
+  bench_output = 1;
+  OutputInit();
+  bench_output = 0;
+  o->fd = -1;
+
+  srand(1);
+  for(int i = 0; i < num_leds * 3; i++)
   {
-    FadeBuffer(display_buffer, FAST_FADE_VAL);
-    DisplayBuffer(display_buffer);
-    usleep(20);
+    display_light[i] = rand() & 0xffff;
   }
-}
 
-void WaitUntil(long num_seconds) {
-  // fade out
-  time_t until = time(0) + num_seconds;
+  printf("serialize %d LEDs, frame budget %llu us\n", o->count, (unsigned long long) budget);
+  for(int dither = 0; dither < 2; dither++)
+  {
+    vector<uint64_t> times;
+    output_dither = dither;
+    for(int f = 0; f < frames; f++)
+    {
+      uint64_t start = MicroTime();
+      OutputFrame(o, display_light);
+      times.push_back(MicroTime() - start);
+    }
+    uint64_t p50 = Percentile(times, 50);
+    printf("  %-12s p50 %3llu us  p99 %3llu us, %.2f%% of the budget\n", dither ? "dithered" : "not dithered",
+           (unsigned long long) p50, (unsigned long long) Percentile(times, 99), p50 * 100.0 / budget);
+  }
 
-  while(time(0) < until)
+  // every LED a different dim level, from the first PWM step up
+  for(int i = 0; i < o->count * 3; i++)
   {
-    usleep(200);
-    if(signaled)
+    display_light[i] = 1 + (i * 7) % 2000;
+  }
+  for(int dither = 0; dither < 2; dither++)
+  {
+    vector<double> average(o->count * 3, 0);
+    output_dither = dither;
+    memset(o->dither, 0, sizeof(o->dither));
+    for(int f = 0; f < DITHER_BENCH_FRAMES; f++)
     {
-      break;
+      OutputFrame(o, display_light);
+      for(int i = 0; i < o->count; i++)
+      {
+        int level = o->wire[4 + i*4] & 0b00011111;
+        for(int c = 0; c < 3; c++)
+        {
+          average[i*3+c] += o->wire[5 + i*4 + c] * level * 65535.0 / (255 * LED_BRIGHTNESS) / DITHER_BENCH_FRAMES;
+        }
+      }
+    }
+    double error = 0, worst = 0;
+    for(int i = 0; i < o->count * 3; i++)
+    {
+      double e = fabs(average[i] - display_light[i]) / display_light[i];
+      error += e / (o->count * 3);
+      worst = std::max(worst, e);
     }
+    printf("  %-12s light 1-2000 of 65535 averaged over %d frames: mean error %.2f%%, worst %.1f%%\n",
+           dither ? "dithered" : "not dithered", DITHER_BENCH_FRAMES, error * 100, worst * 100);
   }
 }
 
-void Sparkle(long num_seconds)
+void BenchPower(void)
 {
-  uint8_t red_val = 0;
-  uint8_t green_val = 0;
-  uint8_t blue_val = 0;
-
-  cout << "Random Sparkle\n";
+  /*
+    Runs every effect for POWER_BENCH_FRAMES frames through the transfer
+    tables and the power limit, and reports the peak current it would have
+    drawn, how much of the time and how hard it was dimmed, and what the
+    estimate and limit cost per frame
+  */
+  effect_state *s = &effect_states[0];
+  vector<uint64_t> times;
 
-  time_t until = time(0) + num_seconds;
+  log_level = LOG_ERROR;
+  OutputLutInit();
 
-  while(time(0) < until)
+  printf("%d LEDs, budget %.1f A (%.1f mA idle, %.1f mA per channel at full)\n", num_leds, power_budget, LED_IDLE_MA, LED_CHANNEL_MA);
+  printf("%-28s  peak A  limited  max cut\n", "");
+  for(int effect = 1; effect < EFFECTS; effect++)
   {
-    int pwmnum = rand() % NUM_LEDS;
-    red_val = RandomColor(128);
-    green_val = RandomColor(128);
-    blue_val = RandomColor(128);
-
-    display_buffer[pwmnum*3] = blue_val;
-    display_buffer[pwmnum*3+1] = green_val;
-    display_buffer[pwmnum*3+2] = red_val;
+    float peak = 0, deepest = 1;
+    int limited = 0;
 
-    DisplayBuffer(display_buffer);
-    FadeBuffer(display_buffer, FADE_VAL);
-    usleep(20);
-    if(signaled)
+    srand(1);
+    EffectInit(s, effect);
+    power_gain = 1;
+    for(int frame = 0; frame < POWER_BENCH_FRAMES; frame++)
     {
-      break;
+      EffectFrame(s);
+      LightBuffer(s->layer, display_light);
+
+      uint64_t start = MicroTime();
+      PowerLimit(display_light);
+      times.push_back(MicroTime() - start);
+
+      // what it would have drawn without the limit
+      peak = std::max(peak, power_amps);
+      limited += power_gain < 1;
+      deepest = std::min(deepest, power_gain);
     }
+    printf("%-28s  %6.1f  %6.1f%%  %6.0f%%\n", effects[effect].c_str(), peak, limited * 100.0 / POWER_BENCH_FRAMES, (1 - deepest) * 100);
   }
+
+  printf("estimate and limit p50 %llu us  p99 %llu us per frame\n",
+         (unsigned long long) Percentile(times, 50), (unsigned long long) Percentile(times, 99));
 }
 
-void SlowSparkle(long num_seconds)
+void BenchEffect(int effect, int frames)
 {
-  uint8_t red_val = 0;
-  uint8_t green_val = 0;
-  uint8_t blue_val = 0;
+  // render time per frame of one effect against the TARGET_FPS budget
+  uint64_t budget = 1000000 / TARGET_FPS;
+  vector<uint64_t> times;
+
+  EffectInit(&effect_states[0], effect);
+
+  for(int frame = 0; frame < frames; frame++)
+  {
+    uint64_t start = MicroTime();
+    EffectFrame(&effect_states[0]);
+    times.push_back(MicroTime() - start);
+  }
+
+  uint64_t p99 = Percentile(times, 99);
+  printf("%-12s p50 %4llu us  p99 %4llu us  %s\n", effects[effect].c_str(),
+         (unsigned long long) Percentile(times, 50), (unsigned long long) p99, (p99 <= budget) ? "ok" : "OVER BUDGET");
+}
 
-  cout << "Slow Sparkle\n";
+void BenchSpatial(void)
+{
+  /*
+    Renders each spatial effect for a few seconds worth of frames and
+    reports the render time per frame against the TARGET_FPS budget
+  */
+  log_level = LOG_ERROR;
 
-  time_t until = time(0) + num_seconds;
+  printf("spatial effects on %d LEDs, budget %d us/frame (%d fps)\n", num_leds, 1000000 / TARGET_FPS, TARGET_FPS);
 
-  while(time(0) < until)
+  for(int effect = 12; effect <= 14; effect++)
   {
-    int pwmnum = rand() % NUM_LEDS;
-    red_val = RandomColor(128);
-    green_val = RandomColor(128);
-    blue_val = RandomColor(128);
+    BenchEffect(effect, 1000);
+  }
+}
 
-    buffer2[pwmnum*3] = blue_val;
-    buffer2[pwmnum*3+1] = green_val;
-    buffer2[pwmnum*3+2] = red_val;
+void BenchParticles(void)
+{
+  /*
+    Times update, render and resolve of a particle system from a few
+    hundred up to MAX_PARTICLES sparks, then the particle effects
+  */
+  const int frames = 500;
+  particle_system *ps = &effect_states[0].particles;
 
-    pwmnum = rand() % NUM_LEDS;
+  log_level = LOG_ERROR;
 
-    buffer2[pwmnum*3] = 0;
-    buffer2[pwmnum*3+1] = 0;
-    buffer2[pwmnum*3+2] = 0;
+  printf("particles on %d LEDs, budget %d us/frame (%d fps)\n", num_leds, 1000000 / TARGET_FPS, TARGET_FPS);
 
-    pwmnum = rand() % NUM_LEDS;
+  for(int particles = 256; particles <= MAX_PARTICLES; particles *= 4)
+  {
+    vector<uint64_t> times;
 
-    buffer2[pwmnum*3] = 0;
-    buffer2[pwmnum*3+1] = 0;
-    buffer2[pwmnum*3+2] = 0;
+    ParticleClear(ps, 1, 1);
+    for(int i = 0; i < particles; i++)
+    {
+      ParticleSpawn(ps, rand() % num_leds, float((rand() % 400) - 200) / 100, 1.5 + rand() % 3, PARTICLE_FOREVER,
+                    RandomColor(128), RandomColor(128), RandomColor(128));
+    }
 
-    DisplayBuffer(display_buffer);
-    FadeToBuffer(display_buffer, buffer2, 1);
-    usleep(20);
-    if(signaled)
+    for(int frame = 0; frame < frames; frame++)
     {
-      break;
+      uint64_t start = MicroTime();
+      ParticleUpdate(ps);
+      ParticleRender(ps, -1, PARTICLE_ADD, 1, 1);
+      ParticleResolve(ps, effect_states[0].layer);
+      times.push_back(MicroTime() - start);
     }
-  }
-}
 
-void RandomTwoColorSparkle(long num_seconds)
-{
-  uint8_t r1, g1, b1, r2, g2, b2;
+    printf("%4d particles  p50 %4llu us  p99 %4llu us\n", particles,
+           (unsigned long long) Percentile(times, 50), (unsigned long long) Percentile(times, 99));
+  }
 
-  if(p_r1 || p_r2 || p_g1 || p_g2 || p_b1 || p_b2)
+  for(int effect = 8; effect <= 9; effect++)
   {
-    r1 = p_r1;
-    g1 = p_g1;
-    b1 = p_b1;
-    b2 = p_b2;
-    g2 = p_g2;
-    r2 = p_r2;
+    BenchEffect(effect, frames);
   }
-  else
+  for(int effect = 15; effect <= 17; effect++)
   {
-    r1 = RandomColor(128);
-    g1 = RandomColor(128);
-    b1 = RandomColor(128);
-    b2 = RandomColor(128);
-    g2 = RandomColor(128);
-    r2 = RandomColor(128);
+    BenchEffect(effect, 2000);
   }
+}
+
+void BenchShader(void)
+{
+  /*
+    Rainbow three ways: the native effect (a rotate per frame), the same
+    hue wheel worked out per LED in C++, and the Rainbow shader, to see
+    what the interpreter costs
+  */
+  const int frames = 2000;
+  effect_state *s = &effect_states[0];
+  shader_program rainbow;
+  vector<uint64_t> native, direct, shaded;
 
-  cout << "Random Two Color Sparkle\n";
+  log_level = LOG_ERROR;
 
-  time_t until = time(0) + num_seconds;
+  ShaderCompile(&rainbow, "Rainbow", default_shaders[0][1]);
+  printf("rainbow on %d LEDs, budget %d us/frame (%d fps), %d per frame and %d per LED shader ops\n", num_leds,
+         1000000 / TARGET_FPS, TARGET_FPS, rainbow.uniform_len, rainbow.varying_len);
 
-  while(time(0) < until)
+  EffectInit(s, 1);
+  for(int frame = 0; frame < frames; frame++)
   {
-    int pwmnum = rand() % NUM_LEDS;
+    uint64_t start = MicroTime();
+    EffectFrame(s);
+    native.push_back(MicroTime() - start);
+  }
 
-    if(rand() % 255 > 128)
-    {
-      display_buffer[pwmnum*3] = b1;
-      display_buffer[pwmnum*3+1] = g1;
-      display_buffer[pwmnum*3+2] = r1;
-    }
-    else
+  for(int frame = 0; frame < frames; frame++)
+  {
+    uint64_t start = MicroTime();
+    float t = frame * 0.1f;
+    for(int i = 0; i < num_leds; i++)
     {
-      display_buffer[pwmnum*3] = b2;
-      display_buffer[pwmnum*3+1] = g2;
-      display_buffer[pwmnum*3+2] = r2;
+      float h = float(i) / num_leds - t * 10 / num_leds;
+      h = h - floorf(h);
+      s->buffer1[i*3] = uint8_t(255 * std::min(std::max(2 - fabsf(h * 6 - 4), 0.0f), 1.0f));
+      s->buffer1[i*3+1] = uint8_t(255 * std::min(std::max(2 - fabsf(h * 6 - 2), 0.0f), 1.0f));
+      s->buffer1[i*3+2] = uint8_t(255 * std::min(std::max(fabsf(h * 6 - 3) - 1, 0.0f), 1.0f));
     }
+    direct.push_back(MicroTime() - start);
+  }
 
-    DisplayBuffer(display_buffer);
-    FadeBuffer(display_buffer, FADE_VAL);
-    usleep(20);
-    if(signaled)
+  for(int frame = 0; frame < frames; frame++)
+  {
+    uint64_t start = MicroTime();
+    ShaderRender(s, &rainbow, frame * 0.1f, s->layer);
+    shaded.push_back(MicroTime() - start);
+  }
+
+  // the shader should come out the same as the C++ version
+  uint64_t mismatches = 0;
+  for(int i = 0; i < num_leds * 3; i++)
+  {
+    mismatches += (abs(s->layer[i] - s->buffer1[i]) > 1);
+  }
+
+  printf("native    p50 %4llu us  p99 %4llu us\n", (unsigned long long) Percentile(native, 50), (unsigned long long) Percentile(native, 99));
+  printf("per LED   p50 %4llu us  p99 %4llu us\n", (unsigned long long) Percentile(direct, 50), (unsigned long long) Percentile(direct, 99));
+  printf("shader    p50 %4llu us  p99 %4llu us  %llu of %d values off\n", (unsigned long long) Percentile(shaded, 50),
+         (unsigned long long) Percentile(shaded, 99), (unsigned long long) mismatches, num_leds * 3);
+
+  for(unsigned int j = 0; j < shaders.size(); j++)
+  {
+    vector<uint64_t> times;
+    for(int frame = 0; frame < frames; frame++)
     {
-      break;
+      uint64_t start = MicroTime();
+      ShaderRender(s, &shaders[j], frame * 0.02f, s->layer);
+      times.push_back(MicroTime() - start);
     }
+    printf("%-20s p50 %4llu us  p99 %4llu us\n", shaders[j].name, (unsigned long long) Percentile(times, 50), (unsigned long long) Percentile(times, 99));
   }
 }
 
-void SlowTwoColorSparkle(long num_seconds)
+void BenchPalette(void)
 {
-  uint8_t r1, g1, b1, r2, g2, b2;
+  /*
+    Drawing the rainbow the old way, six Fill() ramps, against one palette
+    lookup per LED, then how long building each palette takes and the
+    Palette effect itself
+  */
+  effect_state *s = &effect_states[0];
+  const palette *rainbow = FindPalette("Rainbow");
+  uint64_t filled = 0, looked_up = 0;
+  float inc = num_leds / 6;
 
-  if(p_r1 || p_r2 || p_g1 || p_g2 || p_b1 || p_b2)
+  log_level = LOG_ERROR;
+
+  for(int frame = 0; frame < PALETTE_BENCH_FRAMES; frame++)
   {
-    r1 = p_r1;
-    g1 = p_g1;
-    b1 = p_b1;
-    b2 = p_b2;
-    g2 = p_g2;
-    r2 = p_r2;
+    uint64_t start = MicroTime();
+    Fill(s->buffer1, 0,        int(inc),     255,0,  0,    255,255,0);
+    Fill(s->buffer1, int(inc), int(inc*2),   255,255,0,    0,  255,0);
+    Fill(s->buffer1, int(inc*2), int(inc*3), 0,  255,0,    0,  255,255);
+    Fill(s->buffer1, int(inc*3), int(inc*4), 0,  255,255,  0,  0,  255);
+    Fill(s->buffer1, int(inc*4), int(inc*5), 0,  0,  255,  255,0,  255);
+    Fill(s->buffer1, int(inc*5), (num_leds-1), 255,0,  255,  255,0,  0);
+    filled += MicroTime() - start;
+
+    start = MicroTime();
+    PaletteFill(s->layer, rainbow, 0, PaletteStep(1));
+    looked_up += MicroTime() - start;
   }
-  else
+
+  // the palette is the same ramps, give or take where they were cut
+  int worst = 0;
+  for(int i = 0; i < num_leds * 3; i++)
   {
-    r1 = RandomColor(128);
-    g1 = RandomColor(128);
-    b1 = RandomColor(128);
-    b2 = RandomColor(128);
-    g2 = RandomColor(128);
-    r2 = RandomColor(128);
+    worst = std::max(worst, abs(s->layer[i] - s->buffer1[i]));
   }
 
-  cout << "Slow Two Color Sparkle\n";
-
-  time_t until = time(0) + num_seconds;
+  printf("rainbow on %d LEDs, %d frames\n", num_leds, PALETTE_BENCH_FRAMES);
+  // both are about a microsecond, so averages rather than percentiles
+  printf("six Fill()    %6.0f ns per frame\n", filled * 1000.0 / PALETTE_BENCH_FRAMES);
+  printf("PaletteFill   %6.0f ns per frame  largest difference %d\n", looked_up * 1000.0 / PALETTE_BENCH_FRAMES, worst);
 
-  while(time(0) < until)
+  const char *blends[] = { "rgb", "hsv", "oklab" };
+  for(int blend = BLEND_RGB; blend <= BLEND_OKLAB; blend++)
   {
-    int pwmnum = rand() % NUM_LEDS;
-
-    if(rand() % 255 > 128)
-    {
-      buffer2[pwmnum*3] = b1;
-      buffer2[pwmnum*3+1] = g1;
-      buffer2[pwmnum*3+2] = r1;
-    }
-    else
+    palette p;
+    uint8_t stops[PALETTE_STOPS][3];
+    int count = PaletteParse(default_palettes[1][2], stops);
+    uint64_t start = MicroTime();
+    for(int j = 0; j < 100; j++)
     {
-      buffer2[pwmnum*3] = b2;
-      buffer2[pwmnum*3+1] = g2;
-      buffer2[pwmnum*3+2] = r2;
+      PaletteBuild(&p, "bench", stops, count, blend);
     }
+    printf("build %-6s %6.1f us per palette\n", blends[blend], (MicroTime() - start) / 100.0);
+  }
 
-    pwmnum = rand() % NUM_LEDS;
-
-    buffer2[pwmnum*3] = 0;
-    buffer2[pwmnum*3+1] = 0;
-    buffer2[pwmnum*3+2] = 0;
+  BenchEffect(19, 2000);
+}
 
-    pwmnum = rand() % NUM_LEDS;
+struct media_bench
+{
+  uint64_t last;
+  vector<uint64_t> times;
+};
 
-    buffer2[pwmnum*3] = 0;
-    buffer2[pwmnum*3+1] = 0;
-    buffer2[pwmnum*3+2] = 0;
+uint8_t MediaBenchSink(void *ctx, const uint8_t *leds, int delay)
+{
+  // time since the last frame came out is what decoding this one took
+  media_bench *b = (media_bench *) ctx;
+  uint64_t now = MicroTime();
+  b->times.push_back(now - b->last);
+  b->last = MicroTime();
+  return 1;
+}
 
-    DisplayBuffer(display_buffer);
-    FadeToBuffer(display_buffer, buffer2, 1);
+void MediaBenchGif(FILE *fh, int width, int height, int frames)
+{
+  /*
+    Writes a test GIF: a 6x6x6 color cube and frames of moving diagonal
+    bands, with LZW codes that never grow past 9 bits (a clear code every
+    254 pixels), which is as slow to decode as GIFs get
+  */
+  fwrite("GIF89a", 1, 6, fh);
+  fputc(width & 255, fh); fputc(width >> 8, fh);
+  fputc(height & 255, fh); fputc(height >> 8, fh);
+  fputc(0xf7, fh); fputc(0, fh); fputc(0, fh);
+  for(int i = 0; i < 256; i++)
+  {
+    fputc((i < 216) ? (i / 36) * 51 : 0, fh);
+    fputc((i < 216) ? ((i / 6) % 6) * 51 : 0, fh);
+    fputc((i < 216) ? (i % 6) * 51 : 0, fh);
+  }
 
-    usleep(20);
-    if(signaled)
+  uint8_t block[255];
+  for(int f = 0; f < frames; f++)
+  {
+    // graphic control extension, 40ms, then the image descriptor
+    const uint8_t gce[] = { 0x21, 0xf9, 4, 0, 4, 0, 0, 0 };
+    fwrite(gce, 1, sizeof(gce), fh);
+    const uint8_t desc[] = { 0x2c, 0, 0, 0, 0, uint8_t(width & 255), uint8_t(width >> 8), uint8_t(height & 255), uint8_t(height >> 8), 0, 8 };
+    fwrite(desc, 1, sizeof(desc), fh);
+
+    uint32_t bits = 0;
+    int nbits = 0, len = 0, run = 0;
+    for(long p = -1; p <= long(width) * height; p++)
     {
-      break;
+      int code;
+      if(p < 0 || run == 254)
+      {
+        code = 256;
+        run = 0;
+        p -= (p >= 0);
+      }
+      else if(p == long(width) * height)
+      {
+        code = 257;
+      }
+      else
+      {
+        int x = p % width, y = p / width;
+        code = ((x + y + f * 2) / 8) % 216;
+        run++;
+      }
+      bits |= uint32_t(code) << nbits;
+      nbits += 9;
+      while(nbits >= 8)
+      {
+        block[len++] = bits & 255;
+        bits >>= 8;
+        nbits -= 8;
+        if(len == 255)
+        {
+          fputc(len, fh);
+          fwrite(block, 1, len, fh);
+          len = 0;
+        }
+      }
+    }
+    if(nbits)
+    {
+      block[len++] = bits & 255;
+    }
+    if(len)
+    {
+      fputc(len, fh);
+      fwrite(block, 1, len, fh);
     }
+    fputc(0, fh);
   }
+  fputc(0x3b, fh);
 }
 
-void RandomTwoColorFade(long num_seconds)
+void MediaBenchPpm(FILE *fh, int width, int height, int frames)
 {
-  uint8_t r1, g1, b1, r2, g2, b2;
-  uint8_t direction = rand() % 2;
-
-  cout << "Random Two Color Fade ";
-  if(direction)
+  // a PPM stream of the same moving bands
+  for(int f = 0; f < frames; f++)
   {
-    cout << "Right\n";
-  }
-  else
-  {
-    cout << "Left\n";
+    fprintf(fh, "P6\n%d %d\n255\n", width, height);
+    for(int y = 0; y < height; y++)
+    {
+      for(int x = 0; x < width; x++)
+      {
+        fputc((x + f) & 255, fh);
+        fputc((y * 2) & 255, fh);
+        fputc((x + y) & 255, fh);
+      }
+    }
   }
+}
 
-  if(p_r1 || p_r2 || p_g1 || p_g2 || p_b1 || p_b2)
+void BenchMediaFile(const char *name, FILE *fh)
+{
+  static media_decoder d;
+  media_bench b;
+
+  rewind(fh);
+  if(!MediaOpen(&d, fh))
   {
-    r1 = p_r1;
-    g1 = p_g1;
-    b1 = p_b1;
-    b2 = p_b2;
-    g2 = p_g2;
-    r2 = p_r2;
+    printf("%-24s not a GIF or PPM, or too big\n", name);
+    return;
   }
-  else
+
+  // a pass to warm up, then one timed
+  b.times.reserve(1 << 16);
+  MediaDecode(&d, MediaBenchSink, &b);
+  b.times.clear();
+  b.last = MicroTime();
+  uint64_t start = b.last;
+  MediaDecode(&d, MediaBenchSink, &b);
+  uint64_t elapsed = MicroTime() - start;
+
+  if(b.times.empty())
   {
-    r1 = RandomColor(128);
-    g1 = RandomColor(128);
-    b1 = RandomColor(128);
-    b2 = RandomColor(128);
-    g2 = RandomColor(128);
-    r2 = RandomColor(128);
+    printf("%-24s no frames decoded\n", name);
+    return;
   }
+  printf("%-24s %4dx%-4d %-9s %5zu frames  p50 %4llu us  p99 %4llu us  mean %6.1f us\n", name, d.width, d.height,
+         d.still ? "rows" : "animation", b.times.size(), (unsigned long long) Percentile(b.times, 50),
+         (unsigned long long) Percentile(b.times, 99), double(elapsed) / b.times.size());
+}
 
-  Fill(display_buffer, 0,321,r1,g1,b1,r2,g2,b2);
-  Fill(display_buffer, 322,645,r2,g2,b2,r1,g1,b1);
-  DisplayBuffer(display_buffer);
-
-  time_t until = time(0) + num_seconds;
+void BenchMedia(const char *file)
+{
+  /*
+    Decode and resample time per LED frame, from reading the file to the
+    LED colors, for a given file or for generated GIF and PPM animations
+    and a GIF sprite sheet
+  */
+  log_level = LOG_ERROR;
+  printf("%d LEDs, budget %d us/frame (%d fps)\n", num_leds, 1000000 / TARGET_FPS, TARGET_FPS);
 
-  while(time(0) < until)
+  if(file)
   {
-    DisplayBuffer(display_buffer);
-    Rotate(display_buffer, direction);
-    usleep(100);
-    if(signaled)
+    FILE *fh = fopen(file, "rb");
+    if(fh == NULL)
     {
-      break;
+      printf("can't read %s\n", file);
+      return;
     }
+    BenchMediaFile(file, fh);
+    fclose(fh);
+    return;
   }
+
+  FILE *fh = tmpfile();
+  MediaBenchGif(fh, 160, 90, MEDIA_BENCH_FRAMES);
+  BenchMediaFile("GIF 160x90", fh);
+  fclose(fh);
+
+  fh = tmpfile();
+  MediaBenchGif(fh, 640, 360, MEDIA_BENCH_FRAMES / 10);
+  BenchMediaFile("GIF 640x360", fh);
+  fclose(fh);
+
+  fh = tmpfile();
+  MediaBenchGif(fh, num_leds, MEDIA_BENCH_FRAMES * 10, 1);
+  BenchMediaFile("GIF sprite sheet", fh);
+  fclose(fh);
+
+  fh = tmpfile();
+  MediaBenchPpm(fh, 160, 90, MEDIA_BENCH_FRAMES);
+  BenchMediaFile("PPM 160x90", fh);
+  fclose(fh);
+
+  fh = tmpfile();
+  MediaBenchPpm(fh, 640, 360, MEDIA_BENCH_FRAMES / 10);
+  BenchMediaFile("PPM 640x360", fh);
+  fclose(fh);
 }
 
-void RedAlert(long num_seconds)
+void BenchPool(void)
 {
-  uint8_t r1, g1, b1, r2, g2, b2;
+  /*
+    Render time per frame of the effects that use the render pool with 1
+    to MAX_RENDER_THREADS threads, each run from the same random seed
+  */
+  const int frames = 1000;
+  effect_state *s = &effect_states[0];
+  int heavy[] = { 8, 9, 15, 16, 17 };
+  uint64_t mismatches = 0;
 
-  cout << "Red Alert\n";
+  log_level = LOG_ERROR;
 
-  if(p_r1 || p_r2 || p_g1 || p_g2 || p_b1 || p_b2)
+  printf("p50/p99 render time per frame in us on %d LEDs\n%-22s", num_leds, "");
+  for(int threads = 1; threads <= MAX_RENDER_THREADS; threads++)
   {
-    r1 = p_r1;
-    g1 = p_g1;
-    b1 = p_b1;
-    b2 = p_b2;
-    g2 = p_g2;
-    r2 = p_r2;
+    printf("  %d thread%s  ", threads, (threads > 1) ? "s" : " ");
   }
-  else
+  printf("\n");
+
+  // the effects, each shader, then a full particle system on its own
+  int rows = sizeof(heavy) / sizeof(int) + shaders.size() + 1;
+  for(int row = 0; row < rows; row++)
   {
-    r1 = RandomColor(128);
-    g1 = RandomColor(128);
-    b1 = RandomColor(128);
-    b2 = RandomColor(128);
-    g2 = RandomColor(128);
-    r2 = RandomColor(128);
-  }
+    int shader = row - sizeof(heavy) / sizeof(int);
+    printf("%-22s", (shader < 0) ? effects[heavy[row]].c_str() :
+           (shader < int(shaders.size())) ? shaders[shader].name : "4096 particles");
 
-  // bottom right
-  SinFade(display_buffer, 0, 0,  170,0,0,0,r1,g1,b1);
-  // top right
-  SinFade(display_buffer, 0, 173,170,0,0,0,r2,g2,b2);
-  // top left
-  SinFade(display_buffer, 0, 346,147,0,0,0,r2,g2,b2);
-  // bottom left
-  SinFade(display_buffer, 0, 496,147,0,0,0,r1,g1,b1);
+    for(int threads = 1; threads <= MAX_RENDER_THREADS; threads++)
+    {
+      vector<uint64_t> times;
+      PoolInit(threads);
+      srand(1);
 
-  DisplayBuffer(display_buffer);
+      if(shader < 0)
+      {
+        EffectInit(s, heavy[row]);
+      }
+      else if(shader < int(shaders.size()))
+      {
+        EffectInit(s, 18);
+        s->shader = &shaders[shader];
+      }
+      else
+      {
+        ParticleClear(&s->particles, 1, 1);
+        for(int i = 0; i < MAX_PARTICLES; i++)
+        {
+          ParticleSpawn(&s->particles, rand() % num_leds, float((rand() % 400) - 200) / 100, 1.5 + rand() % 3, PARTICLE_FOREVER, 100, 100, 100);
+        }
+      }
 
-  time_t until = time(0) + num_seconds;
+      for(int frame = 0; frame < frames; frame++)
+      {
+        uint64_t start = MicroTime();
+        if(shader < int(shaders.size()))
+        {
+          EffectFrame(s);
+        }
+        else
+        {
+          ParticleUpdate(&s->particles);
+          ParticleRender(&s->particles, -1, PARTICLE_ADD, 1, 1);
+          ParticleResolve(&s->particles, s->layer);
+        }
+        times.push_back(MicroTime() - start);
+      }
+      printf("  %4llu/%-5llu", (unsigned long long) Percentile(times, 50), (unsigned long long) Percentile(times, 99));
 
-  while(time(0) < until)
-  {
-    DisplayBuffer(display_buffer);
-    usleep(100);
-    if(signaled)
-    {
-      break;
+      // the chunked particles should draw the same as one thread did
+      if(shader >= int(shaders.size()))
+      {
+        for(int i = 0; i < num_leds * 3; i++)
+        {
+          mismatches += (threads > 1) && (abs(s->layer[i] - s->buffer4[i]) > 1);
+        }
+        memcpy(s->buffer4, s->layer, num_leds * 3);
+      }
     }
+    printf("\n");
   }
+
+  printf("%llu chunks stolen, %llu particle values differ from 1 thread\n", (unsigned long long) pool_steals.load(), (unsigned long long) mismatches);
+  PoolInit(1);
 }
 
-void Rainbow(long num_seconds)
+void BenchJitter(int seconds)
 {
-  uint8_t direction = rand() % 2;
-
-  cout << "Rainbow Cycle ";
-  if(direction)
+  /*
+    Runs Rainbow at TARGET_FPS without touching SPI for a while and reports
+    how late each frame's wake up was, to compare normal and --rt runs with
+    something else loading the Pi
+  */
+  const int budget = 1000000 / TARGET_FPS;
+  int samples = seconds * TARGET_FPS;
+  uint64_t *late = (uint64_t *) malloc(samples * sizeof(uint64_t));
+  effect_state *s = &effect_states[0];
+
+  log_level = LOG_ERROR;
+  bench_output = 1;
+  RtInit();
+  OutputInit();
+  PoolInit(render_threads);
+  RtThread(rt_render_cpu, RT_PRIORITY);
+
+  printf("%s mode, %d frames at %d fps\n", rt_mode ? "real time" : "normal", samples, TARGET_FPS);
+
+  EffectInit(s, 1);
+  uint64_t allocations = frame_allocations.load();
+  in_frame = 1;
+  for(int i = 0; i < samples; i++)
   {
-    cout << "Right\n";
+    uint64_t start = MicroTime();
+    EffectFrame(s);
+    memcpy(display_buffer, s->layer, num_leds * 3);
+    DisplayBuffer(display_buffer);
+
+    uint64_t delay = budget - std::min(MicroTime() - start, uint64_t(budget));
+    uint64_t sleep_start = MicroTime();
+    Sleep(delay);
+    uint64_t slept = MicroTime() - sleep_start;
+    late[i] = slept - std::min(slept, delay);
   }
-  else
+  in_frame = 0;
+
+  vector<uint64_t> sorted(late, late + samples);
+  std::sort(sorted.begin(), sorted.end());
+  printf("wake up late p50 %llu us  p99 %llu us  p99.9 %llu us  max %llu us\n",
+         (unsigned long long) sorted[samples / 2], (unsigned long long) sorted[(samples * 99) / 100],
+         (unsigned long long) sorted[(samples * 999) / 1000], (unsigned long long) sorted[samples - 1]);
+
+  // same buckets as blinkenlights_frame_jitter_seconds
+  for(int b = 0; b < HISTOGRAM_BUCKETS; b++)
   {
-    cout << "Left\n";
+    uint64_t lo = b ? histogram_bounds[b - 1] : 0;
+    uint64_t hi = (b < HISTOGRAM_BUCKETS - 1) ? histogram_bounds[b] : UINT64_MAX;
+    int count = 0;
+    for(int i = 0; i < samples; i++)
+    {
+      count += (sorted[i] > lo || (b == 0 && sorted[i] == 0)) && sorted[i] <= hi;
+    }
+    if(b < HISTOGRAM_BUCKETS - 1)
+    {
+      printf("  <= %6llu us  %6d\n", (unsigned long long) hi, count);
+    }
+    else
+    {
+      printf("   > %6llu us  %6d\n", (unsigned long long) lo, count);
+    }
   }
+  printf("%llu allocations in the frame loop\n", (unsigned long long) (frame_allocations.load() - allocations));
 
-  float inc = NUM_LEDS / 6;
+  free(late);
+}
 
-  Fill(display_buffer, 0,        int(inc),     255,0,  0,    255,255,0);
-  Fill(display_buffer, int(inc), int(inc*2),   255,255,0,    0,  255,0);
-  Fill(display_buffer, int(inc*2), int(inc*3), 0,  255,0,    0,  255,255);
-  Fill(display_buffer, int(inc*3), int(inc*4), 0,  255,255,  0,  0,  255);
-  Fill(display_buffer, int(inc*4), int(inc*5), 0,  0,  255,  255,0,  255);
-  Fill(display_buffer, int(inc*5), (NUM_LEDS-1), 255,0,  255,  255,0,  0);
 
-  DisplayBuffer(display_buffer);
+void BenchSchedule(int events)
+{
+  /*
+    Builds a calendar of events recurring events, one-offs, exceptions and
+    overnight ones, then times compiling it and asking whether the lights
+    are on for every minute of a year, checked against a scan of every
+    occurrence. Occurrences of the BYDAY=1SA,-1FR events are also checked
+    to be on a first Saturday or a last Friday.
+  */
+  const static char *days[] = { "MO", "TU", "WE", "TH", "FR", "SA", "SU" };
+  char *text = NULL;
+  size_t size = 0;
+  FILE *ics = open_memstream(&text, &size);
+  time_t now = time(0);
+  long today = LocalDay(now, NULL);
+  int y, m, d;
 
-  time_t until = time(0) + num_seconds;
+  log_level = LOG_ERROR;
+  srand(1);
 
-  while(time(0) < until)
+  fprintf(ics, "BEGIN:VCALENDAR\r\nVERSION:2.0\r\n");
+  for(int i = 0; i < events; i++)
   {
-    DisplayBuffer(display_buffer);
-    Rotate(display_buffer, direction);
-    usleep(100);
-    if(signaled)
+    CivilFromDays(today - 30 + rand() % 395, &y, &m, &d);
+    int hour = rand() % 24, minutes = 15 * (rand() % 4);
+
+    fprintf(ics, "BEGIN:VEVENT\r\nUID:%d@bench\r\nSUMMARY:Event %d\r\n", i, i);
+    fprintf(ics, "DTSTART:%04d%02d%02dT%02d%02d00\r\n", y, m, d, hour, minutes);
+    fprintf(ics, "DURATION:PT%dM\r\n", 15 + 15 * (rand() % 8));
+    switch(i % 6)
     {
-      break;
+      case 0:
+        fprintf(ics, "RRULE:FREQ=WEEKLY;BYDAY=%s,%s;COUNT=%d\r\n", days[rand() % 7], days[rand() % 7], 4 + rand() % 20);
+        break;
+      case 1:
+        fprintf(ics, "RRULE:FREQ=MONTHLY;BYDAY=%d%s\r\n", (rand() % 2) ? -1 : 1 + rand() % 4, days[rand() % 7]);
+        break;
+      case 2:
+        fprintf(ics, "RRULE:FREQ=DAILY;INTERVAL=%d;COUNT=%d\r\n", 2 + rand() % 5, 10 + rand() % 50);
+        break;
+      case 3:
+        fprintf(ics, "RRULE:FREQ=WEEKLY;INTERVAL=2;UNTIL=%04d1231T235959Z\r\nEXDATE:%04d%02d%02dT%02d%02d00\r\n", y, y, m, d, hour, minutes);
+        break;
+      case 4:
+        // mixed ordinals, each number only goes with its own day
+        fprintf(ics, "RRULE:FREQ=MONTHLY;BYDAY=1SA,-1FR\r\n");
+        break;
     }
+    fprintf(ics, "END:VEVENT\r\n");
   }
-}
+  fprintf(ics, "END:VCALENDAR\r\n");
+  fclose(ics);
 
+  schedule_event e;
+  e.event_name = "bench";
+  e.open_status = "true";
 
-void RainbowSparkles(long num_seconds)
-{
-  uint8_t direction = rand() % 2;
+  uint64_t start = MicroTime();
+  schedule_rules.clear();
+  FILE *fh = fmemopen(text, size, "r");
+  LoadCalendar(fh, &e);
+  fclose(fh);
+  uint64_t parsed = MicroTime();
+  ScheduleCompile(today - 1, today + SCHEDULE_WINDOW);
+  uint64_t compiled = MicroTime();
 
-  uint8_t r1, g1, b1, r2, g2, b2, mixval;
+  printf("%d events, %zu kB of iCalendar: parse %.1f ms, compile %d days %.1f ms, %zu changes\n",
+         events, size / 1024, (parsed - start) / 1000.0, SCHEDULE_WINDOW, (compiled - parsed) / 1000.0, schedule_changes.size());
 
-  if(p_r1 || p_r2 || p_g1 || p_g2 || p_b1 || p_b2)
+  // every minute of the year from today's midnight
+  time_t from = LocalTime(today, 0);
+  const int minutes = 365 * 24 * 60;
+  int on = 0;
+
+  start = MicroTime();
+  for(int i = 0; i < minutes; i++)
   {
-    r1 = p_r1;
-    g1 = p_g1;
-    b1 = p_b1;
-    mixval = REPLACE;
+    on += ScheduleActive(from + i * 60);
   }
-  else
+  uint64_t elapsed = MicroTime() - start;
+  printf("%d minute lookups in %.1f ms, %.0f ns each, on %d%% of the time\n",
+         minutes, elapsed / 1000.0, elapsed * 1000.0 / minutes, on * 100 / minutes);
+
+  int transitions = 0;
+  start = MicroTime();
+  for(time_t t = from; t < from + 365 * 86400; t = NextScheduleChange(t))
   {
-    r1 = 255;
-    g1 = 255;
-    b1 = 255;
-    mixval = HARD_MIX;
+    transitions++;
   }
+  elapsed = MicroTime() - start;
+  printf("%d next transition lookups in %.1f ms\n", transitions, elapsed / 1000.0);
 
-  cout << "Rainbow Sparkles ";
-
-  if(direction)
+  // every occurrence on its own, checked at a spread of minutes
+  vector<std::pair<time_t, int> > edges;
+  for(size_t i = 0; i < schedule_rules.size(); i++)
   {
-    cout << "Right\n";
+    RuleExpand(&schedule_rules[i], i, today - 1, today + 365, &edges);
   }
-  else
+  int wrong = 0, checked = 0;
+  for(int i = 0; i < minutes; i += 97)
   {
-    cout << "Left\n";
+    time_t t = from + i * 60;
+    uint8_t expected = 0;
+    for(size_t j = 0; j < edges.size() && !expected; j += 2)
+    {
+      expected = (t >= edges[j].first && t < edges[j + 1].first);
+    }
+    wrong += (expected != ScheduleActive(t));
+    checked++;
   }
+  printf("%d of %d sampled minutes differ from scanning %zu occurrences\n", wrong, checked, edges.size() / 2);
 
-  float inc = NUM_LEDS / 6;
-
-  Fill(buffer1, 0,        int(inc),     255,0,  0,    255,255,0);
-  Fill(buffer1, int(inc), int(inc*2),   255,255,0,    0,  255,0);
-  Fill(buffer1, int(inc*2), int(inc*3), 0,  255,0,    0,  255,255);
-  Fill(buffer1, int(inc*3), int(inc*4), 0,  255,255,  0,  0,  255);
-  Fill(buffer1, int(inc*4), int(inc*5), 0,  0,  255,  255,0,  255);
-  Fill(buffer1, int(inc*5), (NUM_LEDS-1), 255,0,  255,  255,0,  0);
-
-  DisplayBuffer(display_buffer);
-
-  time_t until = time(0) + num_seconds;
-
-  while(time(0) < until)
+  int misplaced = 0, mixed = 0;
+  for(size_t i = 0; i < schedule_rules.size(); i++)
   {
-    int pwmnum = rand() % NUM_LEDS;
-
-    buffer3[pwmnum*3] = b1;
-    buffer3[pwmnum*3+1] = g1;
-    buffer3[pwmnum*3+2] = r1;
-
-    FadeToBuffer(buffer2, buffer3, 75);
-
-    for(int i = 0 ; i < NUM_LEDS ; i++)
+    if(atoi(schedule_rules[i].uid.c_str()) % 6 != 4)
     {
-      if(buffer2[pwmnum*3] >= (buffer3[pwmnum*3] - 100)
-         && buffer2[pwmnum*3+1] >= (buffer3[pwmnum*3+1] - 100)
-         && buffer2[pwmnum*3+2] >= (buffer3[pwmnum*3+2] - 100) )
-      {
-        buffer3[pwmnum*3] = 0;
-        buffer3[pwmnum*3+1] = 0;
-        buffer3[pwmnum*3+2] = 0;
-      }
+      continue;
     }
-
-    MixBuffers(buffer1, buffer2, display_buffer, mixval);
-
-    DisplayBuffer(display_buffer);
-
-    Rotate(buffer1, direction);
-    usleep(100);
-    if(signaled)
+    vector<std::pair<time_t, int> > occurrences;
+    RuleExpand(&schedule_rules[i], i, today - 1, today + 365, &occurrences);
+    for(size_t j = 0; j < occurrences.size(); j += 2)
     {
-      break;
+      long day = LocalDay(occurrences[j].first, NULL);
+      CivilFromDays(day, &y, &m, &d);
+      int length = DaysFromCivil(y + (m == 12), (m % 12) + 1, 1) - DaysFromCivil(y, m, 1);
+      int wday = Weekday(day);
+      misplaced += !((wday == 6 && d <= 7) || (wday == 5 && d + 7 > length));
+      mixed++;
     }
   }
+  printf("%d of %d BYDAY=1SA,-1FR occurrences not on a first Saturday or last Friday\n", misplaced, mixed);
+
+  free(text);
 }
 
 
-void LavaLamp(long num_seconds)
+time_t ParseDate(const char *text)
 {
-  uint8_t r1, g1, b1, r2, g2, b2;
-  uint8_t blend = rand() % 4 + 1;
-  uint8_t total_blobs = rand() % 7 + 7;
+  // local YYYY-MM-DD with an optional THH:MM or " HH:MM", 0 if it isn't one
+  int y, m, d, h = 0, min = 0;
+  char sep;
 
-  if(p_r1 || p_r2 || p_g1 || p_g2 || p_b1 || p_b2)
-  {
-    r1 = p_r1;
-    g1 = p_g1;
-    b1 = p_b1;
-    b2 = p_b2;
-    g2 = p_g2;
-    r2 = p_r2;
-  }
-  else
+  int fields = sscanf(text, "%d-%d-%d%c%d:%d", &y, &m, &d, &sep, &h, &min);
+  if(fields < 3 || (fields > 3 && fields != 6) || m < 1 || m > 12 || d < 1 || d > 31)
   {
-    r1 = std::max(RandomColor(128), RandomColor(128));
-    g1 = RandomColor(128);
-    b1 = RandomColor(128);
-    r2 = RandomColor(128);
-    g2 = RandomColor(128);
-    b2 = RandomColor(128);
+    return 0;
   }
+  return LocalTime(DaysFromCivil(y, m, d), h * 3600 + min * 60);
+}
 
-  cout << "Lava Lamp\n";
-
-  // seven blobs
-  // position, color, size, direction
-  float blobs[56];
+int SimulateSchedule(const char *from_text, const char *to_text)
+{
+  /*
+    Prints every time the lights go on or off, the shop opens or closes or
+    an event picks the effect between two dates according to schedule.conf,
+    straight from the compiled change list, to check an edited schedule
+    before it goes live
+  */
+  time_t from = ParseDate(from_text);
+  time_t to = ParseDate(to_text);
+  char when[64];
 
-  for(int i=0 ; i < total_blobs ; i++)
+  if(!from || !to || to <= from)
   {
-    blobs[i*4] = rand() % NUM_LEDS;
-    blobs[i*4+1] = rand() % 2;
-    blobs[i*4+2] = rand() % 80 + 10;
-    blobs[i*4+3] = float((rand() % 150)-75)/100;
+    fprintf(stderr, "--simulate-schedule needs two dates, YYYY-MM-DD[THH:MM], the second later\n");
+    return(1);
   }
 
-  time_t until = time(0) + num_seconds;
+  FILE *fh = fopen("schedule.conf", "r");
+  if(fh == NULL)
+  {
+    fprintf(stderr, "can't read schedule.conf\n");
+    return(1);
+  }
+  fclose(fh);
 
-  while(time(0) < until)
+  uint64_t start = MicroTime();
+  LoadSchedule();
+  uint64_t loaded = MicroTime();
+  // events it had to leave out, there's no log thread to print them
+  LogDrain();
+
+  uint8_t on = ScheduleActive(from);
+  uint8_t open = ScheduleOpen(from);
+  const schedule_change *first = ScheduleLookup(from);
+  uint16_t rule = first ? first->effect_rule : 0;
+  time_t since = from;
+  long on_seconds = 0, open_seconds = 0;
+  int changes = 0;
+
+  strftime(when, sizeof(when), "%a %Y-%m-%d %H:%M", localtime(&from));
+  printf("%s  lights %-3s  shop %s\n", when, on ? "on" : "off", open ? "open" : "closed");
+
+  // walk the change list, moving the window on when it runs out
+  time_t t = from;
+  while(t < to)
   {
-    // clear work buffers
-    for(int i=0 ; i < NUM_LEDS * 3 ; i++)
-    {
-      buffer1[i] = 0;
-      buffer2[i] = 0;
-    }
+    ScheduleLookup(t);
+    schedule_change key = { t, 0, 0, 0 };
+    vector<schedule_change>::const_iterator it = std::upper_bound(schedule_changes.begin(), schedule_changes.end(), key,
+      [](const schedule_change &a, const schedule_change &b) { return a.at < b.at; });
 
-    // process blobs
-    for(int i=0 ; i < total_blobs ; i++)
+    for(; it != schedule_changes.end() && it->at < schedule_end && it->at < to; it++)
     {
-      // move blob
-      blobs[i*4] = blobs[i*4] + blobs[i*4+3];
-      if(blobs[i*4] < 0)
-      {
-        blobs[i*4] = blobs[i*4] + NUM_LEDS;
-      }
-      if(blobs[i*4] > NUM_LEDS)
+      on_seconds += on ? it->at - since : 0;
+      open_seconds += open ? it->at - since : 0;
+      since = it->at;
+
+      strftime(when, sizeof(when), "%a %Y-%m-%d %H:%M", localtime(&it->at));
+      if(it->on != on)
       {
-        blobs[i*4] = blobs[i*4] - NUM_LEDS;
+        printf("%s  lights %s\n", when, it->on ? "on" : "off");
+        changes++;
       }
-
-      // adjust blob size
-      blobs[i*4+2] = blobs[i*4+2] + ((rand() % 100)-50)/100;
-
-      // paint blob
-      if(blobs[i*4+1])
+      if(it->open != open)
       {
-        SinFade(buffer1, 1, int(blobs[i*4]), int(blobs[i*4+2]), 0,0,0,r1,g1,b1);
+        printf("%s  shop %s\n", when, it->open ? "open" : "closed");
+        changes++;
       }
-      else
+      if(it->effect_rule != rule)
       {
-        SinFade(buffer2, 1, int(blobs[i*4]), int(blobs[i*4+2]), 0,0,0,r2,g2,b2);
+        const schedule_rule *r = it->effect_rule ? &schedule_rules[it->effect_rule - 1] : NULL;
+        printf("%s  effect %s%s%s\n", when, r ? effects[r->effect].c_str() : "random",
+               (r && r->media != "") ? " " : "", r ? r->media.c_str() : "");
+        changes++;
       }
+      on = it->on;
+      open = it->open;
+      rule = it->effect_rule;
     }
-
-    MixBuffers(buffer1, buffer2, display_buffer, blend);
-    DisplayBuffer(display_buffer);
-
-    usleep(100);
-    if(signaled)
-    {
-      break;
-    }
+    t = std::max(schedule_end, t + 1);
   }
-}
+  on_seconds += on ? to - since : 0;
+  open_seconds += open ? to - since : 0;
 
-void ColorOrgan(long num_seconds)
-{
-  uint8_t r1, g1, b1, r2, g2, b2, r3, b3, g3;
-  uint8_t blend = MAX;
-  uint8_t total_blobs = 3;
+  uint64_t elapsed = MicroTime() - start;
+  printf("%d changes in %.1f days, lights on %.1f h, shop open %.1f h\n",
+         changes, (to - from) / 86400.0, on_seconds / 3600.0, open_seconds / 3600.0);
+  fprintf(stderr, "%zu rules, read in %.1f ms, simulated in %.1f ms\n",
+          schedule_rules.size(), (loaded - start) / 1000.0, (elapsed - (loaded - start)) / 1000.0);
 
-  if(p_r1 || p_r2 || p_g1 || p_g2 || p_b1 || p_b2)
-  {
-    r1 = p_r1;
-    g1 = p_g1;
-    b1 = p_b1;
-    b2 = p_b2;
-    g2 = p_g2;
-    r2 = p_r2;
-    r3 = RandomColor(128);
-    g3 = RandomColor(128);
-    b3 = RandomColor(128);
-  }
-  else
-  {
-    r1 = 255;
-    g1 = 0;
-    b1 = 0;
-    r2 = 0;
-    g2 = 255;
-    b2 = 0;
-    r3 = 0;
-    g3 = 0;
-    b3 = 255;
-  }
+  return(0);
+}
 
-  cout << "Color Organ\n";
 
-  // seven blobs
-  // position, color, size, direction
-  float blobs[16];
+// main function
 
-  for(int i=0 ; i < total_blobs ; i++)
-  {
-    // location
-    blobs[i*4] = rand() % NUM_LEDS;
-    // layer
-    blobs[i*4+1] = i + 1;
-    // size
-    blobs[i*4+2] = rand() % 20 + (NUM_LEDS / 4);
-    // speed
-    blobs[i*4+3] = float((rand() % 150)-75)/100;
-  }
+int main(int argc, char *argv[])
+{
+  LogInit();
+  TriggerInit();
+  LoadLayout();
+  LoadShaders();
+  LoadPalettes();
+  srand (time(NULL));
 
-  time_t until = time(0) + num_seconds;
+  const char *audio_input = NULL;
+  int http_port = HTTP_PORT;
+#ifdef SIMULATOR
+  int sim_effect = 0;
+#endif
 
-  while(time(0) < until)
+  for(int i = 1; i < argc; i++)
   {
-    // clear work buffers
-    for(int i=0 ; i < NUM_LEDS * 3 ; i++)
+    if(strcmp(argv[i], "--bench-transitions") == 0)
     {
-      buffer1[i] = 0;
-      buffer2[i] = 0;
-      buffer3[i] = 0;
-      buffer4[i] = 0;
+      BenchTransitions();
+      return(0);
     }
-
-    // process blobs
-    for(int i=0 ; i < total_blobs ; i++)
+    else if(strcmp(argv[i], "--bench-audio") == 0)
+    {
+      BenchAudio((i + 1 < argc) ? argv[i + 1] : "synth");
+      return(0);
+    }
+    else if(strcmp(argv[i], "--bench-http") == 0)
+    {
+      BenchHttp((i + 1 < argc) ? atoi(argv[i + 1]) : 4);
+      return(0);
+    }
+    else if(strcmp(argv[i], "--trigger-transition") == 0 && i + 1 < argc)
+    {
+      trigger_transition = atoi(argv[++i]);
+    }
+    else if(strcmp(argv[i], "--gamma") == 0 && i + 1 < argc)
+    {
+      output_gamma = atof(argv[++i]);
+    }
+    else if(strcmp(argv[i], "--dimmer") == 0 && i + 1 < argc)
+    {
+      output_dimmer = atof(argv[++i]);
+    }
+    else if(strcmp(argv[i], "--color-balance") == 0 && i + 1 < argc)
+    {
+      // given as red,green,blue, kept in buffer order
+      sscanf(argv[++i], "%f,%f,%f", &output_balance[2], &output_balance[1], &output_balance[0]);
+    }
+    else if(strcmp(argv[i], "--no-hdr") == 0)
+    {
+      output_hdr = 0;
+    }
+    else if(strcmp(argv[i], "--power-budget") == 0 && i + 1 < argc)
+    {
+      power_budget = atof(argv[++i]);
+    }
+    else if(strcmp(argv[i], "--bench-power") == 0)
+    {
+      BenchPower();
+      return(0);
+    }
+    else if(strcmp(argv[i], "--no-dither") == 0)
+    {
+      output_dither = 0;
+    }
+    else if(strcmp(argv[i], "--rt") == 0)
+    {
+      rt_mode = 1;
+    }
+    else if(strcmp(argv[i], "--rt-cpus") == 0 && i + 1 < argc)
+    {
+      sscanf(argv[++i], "%d,%d", &rt_render_cpu, &rt_transmit_cpu);
+    }
+    else if(strcmp(argv[i], "--bench-jitter") == 0)
+    {
+      BenchJitter((i + 1 < argc) ? atoi(argv[i + 1]) : JITTER_BENCH_SECONDS);
+      return(0);
+    }
+    else if(strcmp(argv[i], "--simulate-schedule") == 0 && i + 2 < argc)
+    {
+      return(SimulateSchedule(argv[i + 1], argv[i + 2]));
+    }
+    else if(strcmp(argv[i], "--bench-schedule") == 0)
+    {
+      BenchSchedule((i + 1 < argc) ? atoi(argv[i + 1]) : SCHEDULE_BENCH_EVENTS);
+      return(0);
+    }
+    else if(strcmp(argv[i], "--bench-pool") == 0)
+    {
+      BenchPool();
+      return(0);
+    }
+    else if(strcmp(argv[i], "--render-threads") == 0 && i + 1 < argc)
+    {
+      render_threads = atoi(argv[++i]);
+    }
+    else if(strcmp(argv[i], "--bench-shader") == 0)
+    {
+      BenchShader();
+      return(0);
+    }
+    else if(strcmp(argv[i], "--bench-palette") == 0)
+    {
+      BenchPalette();
+      return(0);
+    }
+    else if(strcmp(argv[i], "--bench-media") == 0)
+    {
+      BenchMedia((i + 1 < argc) ? argv[i + 1] : NULL);
+      return(0);
+    }
+    else if(strcmp(argv[i], "--media") == 0 && i + 1 < argc)
+    {
+      // what Playback shows when the schedule doesn't name a file
+      snprintf(media_path, sizeof(media_path), "%s", argv[++i]);
+    }
+    else if(strcmp(argv[i], "--shader") == 0 && i + 1 < argc)
+    {
+      // run just this one expression as the Shader effect
+      shaders.clear();
+      ShaderAdd("command line", argv[++i]);
+    }
+    else if(strcmp(argv[i], "--bench-particles") == 0)
+    {
+      BenchParticles();
+      return(0);
+    }
+    else if(strcmp(argv[i], "--bench-spatial") == 0)
+    {
+      BenchSpatial();
+      return(0);
+    }
+    else if(strcmp(argv[i], "--bench-dither") == 0)
     {
-      // move blob
-      blobs[i*4] = blobs[i*4] + blobs[i*4+3];
-      if(blobs[i*4] < 0)
+      BenchDither();
+      return(0);
+    }
+    else if(strcmp(argv[i], "--bench-outputs") == 0)
+    {
+      BenchOutputs();
+      return(0);
+    }
+    else if(strcmp(argv[i], "--bench-trigger") == 0)
+    {
+      BenchTrigger();
+      return(0);
+    }
+    else if(strcmp(argv[i], "--audio") == 0 && i + 1 < argc)
+    {
+      audio_input = argv[++i];
+    }
+    else if(strcmp(argv[i], "--http") == 0 && i + 1 < argc)
+    {
+      http_port = atoi(argv[++i]);
+    }
+    else if(strcmp(argv[i], "--shm-demo") == 0)
+    {
+      ShmDemo();
+      return(0);
+    }
+#ifdef SIMULATOR
+    else if(strcmp(argv[i], "--sim-fast") == 0)
+    {
+      sim_fast = 1;
+    }
+    else if(strcmp(argv[i], "--sim-ansi") == 0)
+    {
+      sim_ansi = 1;
+    }
+    else if(strcmp(argv[i], "--sim-ppm") == 0 && i + 1 < argc)
+    {
+      sim_ppm = fopen(argv[++i], "wb");
+      if(sim_ppm == NULL)
       {
-        blobs[i*4] = blobs[i*4] + NUM_LEDS;
+        fprintf(stderr, "can't write %s\n", argv[i]);
+        return(1);
       }
-      if(blobs[i*4] > NUM_LEDS)
+      SimWritePPMHeader();
+    }
+    else if(strcmp(argv[i], "--sim-seconds") == 0 && i + 1 < argc)
+    {
+      sim_end = atol(argv[++i]) * 1000000;
+    }
+    else if(strcmp(argv[i], "--sim-effect") == 0 && i + 1 < argc)
+    {
+      i++;
+      for(int e = 1; e < EFFECTS; e++)
       {
-        blobs[i*4] = blobs[i*4] - NUM_LEDS;
+        if(effects[e] == argv[i])
+        {
+          sim_effect = e;
+        }
       }
-
-      // adjust blob size
-      blobs[i*4+2] = blobs[i*4+2] + ((rand() % 100)-50)/100;
-
-      // paint blob
-      switch(int (blobs[i*4+1]))
+      if(!sim_effect)
       {
-      case 1:
-        SinFade(buffer1, 0, int(blobs[i*4]), int(blobs[i*4+2]), 0,0,0,r1,g1,b1);
-        break;
-      case 2:
-        SinFade(buffer2, 0, int(blobs[i*4]), int(blobs[i*4+2]), 0,0,0,r2,g2,b2);
-        break;
-      case 3:
-        SinFade(buffer3, 0, int(blobs[i*4]), int(blobs[i*4+2]), 0,0,0,r3,g3,b3);
-        break;
+        fprintf(stderr, "unknown effect %s\n", argv[i]);
+        return(1);
       }
     }
-
-    MixBuffers(buffer1, buffer2, buffer4, blend);
-    MixBuffers(buffer4, buffer3, display_buffer, blend);
-    DisplayBuffer(display_buffer);
-
-    usleep(100);
-    if(signaled)
+#endif
+    else
     {
-      break;
+      fprintf(stderr, "unknown option %s\n", argv[i]);
+      return(1);
     }
   }
-}
 
+  int current_effect = 0;
+  int next_effect = 0;
 
-void RandomWhite(long num_seconds)
-{
-  cout << "Random White\n";
+#ifdef SIMULATOR
+  // simulated time starts now, --sim-seconds counts from here
+  sim_clock = uint64_t(time(0)) * 1000000;
+  sim_end = sim_end ? (sim_end + sim_clock) : 0;
+  uint64_t sim_start = MicroTime();
+  uint64_t sim_clock_start = sim_clock;
+#endif
 
-  uint8_t r1, g1, b1, r2, g2, b2;
+  void(*prev_handler)(int);
+  prev_handler = signal(SIGUSR1, signalHandler);
+  prev_handler = signal(SIGINT, signalHandler);
+  prev_handler = signal(SIGRTMIN, signalHandler);
 
-  if(p_r1 || p_r2 || p_g1 || p_g2 || p_b1 || p_b2)
-  {
-    r1 = p_r1;
-    g1 = p_g1;
-    b1 = p_b1;
-  }
-  else
+  wiringPiSetup();
+  RtInit();
+  OutputInit();
+  PoolInit(render_threads);
+  pinMode(2, OUTPUT);
+
+#ifdef TRACING
+  // SIGUSR2 is only ever picked up by the trace dump thread
+  sigset_t trace_mask;
+  sigemptyset(&trace_mask);
+  sigaddset(&trace_mask, SIGUSR2);
+  pthread_sigmask(SIG_BLOCK, &trace_mask, NULL);
+  std::thread(TraceThread).detach();
+#endif
+
+  std::thread(LogThread).detach();
+  std::thread(MetricsThread).detach();
+  std::thread(MediaThread).detach();
+
+  static audio_source audio;
+  if(audio_input && AudioOpen(audio_input, &audio))
   {
-    r1 = 255;
-    g1 = 255;
-    b1 = 255;
+    std::thread(AudioThread, &audio).detach();
   }
 
-  time_t until = time(0) + num_seconds;
+  ShmInit();
 
-  while(time(0) < until)
+  if(http_port)
   {
-    int pwmnum = rand() % NUM_LEDS;
-
-    display_buffer[pwmnum*3] = b1;
-    display_buffer[pwmnum*3+1] = g1;
-    display_buffer[pwmnum*3+2] = r1;
-
-    DisplayBuffer(display_buffer);
-    FadeBuffer(display_buffer, FADE_VAL);
-    usleep(20);
-    if(signaled)
+    int fd = HttpListen(INADDR_ANY, http_port);
+    if(fd >= 0)
     {
-      break;
+      std::thread(HttpThread, fd).detach();
+    }
+    else
+    {
+      LOG(LOG_WARN, "Failed to listen on port %d", http_port);
     }
   }
-}
-
-
-// main function
-
-int main()
-{
-  srand (time(NULL));
-
-  int current_effect = 0;
-  int next_effect = 0;
-
-  void(*prev_handler)(int);
-  prev_handler = signal(SIGUSR1, signalHandler);
-  prev_handler = signal(SIGINT, signalHandler);
-
-  wiringPiSetup();
-  if(wiringPiSPISetup(0, SPI_SPEED) < 0) {
-    std::cerr << "wiringPiSPISetup failed" << std::endl;
-  }
-  pinMode(2, OUTPUT);
 
+  // last, so the helper threads above stay ordinary threads
+  RtThread(rt_render_cpu, RT_PRIORITY);
 
   uint8_t led_frame[4];
   uint8_t r, g, b, brightness;
@@ -1450,39 +9892,62 @@ int main()
   brightness = 7;
 
   // set frame display_buffer
-  for(int i = 0; i < NUM_LEDS; i++)
+  for(int i = 0; i < num_leds; i++)
+  {
+    display_buffer[i*3] = b;
+    display_buffer[i*3+1] = g;
+    display_buffer[i*3+2] = r;
+  }
+
+  // random order LEDs switch over in during a dissolve
+  for(int i = 0; i < num_leds; i++)
   {
-    display_buffer[i*4] = b;
-    display_buffer[i*4+1] = g;
-    display_buffer[i*4+2] = r;
+    dissolve_order[i] = rand() % 256;
   }
 
   // main loop
   while(signaled != 2)
   {
+    if(signaled)
+    {
+      LOG(LOG_INFO, "signal: %d", signaled);
+    }
     signaled = 0;
 
     while(!signaled)
     {
-      time_t now = time(0);
-      struct tm * p = localtime(&now);
-      char s[100];
-      strftime(s, 100, "%c",p);
-      printf("%s: ", s);
+      time_t now = Now();
+
+      if(ShmProducer())
+      {
+        // an external producer takes over the strip until it detaches
+        WakeOutput();
+        digitalWrite(2, 1);
+        RunExternal();
+        continue;
+      }
+
+      InSemaphor();
+      uint8_t swiped = TriggerCollect();
+
+      uint32_t effect_time = EFFECT_DELAY;
+      int transition_frames = TRANSITION_FRAMES;
 
-      lights_on = InSchedule();
-      lights_on |= InSemaphor();
+      // a personal effect doesn't need the schedule, so a swipe goes straight
+      // to the next frame with only a short transition
+      uint8_t personal = PersonalTurn(&current_effect, &next_effect, &effect_time, swiped);
 
-      if(now < personal_effect_until)
+      if(personal)
       {
-        while(next_effect == current_effect)
+        if(swiped)
         {
-          next_effect = (EFFECTS - CUSTOM_EFFECTS) + (rand() % (CUSTOM_EFFECTS));
+          transition_frames = trigger_transition;
         }
-        current_effect = next_effect;
       }
       else
       {
+        lights_on = InSchedule();
+
         // clear personal custom colors if set
         p_r1 = 0;
         p_g1 = 0;
@@ -1491,12 +9956,26 @@ int main()
         p_g2 = 0;
         p_b2 = 0;
 
-        if(lights_on)
+        const schedule_rule *scheduled = lights_on ? ScheduleEffect(Now()) : NULL;
+
+        if(scheduled)
+        {
+          // the event names the effect, and the same media carries on
+          // without a transition
+          snprintf(media_path, sizeof(media_path), "%s", scheduled->media.c_str());
+          next_effect = scheduled->effect;
+          if(next_effect == current_effect && next_effect == PLAYBACK_EFFECT)
+          {
+            transition_frames = 0;
+          }
+          current_effect = next_effect;
+        }
+        else if(lights_on)
         {
           // if we're on, pick a random effect different than the last one displayed
-          while(next_effect == current_effect)
+          while(next_effect == current_effect || next_effect >= RANDOM_EFFECTS)
           {
-            next_effect = 1 + (rand() % (EFFECTS - 1));
+            next_effect = 1 + (rand() % (RANDOM_EFFECTS - 1));
           }
           current_effect = next_effect;
         }
@@ -1509,84 +9988,62 @@ int main()
       }
 
       //current_effect = 11;
+#ifdef SIMULATOR
+      if(sim_effect)
+      {
+        current_effect = sim_effect;
+      }
+#endif
 
       // display the current effect
       switch(current_effect)
       {
         case 0:
-          // lights out
-          cout << "- wait -" << endl;
-          digitalWrite(2, 0);
-          FadeOut();
-          WaitUntil(WAIT_DELAY);
-          break;
-        /* non-customizable effects */
-        case 1:
-          digitalWrite(2, 1);
-          Rainbow(EFFECT_DELAY);
-          FadeOut();
-          break;
-        case 2:
-          digitalWrite(2, 1);
-          Sparkle(EFFECT_DELAY);
-          FadeOut();
-          break;
-        /* customizable effects */
-        case 3:
-          digitalWrite(2, 1);
-          RandomWhite(EFFECT_DELAY);
-          FadeOut();
-          break;
-        case 4:
-          digitalWrite(2, 1);
-          RandomTwoColorFade(EFFECT_DELAY);
-          FadeOut();
-          break;
-        case 5:
-          digitalWrite(2, 1);
-          RandomTwoColorSparkle(EFFECT_DELAY);
-          FadeOut();
-          break;
-        case 6:
-          digitalWrite(2, 1);
-          RedAlert(EFFECT_DELAY);
-          FadeOut();
-          break;
-        case 7:
-          digitalWrite(2, 1);
-          RainbowSparkles(EFFECT_DELAY);
-          FadeOut();
-          break;
-        case 8:
-          digitalWrite(2, 1);
-          LavaLamp(EFFECT_DELAY);
-          FadeOut();
-          break;
-        case 9:
-          digitalWrite(2, 1);
-          ColorOrgan(EFFECT_DELAY);
-          FadeOut();
+          // lights out, transition the last effect to black then sleep
+          LOG(LOG_INFO, "- wait -");
+          if(!output_idle)
+          {
+            RunEffect(0, 0, TRANSITION_FRAMES);
+            IdleOutput();
+          }
+          Idle();
           break;
-        case 10:
-          digitalWrite(2, 1);
-          SlowSparkle(EFFECT_DELAY);
-          FadeOut();
+        case EFFECTS:
+          digitalWrite(2, 0);
+          LOG(LOG_ERROR, "no effect defined");
           break;
-        case 11:
+        default:
+          WakeOutput();
           digitalWrite(2, 1);
-          SlowTwoColorSparkle(EFFECT_DELAY);
-          FadeOut();
-          break;
-        case 12:
-          digitalWrite(2, 0);
-          cout << "error no effect defined\n";
+          RunEffect(current_effect, effect_time, transition_frames);
           break;
       }
+
+      if(personal)
+      {
+        TriggerRotate(Now() - now);
+      }
     }
   }
 
   // make sure the lights are off
   FadeOut();
+  shm_unlink(SHM_NAME);
+  LOG(LOG_INFO, "signal: %d, exiting", signaled);
+  LogDrain();
+
+#ifdef SIMULATOR
+  SimClose();
+  double wall = (MicroTime() - sim_start) / 1e6;
+  printf("simulator: %llu frames in %.3f s wall time, %.0f fps", (unsigned long long) sim_frames, wall,
+         sim_frames / std::max(wall, 1e-6));
+  if(sim_fast)
+  {
+    double simulated = (sim_clock - sim_clock_start) / 1e6;
+    printf(", %.1f s simulated (%.0fx real time)", simulated, simulated / std::max(wall, 1e-6));
+  }
+  printf("\n");
+#endif
   return(0);
 }
 
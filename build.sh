@@ -1,6 +1,22 @@
 #!/bin/bash
 
-gcc bl_siguser1.c -o bl_siguser1
+# ./build.sh [trace] [alsa] [sim] [split]
+#   trace   builds with frame stage tracing compiled in
+#   alsa    builds with ALSA capture for --audio
+#   sim     builds blinkenlights-sim, with a virtual strip instead of wiringPi
+#   split   drives the strip as two halves from SPI0 and SPI1 in parallel
+DEFINES=""
+LIBS="-lwiringPi"
+TARGET="blinkenlights"
+for opt in "$@"; do
+  case $opt in
+    trace) DEFINES="$DEFINES -DTRACING" ;;
+    alsa)  DEFINES="$DEFINES -DUSE_ALSA"; LIBS="$LIBS -lasound" ;;
+    split) DEFINES="$DEFINES -DSPLIT_OUTPUTS" ;;
+    sim)   DEFINES="$DEFINES -DSIMULATOR"; LIBS="${LIBS/-lwiringPi/}"; TARGET="blinkenlights-sim" ;;
+  esac
+done
 
-g++ blinkenlights.cpp -o blinkenlights -lwiringPi -lyaml
+gcc bl_siguser1.c -o bl_siguser1
 
+g++ -O2 $DEFINES blinkenlights.cpp -o $TARGET -lyaml -pthread $LIBS
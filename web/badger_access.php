@@ -11,14 +11,19 @@ file_put_contents('log.txt', $data, FILE_APPEND);
 
 $colors = explode(",", $color);
 
-$data = "";
+// one file per swipe so swipes close together queue up instead of
+// overwriting each other, first line is the user
+$data = "$user\n";
 foreach($colors as $key => $value)
 {
   $data .= "$value\n";
 }
 
-file_put_contents('bl_semaphor/outfile.txt', $data);
-chmod('bl_semaphor/outfile.txt', 0664);
+// written as a dot file and renamed so blinkenlights never reads half a file
+$name = uniqid("", true);
+file_put_contents("bl_semaphor/.$name", $data);
+chmod("bl_semaphor/.$name", 0664);
+rename("bl_semaphor/.$name", "bl_semaphor/$name.txt");
 
 exec("/usr/local/bin/bl_sigusr1");
 